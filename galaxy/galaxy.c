@@ -30,6 +30,10 @@
 #  include <unistd.h>
 #endif
 
+#if HAVE_STRING_H
+#  include <string.h>
+#endif
+
 #if HAVE_PTHREAD_H
 #  include <pthread.h>
 #endif
@@ -99,6 +103,8 @@ print_mask(int mask)
     fprintf(stderr, "CREATE ");
   if (mask & IN_DELETE_SELF)
     fprintf(stderr, "DELETE_SELF ");
+  if (mask & GAL_RESCAN)
+    fprintf(stderr, "RESCAN ");
   if (mask & IN_UNMOUNT)
     fprintf(stderr, "UNMOUNT ");
   if (mask & IN_Q_OVERFLOW)
@@ -179,8 +185,48 @@ receive_notifications(void *arg)
 			err_msg("warning[receive_notifications]: gevent is NULL!");
 		}
 
-		err_msg("gevent->mask = %d gevent->name = %s gvent->timestamp = %d\n",
-			gevent->mask, gevent->name, gevent->timestamp);
+		err_msg("gevent->mask = %d gevent->name = %s gvent->timestamp = %d gevent->pid = %d\n",
+			gevent->mask, gevent->name, gevent->timestamp, (int)gevent->pid);
+		if (gevent->old_name != NULL)
+			err_msg("gevent->old_name = %s\n", gevent->old_name);
+		if (gevent->sequence != 0)
+			err_msg("gevent->sequence = %llu gevent->realtime_ns = %llu\n",
+				(unsigned long long)gevent->sequence,
+				(unsigned long long)gevent->realtime_ns);
+		if (gevent->stat.fields & GALAXY_STAT_SIZE)
+			err_msg("gevent->stat.size = %llu\n",
+				(unsigned long long)gevent->stat.size);
+		if (gevent->digest_len != 0) {
+			char hex[2 * GALAXY_DIGEST_LENGTH + 1];
+			uint32_t i;
+
+			for (i = 0; i < gevent->digest_len; i++)
+				sprintf(hex + 2 * i, "%02x", gevent->digest[i]);
+			err_msg("gevent->digest = %s\n", hex);
+		}
+		if (gevent->tail_len != 0 || gevent->tail_flags != 0)
+			err_msg("gevent->tail_offset = %llu gevent->tail_len = %u gevent->tail_flags = 0x%x\n",
+				(unsigned long long)gevent->tail_offset, gevent->tail_len,
+				gevent->tail_flags);
+		if (gevent->summary_events != 0) {
+			const char *name;
+			uint32_t i;
+
+			err_msg("gevent->summary_events = %u over %llu ns:",
+				gevent->summary_events,
+				(unsigned long long)(gevent->summary_last_ns -
+				                     gevent->summary_first_ns));
+			for (i = 0; i < GALAXY_SUMMARY_BITS; i++) {
+				if (gevent->summary_counts[i] != 0)
+					err_msg(" 0x%x=%u", 1u << i, gevent->summary_counts[i]);
+			}
+			err_msg("\n");
+			name = gevent->summary_names;
+			for (i = 0; i < gevent->summary_nnames; i++) {
+				err_msg("  %s\n", name);
+				name += strlen(name) + 1;
+			}
+		}
 		print_mask(gevent->mask);
 	}
 
@@ -0,0 +1,299 @@
+/*
+ * Galaxy - A filesystem monitoring tool.
+ * Copyright (C) 2005  Gabriel Munoz <gabriel@xusia.net>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ */
+
+/*
+ * Coalesces repeated events for subscriptions that ask for it
+ * (GAL_COALESCE). Writing a large file raises an IN_MODIFY for every
+ * write(2); instead of sending each one, the first event on a path
+ * opens a window during which later events on the same path, for the
+ * same client, are or-ed into it. The merged event is sent when the
+ * window closes.
+ *
+ * Every entry is held for the same window, so entries expire in the
+ * order they were created and a FIFO is all the flusher needs.
+ */
+
+#if HAVE_CONFIG_H
+#  include <config.h>
+#endif
+
+#if HAVE_STDLIB_H
+#  include <stdlib.h>
+#endif
+
+#include <time.h>
+
+#if HAVE_STRING_H
+#  include <string.h>
+#endif
+
+#if HAVE_PTHREAD_H
+#  include <pthread.h>
+#endif
+
+#if HAVE_ERRNO_H
+#  include <errno.h>
+#endif
+
+#if HAVE_LIBGLIB_2_0
+#  include <glib.h>
+#endif
+
+#include "coalesce.h"
+#include "thread.h"
+#include "watch.h"
+#include "galaxy.h"
+#include "list.h"
+#include "error.h"
+
+/* Past this many held events new ones are sent right away. */
+#define COALESCE_MAX_PENDING 65536
+
+/* Events held for one client and path. */
+struct pending_t {
+	struct timespec deadline;  /* CLOCK_MONOTONIC. */
+	struct galaxy_event_t event;  /* Merged; its name is `path'. */
+	char *path;                /* Points into `client'. */
+	char client[1];
+} pending_t;
+
+static unsigned int window_ms = 0;
+
+static pthread_mutex_t coalesce_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t coalesce_cond;
+static GHashTable *pending = NULL;  /* Of struct pending_t, by itself. */
+static list_t *fifo = NULL;         /* The same entries, oldest first. */
+
+static guint
+pending_hash(gconstpointer key)
+{
+	const struct pending_t *p = key;
+
+	return g_str_hash(p->client) * 31 + g_str_hash(p->path);
+}
+
+static gboolean
+pending_equal(gconstpointer a, gconstpointer b)
+{
+	const struct pending_t *p = a, *q = b;
+
+	return strcmp(p->path, q->path) == 0 && strcmp(p->client, q->client) == 0;
+}
+
+static struct pending_t *
+create_pending(const char *client_name, const struct galaxy_event_t *gevent)
+{
+	struct pending_t *p;
+	size_t len;
+
+	len = strlen(client_name);
+	p = malloc(sizeof(struct pending_t) + len + 1 + strlen(gevent->name));
+	if (p == NULL) {
+		err_malloc(errno);
+		return NULL;
+	}
+	memcpy(p->client, client_name, len + 1);
+	p->path = p->client + len + 1;
+	strcpy(p->path, gevent->name);
+	/* Keeps the stamp of the first event, so that the time it was held
+	 * shows, and the stat of the latest. */
+	p->event = *gevent;
+	p->event.name = p->path;
+	p->event.old_name = NULL;
+
+	return p;
+}
+
+/*
+ * Sets the coalescing window to `window' milliseconds; zero sends every
+ * event as it comes, even for subscriptions that asked for coalescing.
+ */
+int
+init_coalesce(unsigned int window)
+{
+	pthread_condattr_t attr;
+
+	window_ms = window;
+	if (window_ms == 0)
+		return 0;
+
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&coalesce_cond, &attr);
+	pthread_condattr_destroy(&attr);
+
+	pending = g_hash_table_new(pending_hash, pending_equal);
+	fifo = list_create(free);
+	if (fifo == NULL) {
+		err_msg("error[init_coalesce]: Unable to create the coalescing queue.\n");
+		return -1;
+	}
+
+	return 0;
+}
+
+void
+destroy_coalesce(void)
+{
+	if (window_ms == 0)
+		return;
+	pthread_mutex_lock(&coalesce_mutex);
+	g_hash_table_destroy(pending);
+	pending = NULL;
+	list_destroy(fifo);
+	fifo = NULL;
+	pthread_mutex_unlock(&coalesce_mutex);
+	pthread_cond_destroy(&coalesce_cond);
+}
+
+int
+coalesce_enabled(void)
+{
+	return window_ms > 0;
+}
+
+/*
+ * Holds an event for the client `client_name', merging it with those
+ * already held for the same path.
+ *
+ * Return Value:
+ *   Returns zero if the event was taken, or -1 if the caller has to send
+ *   it right away (coalescing is off, or too many events are held).
+ */
+int
+coalesce_event(const char *client_name, const struct galaxy_event_t *gevent)
+{
+	struct pending_t *p, *found;
+
+	if (window_ms == 0)
+		return -1;
+
+	p = create_pending(client_name, gevent);
+	if (p == NULL)
+		return -1;
+
+	pthread_mutex_lock(&coalesce_mutex);
+	found = g_hash_table_lookup(pending, p);
+	if (found != NULL) {
+		found->event.mask |= gevent->mask;
+		found->event.pid = gevent->pid;
+		found->event.stat = gevent->stat;
+		found->event.digest_len = gevent->digest_len;
+		memcpy(found->event.digest, gevent->digest, sizeof(gevent->digest));
+		pthread_mutex_unlock(&coalesce_mutex);
+		free(p);
+		return 0;
+	}
+	if (g_hash_table_size(pending) >= COALESCE_MAX_PENDING ||
+	    list_push(fifo, p) < 0) {
+		pthread_mutex_unlock(&coalesce_mutex);
+		free(p);
+		return -1;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &p->deadline);
+	p->deadline.tv_sec += window_ms / 1000;
+	p->deadline.tv_nsec += (window_ms % 1000) * 1000000L;
+	if (p->deadline.tv_nsec >= 1000000000L) {
+		p->deadline.tv_sec++;
+		p->deadline.tv_nsec -= 1000000000L;
+	}
+	g_hash_table_insert(pending, p, p);
+	if (list_size(fifo) == 1)
+		pthread_cond_signal(&coalesce_cond);
+	pthread_mutex_unlock(&coalesce_mutex);
+
+	return 0;
+}
+
+static int
+expired(const struct timespec *deadline, const struct timespec *now)
+{
+	return deadline->tv_sec < now->tv_sec ||
+		(deadline->tv_sec == now->tv_sec && deadline->tv_nsec <= now->tv_nsec);
+}
+
+static void
+unlock_coalesce(void *arg)
+{
+	pthread_mutex_unlock(&coalesce_mutex);
+}
+
+/*
+ * Sends the merged events whose window closed. Sending may block on a
+ * slow client, so it is done without the mutex.
+ */
+static void *
+coalesce_flush(void *arg)
+{
+	struct pending_t *p;
+	struct timespec now;
+	list_t *due;
+
+	due = list_create(free);
+	if (due == NULL) {
+		err_msg("error[coalesce_flush]: Unable to create the flush list.\n");
+		return NULL;
+	}
+
+	while (1) {
+		pthread_mutex_lock(&coalesce_mutex);
+		/* The thread is cancelled on shutdown while it waits. */
+		pthread_cleanup_push(unlock_coalesce, NULL);
+		while (list_size(fifo) == 0)
+			pthread_cond_wait(&coalesce_cond, &coalesce_mutex);
+		p = list_key(list_head(fifo));
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		if (!expired(&p->deadline, &now)) {
+			pthread_cond_timedwait(&coalesce_cond, &coalesce_mutex,
+				&p->deadline);
+			clock_gettime(CLOCK_MONOTONIC, &now);
+		}
+		while (list_size(fifo) > 0 &&
+		       expired(&((struct pending_t *)list_key(list_head(fifo)))->deadline, &now)) {
+			p = list_shift(fifo);
+			g_hash_table_remove(pending, p);
+			list_push(due, p);
+		}
+		pthread_cleanup_pop(1);
+
+		while ((p = list_shift(due)) != NULL) {
+			galaxy_notify_client(p->client, &p->event);
+			free(p);
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * Creates the thread that sends the coalesced events. Only needed when
+ * coalesce_enabled().
+ */
+int
+create_coalesce_thread(pthread_t *id)
+{
+	int err;
+
+	err = create_joinable_thread(id, coalesce_flush, NULL);
+	if (err < 0)
+		err_create_joinable_thread(errno);
+
+	return err;
+}
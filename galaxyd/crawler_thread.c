@@ -27,6 +27,7 @@
 #endif
 
 #include <stdio.h>
+#include <time.h>
 
 #if HAVE_SYS_TYPES_H
 #  include <sys/types.h>
@@ -64,19 +65,84 @@
 #include "thread.h"
 #include "inotify.h"
 #include "inotify_utils.h"
+#include "dir_tree.h"
+#include "thread_pool.h"
+#include "watch.h"
+#include "watch_budget.h"
+#include "prune.h"
+#include "fs_policy.h"
+#include "self_events.h"
+#include "heap.h"
+#include "listing.h"
+#include "recovery.h"
+#include "fanotify_thread.h"
 #include "error.h"
 #include "list.h"
 
-extern pthread_mutex_t inotify_wds_mutex;
+#define PRIORITY_EXPLICIT  2   /* A client named this part of the tree. */
+#define PRIORITY_RECENT    1   /* Changed within the last RECENT_SECS. */
+#define RECENT_SECS     3600
 
-static int total = 0;
+extern thread_pool_t workers;
+
+/* Resolved root directories and crawl options, kept so the watch set
+ * can be rebuilt whenever the client subscriptions change. */
+static list_t *roots = NULL;
+static int crawl_recursive = 0;
+
+/* Runs the reconcile, rewatch and mount crawls one at a time, so the
+ * shared workers never wait on a crawl. Set to NULL, under the pending
+ * mutex, once it is being shut down. */
+static thread_pool_t crawlers = NULL;
+
+/* Serializes the initial crawl with the crawl queue. The pending mutex guards the flags
+ * below and the progress of every root, and is also held while `roots'
+ * is set. Waiters for coverage sleep on the progress condition. */
+static pthread_mutex_t reconcile_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t pending_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t progress_cond = PTHREAD_COND_INITIALIZER;
+static int reconcile_queued = 0;
+static int reconcile_grow = 0;
+
+/* Directory counters kept for every root. */
+enum {
+	CRAWL_QUEUED,       /* Found and due to be crawled. */
+	CRAWL_SCANNED,      /* Read. */
+	CRAWL_UNREADABLE,   /* Couldn't be read. */
+	CRAWL_WATCHED,      /* Given a watch. */
+	CRAWL_UNWATCHED,    /* Read, but couldn't be given a watch. */
+	CRAWL_COUNTERS
+};
+
+/* A root directory and how far its crawls got. The counters describe
+ * the crawls since the root last went idle. */
+struct crawl_root_t {
+	unsigned long count[CRAWL_COUNTERS];
+	time_t started;
+	time_t finished;
+	int crawls;    /* Crawls of (part of) this root in progress. */
+	int crawled;   /* A crawl of the whole root has been started. */
+	char path[1];
+} crawl_root_t;
+
+/* A watched directory and the mask it should have, as seen by a sweep
+ * of the watch set. */
+struct swept_watch_t {
+	int wd;
+	uint32_t mask;
+	char path[1];
+} swept_watch_t;
+
+/* A crawl of `path' on behalf of one of the roots. */
+struct crawl_job_t {
+	struct crawl_root_t *root;
+	char path[1];
+} crawl_job_t;
 
 struct crawl_data_t {
 	int fd;
 	int recursive;  /* Boolean to specify if we should add recursively. */
 	const list_t *dirs;
-	const list_t *prune_dirs;
-	GHashTable *inotify_wds;
 } crawl_data_t;
 
 static int
@@ -95,32 +161,248 @@ max_pathname(const char *path)
 	return max_path + 1;
 }
 
+/*
+ * Marks the start of a crawl below `root'. A root that was idle starts
+ * counting from scratch. Must hold the pending mutex.
+ */
+static void
+progress_begin(struct crawl_root_t *root, int whole)
+{
+	if (root == NULL)
+		return;
+	if (root->crawls++ == 0) {
+		memset(root->count, 0, sizeof(root->count));
+		root->started = time(NULL);
+	}
+	if (whole)
+		root->crawled = 1;
+}
+
+static void
+progress_end(struct crawl_root_t *root)
+{
+	if (root == NULL)
+		return;
+	pthread_mutex_lock(&pending_mutex);
+	if (--root->crawls == 0) {
+		root->finished = time(NULL);
+		pthread_cond_broadcast(&progress_cond);
+	}
+	pthread_mutex_unlock(&pending_mutex);
+}
+
+static void
+progress_count(struct crawl_root_t *root, int counter, unsigned long n)
+{
+	if (root == NULL)
+		return;
+	pthread_mutex_lock(&pending_mutex);
+	root->count[counter] += n;
+	pthread_mutex_unlock(&pending_mutex);
+}
+
+/*
+ * Tells whether `path' is `dir' or lies below it.
+ */
 static int
-recursive_crawl(int fd, const char *dirname, GHashTable *wds,
-	const list_t *prune_dirs, const int recursive)
+path_within(const char *path, const char *dir)
+{
+	size_t len;
+
+	len = strlen(dir);
+	return strncmp(path, dir, len) == 0 &&
+		(path[len] == '\0' || path[len] == '/' || (len > 0 && dir[len - 1] == '/'));
+}
+
+/*
+ * Returns the innermost root `path' belongs to, or NULL. Must hold the
+ * pending mutex.
+ */
+static struct crawl_root_t *
+find_root(const char *path)
+{
+	list_node_t *node = NULL;
+	struct crawl_root_t *root, *found = NULL;
+
+	if (roots == NULL)
+		return NULL;
+	list_foreach(roots, node) {
+		root = list_key(node);
+		if (path_within(path, root->path) &&
+		    (found == NULL || strlen(root->path) > strlen(found->path)))
+			found = root;
+	}
+
+	return found;
+}
+
+/*
+ * A directory on the crawl frontier. Directories come off the frontier
+ * by priority; among equals the most recently found one is crawled
+ * first, which keeps the frontier as small as a depth-first walk's.
+ */
+struct crawl_dir_t {
+	int priority;
+	unsigned long seq;
+	uint32_t mask;
+	char path[1];
+} crawl_dir_t;
+
+static int
+compare_crawl_dirs(const void *a, const void *b)
+{
+	const struct crawl_dir_t *x = a, *y = b;
+
+	if (x->priority != y->priority)
+		return x->priority > y->priority ? 1 : -1;
+	if (x->seq != y->seq)
+		return x->seq > y->seq ? 1 : -1;
+	return 0;
+}
+
+/*
+ * Tells whether `dirname' needs crawling at all, and with which mask and
+ * priority: pruned and polled directories don't, nor do those on file
+ * systems marked with fanotify, nor those no client subscription can
+ * match anything below. Directories a client
+ * asked for by name, and those that changed lately, are crawled before
+ * the rest of the tree. `statbuf' may be NULL.
+ */
+static int
+crawl_wanted(const char *dirname, const struct stat *statbuf, uint32_t *mask,
+	int *priority)
+{
+	struct dir_node_t *node;
+	time_t recent;
+	int explicit;
+
+	if (prune_match(dirname) || watch_budget_is_polled(dirname) ||
+	    fanotify_covers(dirname, statbuf))
+		return 0;
+	*mask = galaxy_watch_interest(dirname, &explicit);
+	if (*mask == 0)
+		return 0;
+
+	*priority = explicit ? PRIORITY_EXPLICIT : 0;
+	recent = time(NULL) - RECENT_SECS;
+	if (statbuf != NULL && statbuf->st_mtime >= recent) {
+		*priority += PRIORITY_RECENT;
+	} else {
+		dir_tree_lock();
+		node = dir_tree_lookup(dirname);
+		if (node != NULL && node->active >= recent)
+			*priority += PRIORITY_RECENT;
+		dir_tree_unlock();
+	}
+
+	return 1;
+}
+
+/*
+ * Puts `path' on the crawl frontier if it needs crawling.
+ */
+static void
+frontier_push(heap_t *frontier, const char *path, const struct stat *statbuf,
+	struct crawl_root_t *root)
+{
+	static unsigned long seq = 0;
+	struct crawl_dir_t *dir;
+	uint32_t mask;
+	int priority;
+
+	if (!crawl_wanted(path, statbuf, &mask, &priority))
+		return;
+
+	dir = malloc(sizeof(struct crawl_dir_t) + strlen(path));
+	if (dir == NULL) {
+		err_malloc(errno);
+		err_msg("error[frontier_push]: Unable to malloc '%s'.\n", path);
+		return;
+	}
+	dir->priority = priority;
+	dir->seq = seq++;  /* Crawls are serialized by the reconcile mutex. */
+	dir->mask = mask;
+	strcpy(dir->path, path);
+	if (heap_push(frontier, dir) < 0) {
+		err_msg("error[frontier_push]: Unable to queue '%s'.\n", path);
+		free(dir);
+		return;
+	}
+	progress_count(root, CRAWL_QUEUED, 1);
+}
+
+/*
+ * Watches the directory `dirname' and puts its subdirectories on the
+ * crawl frontier.
+ *
+ * The watch is added before the directory is read, so anything created
+ * while the crawl goes on is reported by the kernel. The opendir() and
+ * readdir() calls raise events of their own, but those are recognized
+ * and dropped (see self_events.c).
+ */
+static int
+crawl_dir(heap_t *frontier, const char *dirname, uint32_t mask,
+	const int recursive, struct crawl_root_t *root)
 {
 	DIR *dir = NULL;
 	struct dirent *entry;
 	struct stat statbuf;
-	int ret, *key;
-	list_node_t *node = NULL;
+	struct dir_node_t *node;
+	listing_t listing;
+	int ret, watched;
 
-	/* Prune this directory if it is in our list of prunes. */
-	list_foreach(prune_dirs, node) {
-		if (strcmp(dirname, list_key(node)) == 0)
+	dir_tree_lock();
+	node = dir_tree_lookup(dirname);
+	watched = node != NULL && node->wd >= 0;
+	if (watched)
+		galaxy_update_watch(node, mask);
+	dir_tree_unlock();
+
+	if (watched) {
+		progress_count(root, CRAWL_WATCHED, 1);
+	} else {
+		ret = galaxy_add_watch(dirname, mask);
+		if (ret == -2) {
+			/* Out of watches; polling covers the whole subtree. */
+			watch_budget_poll(dirname, 1);
+			progress_count(root, CRAWL_SCANNED, 1);
 			return 0;
+		} else if (ret < 0) {
+			err_msg("error[crawl_dir]: Unable to add a galaxy watch event.\n");
+			progress_count(root, CRAWL_UNWATCHED, 1);
+		} else {
+			progress_count(root, CRAWL_WATCHED, 1);
+		}
 	}
 
+	/* Rules in an ignore file apply to the directories below it. */
+	prune_load_ignore_file(dirname);
+
+	self_scan_begin(dirname);
 	dir = opendir(dirname);
 	if (dir == NULL) {
 		err_opendir(errno);
+		self_scan_end(dirname);
+		progress_count(root, CRAWL_UNREADABLE, 1);
 		return -1;
 	}
+	listing = recovery_enabled() ? listing_create() : NULL;
 
-	while (errno = 0, (entry = readdir(dir)) != NULL && recursive) {
+	errno = 0;
+	while (recursive || listing != NULL) {
 		char path[4097];
 		size_t path_len;
 
+		/* readdir() only sets errno on failure. */
+		errno = 0;
+		entry = readdir(dir);
+		if (entry == NULL)
+			break;
+
+		if (strcmp(entry->d_name, ".") == 0 ||
+		    strcmp(entry->d_name, "..") == 0)
+			continue;
+
 		strcpy(path, dirname);
 		path_len = strlen(path);
 
@@ -134,44 +416,710 @@ recursive_crawl(int fd, const char *dirname, GHashTable *wds,
 		strncpy(path + path_len, entry->d_name, sizeof(path) - path_len);
 		if (lstat(path, &statbuf) == -1) {
 			err_lstat(errno);
-			err_msg("error[recursive_crawl]: lstat failed on %s\n", entry->d_name);
+			err_msg("error[crawl_dir]: lstat failed on %s\n", entry->d_name);
+			continue;
 		}
+		if (listing != NULL)
+			listing_update(listing, entry->d_name, &statbuf);
 
-		if (S_ISDIR(statbuf.st_mode) && strcmp(entry->d_name, ".") != 0 &&
-		    strcmp(entry->d_name, "..") != 0) {
-			recursive_crawl(fd, path, wds, prune_dirs, recursive);
+		if (recursive && S_ISDIR(statbuf.st_mode) &&
+		    fs_policy_allows(path, &statbuf))
+			frontier_push(frontier, path, &statbuf, root);
+	}
+	if (errno != 0) {
+		err_msg("error[crawl_dir]: readdir failed on %s: %s\n", dirname,
+			strerror(errno));
+		closedir(dir);
+		self_scan_end(dirname);
+		/* A partial listing would make recovery report deletions. */
+		if (listing != NULL)
+			listing_destroy(listing);
+		progress_count(root, CRAWL_UNREADABLE, 1);
+		return -1;
+	}
+
+	closedir(dir);
+	self_scan_end(dirname);
+	if (listing != NULL)
+		recovery_attach(dirname, listing);
+	progress_count(root, CRAWL_SCANNED, 1);
+
+	return 0;
+}
+
+/*
+ * Crawls `dirname' on behalf of `root', which must have had its crawl
+ * started with progress_begin(). The frontier is kept as a priority
+ * queue, so the parts of the tree clients are waiting on get their
+ * watches first and the rest is filled in afterwards.
+ */
+static void
+crawl_path(const char *dirname, struct crawl_root_t *root)
+{
+	heap_t *frontier;
+	struct crawl_dir_t *dir;
+
+	frontier = heap_create(compare_crawl_dirs, free);
+	if (frontier == NULL) {
+		err_msg("error[crawl_path]: Unable to create the crawl frontier.\n");
+		progress_end(root);
+		return;
+	}
+
+	frontier_push(frontier, dirname, NULL, root);
+	while ((dir = heap_pop(frontier)) != NULL) {
+		crawl_dir(frontier, dir->path, dir->mask, crawl_recursive, root);
+		free(dir);
+	}
+
+	heap_destroy(frontier);
+	progress_end(root);
+}
+
+/*
+ * Worker pool job that covers a directory whose watch was just added.
+ * Anything that was created in it before the watch landed would
+ * otherwise be missed, so every entry found gets a synthesized
+ * IN_CREATE. Subdirectories get their watch first and are then scanned
+ * by their own job, which keeps the scan race-free and spreads a large
+ * tree over the pool.
+ *
+ * An entry created between the watch and the scan is reported twice
+ * (once by the kernel and once here); clients must tolerate that.
+ */
+static void
+scan_job(void *arg)
+{
+	char *dirname = (char *)arg;
+	DIR *dir;
+	struct dirent *entry;
+	struct stat statbuf;
+	listing_t listing;
+	char path[4097];
+	size_t path_len;
+
+	self_scan_begin(dirname);
+	dir = opendir(dirname);
+	if (dir == NULL) {
+		/* Probably gone already; its IN_IGNORED cleans up. */
+		self_scan_end(dirname);
+		free(dirname);
+		return;
+	}
+	prune_load_ignore_file(dirname);
+	listing = recovery_enabled() ? listing_create() : NULL;
+
+	strcpy(path, dirname);
+	path_len = strlen(path);
+	if (path[path_len - 1] != '/') {
+		path[path_len++] = '/';
+		path[path_len] = '\0';
+	}
+
+	while ((entry = readdir(dir)) != NULL) {
+		if (strcmp(entry->d_name, ".") == 0 ||
+		    strcmp(entry->d_name, "..") == 0)
+			continue;
+		if (path_len + strlen(entry->d_name) >= sizeof(path))
+			continue;
+		strcpy(path + path_len, entry->d_name);
+		if (lstat(path, &statbuf) == -1)
+			continue;
+		if (listing != NULL)
+			listing_update(listing, entry->d_name, &statbuf);
+
+		if (!S_ISDIR(statbuf.st_mode)) {
+			find_matching_events(path, IN_CREATE);
+			continue;
 		}
+
+		find_matching_events(path, IN_CREATE | IN_ISDIR);
+		watch_new_directory(path, &statbuf);
 	}
 
-	if (dir != NULL)
-		closedir(dir);
+	closedir(dir);
+	self_scan_end(dirname);
+	if (listing != NULL)
+		recovery_attach(dirname, listing);
+	free(dirname);
+}
+
+/*
+ * Gives the directory `path', which just showed up inside a watched
+ * one, a watch of its own if anybody wants it, and queues a scan of its
+ * contents. `statbuf' may be NULL.
+ *
+ * Return Value:
+ *   Returns 1 if the directory was newly watched, otherwise zero.
+ */
+int
+watch_new_directory(const char *path, const struct stat *statbuf)
+{
+	struct dir_node_t *node;
+	uint32_t mask;
+	int ret, watched;
+
+	if (prune_match(path) || !fs_policy_allows(path, statbuf))
+		return 0;
+	mask = galaxy_watch_mask(path);
+	if (mask == 0)
+		return 0;
+
+	/* Skip directories somebody else already covers, e.g. the
+	 * watcher thread reacting to their own IN_CREATE. */
+	dir_tree_lock();
+	node = dir_tree_lookup(path);
+	watched = node != NULL && node->wd >= 0;
+	dir_tree_unlock();
+	if (watched)
+		return 0;
+
+	ret = galaxy_add_watch(path, mask);
+	if (ret == -2)
+		watch_budget_poll(path, 0);
+	if (ret < 0)
+		return 0;
+	scan_new_directory(path);
+
+	return 1;
+}
+
+/*
+ * Queues a scan of the freshly watched directory `dirname' on the
+ * worker pool (see scan_job()), so a large untar never blocks the
+ * inotify watcher thread.
+ *
+ * Return Value:
+ *   Returns -1 on error, otherwise zero.
+ */
+int
+scan_new_directory(const char *dirname)
+{
+	char *arg;
+
+	if (prune_match(dirname))
+		return 0;
 
-	/* Add the directory to the galaxy watch list. Adding the galaxy watch
-	 * here will perform a depth-first search. Keeping this after the
-	 * opendir(), closedir(), and recursive calls will minimize the number
-	 * of Inotify events raised due to this function crawling the
-	 * filesystem.*/
-	ret = galaxy_add_watch(dirname, IN_ALL_EVENTS);
-	if (ret < 0) {
-		err_msg("error[recursive_crawl]: Unable to add a galaxy watch event.\n");
+	arg = strdup(dirname);
+	if (arg == NULL) {
+		err_malloc(errno);
+		err_msg("error[scan_new_directory]: Unable to strdup '%s'.\n", dirname);
+		return -1;
+	}
+	if (thread_pool_submit(workers, scan_job, arg) < 0) {
+		free(arg);
 		return -1;
 	}
-	total++;
 
 	return 0;
 }
 
+/*
+ * Collects the path and wd of every watched node below `top', parents
+ * before their children. The tree is walked without recursion, since it
+ * may be deeper than the stack allows. Must hold the tree lock.
+ */
+static void
+collect_watches(struct dir_node_t *top, list_t *watches)
+{
+	struct dir_node_t *node = top;
+	struct swept_watch_t *watch;
+	char *path;
+
+	while (node != NULL) {
+		if (node->wd >= 0 && (path = dir_node_path(node, NULL)) != NULL) {
+			watch = malloc(sizeof(struct swept_watch_t) + strlen(path));
+			if (watch == NULL || list_push(watches, watch) < 0) {
+				err_malloc(errno);
+				free(watch);
+				return;
+			}
+			watch->wd = node->wd;
+			strcpy(watch->path, path);
+		}
+
+		/* On to the next node in pre-order. */
+		if (node->children != NULL) {
+			node = node->children;
+			continue;
+		}
+		while (node != top && node->next == NULL)
+			node = node->parent;
+		node = node != top ? node->next : NULL;
+	}
+}
+
+/*
+ * Brings the mask of every watched directory below `dirname' in line
+ * with the subscriptions. If `drop' is set the topmost watched
+ * directories nobody wants anymore are dropped along with everything
+ * below them, otherwise they keep their mask. Matching every path
+ * against the subscriptions takes a while, so the masks are worked out
+ * without the tree lock; watches that were dropped or moved in the
+ * meantime are left alone.
+ */
+static void
+sweep_watches(const char *dirname, int drop)
+{
+	struct dir_node_t *dnode;
+	struct swept_watch_t *watch;
+	list_node_t *node = NULL;
+	list_t *watches;
+	char *path;
+
+	watches = list_create(free);
+	if (watches == NULL)
+		return;
+
+	dir_tree_lock();
+	dnode = dir_tree_lookup(dirname);
+	if (dnode != NULL)
+		collect_watches(dnode, watches);
+	dir_tree_unlock();
+
+	list_foreach(watches, node) {
+		watch = list_key(node);
+		watch->mask = galaxy_watch_mask(watch->path);
+	}
+
+	/* Parents come first, so the watches below an unwanted directory
+	 * are gone by the time they come up. */
+	dir_tree_lock();
+	node = NULL;
+	list_foreach(watches, node) {
+		watch = list_key(node);
+		dnode = dir_tree_lookup_wd(watch->wd);
+		if (dnode == NULL || (path = dir_node_path(dnode, NULL)) == NULL ||
+		    strcmp(path, watch->path) != 0)
+			continue;
+		if (watch->mask != 0)
+			galaxy_update_watch(dnode, watch->mask);
+		else if (drop)
+			galaxy_remove_subtree(dnode, 1);
+	}
+	dir_tree_unlock();
+
+	list_destroy(watches);
+}
+
+/*
+ * Crawl queue job that brings the watch set in line with the current
+ * client subscriptions. Masks are narrowed or widened and watches nobody
+ * wants are dropped by walking the in-memory tree; if subscriptions may
+ * have grown the roots are crawled again to pick up newly wanted
+ * directories.
+ */
+static void
+reconcile_job(void *arg)
+{
+	list_node_t *node;
+	int grow;
+
+	pthread_mutex_lock(&pending_mutex);
+	reconcile_queued = 0;
+	grow = reconcile_grow && roots != NULL;
+	reconcile_grow = 0;
+	if (grow) {
+		node = NULL;
+		list_foreach(roots, node)
+			progress_begin(list_key(node), 1);
+	}
+	pthread_mutex_unlock(&pending_mutex);
+
+	fanotify_update_mask();
+
+	pthread_mutex_lock(&reconcile_mutex);
+
+	sweep_watches("/", 1);
+
+	if (grow) {
+		node = NULL;
+		list_foreach(roots, node) {
+			struct crawl_root_t *croot = list_key(node);
+
+			crawl_path(croot->path, croot);
+		}
+	}
+
+	pthread_mutex_unlock(&reconcile_mutex);
+}
+
+/*
+ * Queues `func(arg)' on the crawl queue.
+ *
+ * Return Value:
+ *   Returns -1 on error or once the queue is shut down, otherwise zero.
+ */
+static int
+queue_crawl(void (*func)(void *arg), void *arg)
+{
+	int err = -1;
+
+	pthread_mutex_lock(&pending_mutex);
+	if (crawlers != NULL)
+		err = thread_pool_submit(crawlers, func, arg);
+	pthread_mutex_unlock(&pending_mutex);
+
+	return err;
+}
+
+static void
+refresh_job(void *arg)
+{
+	sweep_watches((char *)arg, 0);
+	free(arg);
+}
+
+/*
+ * Queues a refresh of the masks of the watches below `dirname', e.g.
+ * after it went into or out of storm mode. Unlike update_watch_set()
+ * no watch is added or dropped.
+ *
+ * Return Value:
+ *   Returns -1 on error, otherwise zero.
+ */
+int
+refresh_watch_masks(const char *dirname)
+{
+	char *arg;
+
+	arg = strdup(dirname);
+	if (arg == NULL) {
+		err_malloc(errno);
+		err_msg("error[refresh_watch_masks]: Unable to strdup '%s'.\n", dirname);
+		return -1;
+	}
+	if (queue_crawl(refresh_job, arg) < 0) {
+		free(arg);
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Schedules a reconcile of the watch set against the client
+ * subscriptions (see reconcile_job()). Set `grown' when subscriptions
+ * were added or widened, so that the roots get crawled for directories
+ * that just became interesting. Requests that arrive while one is
+ * still queued are folded into it.
+ *
+ * Return Value:
+ *   Returns -1 on error, otherwise zero.
+ */
+int
+update_watch_set(int grown)
+{
+	int queued;
+
+	pthread_mutex_lock(&pending_mutex);
+	queued = reconcile_queued;
+	reconcile_queued = 1;
+	reconcile_grow |= grown;
+	pthread_mutex_unlock(&pending_mutex);
+
+	if (queued)
+		return 0;
+	if (queue_crawl(reconcile_job, NULL) < 0) {
+		pthread_mutex_lock(&pending_mutex);
+		reconcile_queued = 0;
+		reconcile_grow = 0;
+		pthread_cond_broadcast(&progress_cond);
+		pthread_mutex_unlock(&pending_mutex);
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Queues `func' with a crawl job for `path', whose root counts as being
+ * crawled from now on.
+ */
+static int
+submit_crawl_job(void (*func)(void *arg), const char *path)
+{
+	struct crawl_job_t *job;
+
+	job = malloc(sizeof(struct crawl_job_t) + strlen(path));
+	if (job == NULL) {
+		err_malloc(errno);
+		err_msg("error[submit_crawl_job]: Unable to malloc a crawl of '%s'.\n", path);
+		return -1;
+	}
+	strcpy(job->path, path);
+
+	pthread_mutex_lock(&pending_mutex);
+	job->root = find_root(path);
+	progress_begin(job->root, 0);
+	pthread_mutex_unlock(&pending_mutex);
+
+	if (queue_crawl(func, job) < 0) {
+		progress_end(job->root);
+		free(job);
+		return -1;
+	}
+
+	return 0;
+}
+
+static void
+rewatch_job(void *arg)
+{
+	struct crawl_job_t *job = (struct crawl_job_t *)arg;
+
+	pthread_mutex_lock(&reconcile_mutex);
+	crawl_path(job->path, job->root);
+	pthread_mutex_unlock(&reconcile_mutex);
+	free(job);
+}
+
+/*
+ * Queues a crawl of `dirname' that adds a watch to every wanted
+ * directory below it that doesn't have one yet. Used after a watched
+ * directory was moved, since subdirectories nobody wanted at the old
+ * path may be wanted at the new one. Unlike scan_new_directory() no
+ * events are synthesized, since nothing was created.
+ *
+ * Return Value:
+ *   Returns -1 on error, otherwise zero.
+ */
+int
+rewatch_subtree(const char *dirname)
+{
+	return submit_crawl_job(rewatch_job, dirname);
+}
+
+/*
+ * Crawl queue job run when a mount point under a root changed. Whatever
+ * was known below it belongs to the file system that was there before,
+ * so the whole subtree is dropped in one go and crawled again.
+ */
+static void
+mount_job(void *arg)
+{
+	struct crawl_job_t *job = (struct crawl_job_t *)arg;
+	struct dir_node_t *node;
+
+	pthread_mutex_lock(&reconcile_mutex);
+	dir_tree_lock();
+	node = dir_tree_lookup(job->path);
+	if (node != NULL)
+		galaxy_remove_subtree(node, 1);
+	dir_tree_unlock();
+
+	if (fs_policy_allows(job->path, NULL)) {
+		/* Nothing left to crawl if the new file system can be marked. */
+		if (fanotify_enabled())
+			fanotify_mark_path(job->path);
+		crawl_path(job->path, job->root);
+	} else {
+		progress_end(job->root);
+	}
+	pthread_mutex_unlock(&reconcile_mutex);
+
+	free(job);
+}
+
+/*
+ * Called when something was mounted on, or unmounted from, `mountpoint'.
+ * The file system policies forget what they decided for it; beyond
+ * that, mount points outside the roots are ignored.
+ *
+ * Return Value:
+ *   Returns -1 on error, otherwise zero.
+ */
+int
+crawl_mount_change(const char *mountpoint)
+{
+	int below;
+
+	fs_policy_forget(mountpoint);
+
+	/* Not the reconcile mutex: crawls hold that one for long. */
+	pthread_mutex_lock(&pending_mutex);
+	below = find_root(mountpoint) != NULL;
+	pthread_mutex_unlock(&pending_mutex);
+	if (!below)
+		return 0;
+
+	return submit_crawl_job(mount_job, mountpoint);
+}
+
+/*
+ * Tells whether the crawls covering `prefix' are done. A root covers
+ * the prefix if either one contains the other. Must hold the pending
+ * mutex.
+ *
+ * Return Value:
+ *   Returns 1 if they are, zero if not yet, and -1 if no root covers
+ *   `prefix'.
+ */
+static int
+coverage_state(const char *prefix)
+{
+	list_node_t *node = NULL;
+	struct crawl_root_t *root;
+	int covered = 0, busy;
+
+	if (roots == NULL)
+		return 0;
+
+	/* A grown subscription is about to be crawled for. */
+	busy = reconcile_queued && reconcile_grow;
+	list_foreach(roots, node) {
+		root = list_key(node);
+		if (!path_within(prefix, root->path) &&
+		    !path_within(root->path, prefix))
+			continue;
+		covered = 1;
+		if (!root->crawled || root->crawls > 0)
+			busy = 1;
+	}
+
+	if (!covered)
+		return -1;
+
+	return !busy;
+}
+
+/*
+ * Blocks until every directory under `prefix' that clients want has
+ * been crawled, or for at most `timeout' seconds (zero waits for as
+ * long as it takes).
+ *
+ * Return Value:
+ *   Returns 1 once `prefix' is covered, zero on timeout, and -1 if it
+ *   is not under any root.
+ */
+int
+crawl_wait_ready(const char *prefix, unsigned int timeout)
+{
+	struct timespec deadline;
+	int state, err = 0;
+
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	deadline.tv_sec += timeout;
+
+	pthread_mutex_lock(&pending_mutex);
+	while ((state = coverage_state(prefix)) == 0 && err != ETIMEDOUT) {
+		if (timeout == 0)
+			pthread_cond_wait(&progress_cond, &pending_mutex);
+		else
+			err = pthread_cond_timedwait(&progress_cond, &pending_mutex,
+				&deadline);
+	}
+	pthread_mutex_unlock(&pending_mutex);
+
+	return state;
+}
+
+/*
+ * Takes a snapshot of the crawl progress of every root. The array is
+ * returned in `progress' and must be released with free(); the root
+ * names stay valid until shutdown.
+ *
+ * Return Value:
+ *   Returns the number of roots, or -1 on error.
+ */
+int
+crawl_progress(struct crawl_progress_t **progress)
+{
+	list_node_t *node = NULL;
+	struct crawl_root_t *root;
+	struct crawl_progress_t *p;
+	unsigned long done;
+	time_t now;
+	int n = 0;
+
+	now = time(NULL);
+	pthread_mutex_lock(&pending_mutex);
+	*progress = malloc(sizeof(struct crawl_progress_t) *
+		(roots != NULL && list_size(roots) > 0 ? list_size(roots) : 1));
+	if (*progress == NULL) {
+		pthread_mutex_unlock(&pending_mutex);
+		err_malloc(errno);
+		err_msg("error[crawl_progress]: Unable to malloc crawl progress.\n");
+		return -1;
+	}
+	if (roots != NULL) {
+		list_foreach(roots, node) {
+			root = list_key(node);
+			p = &(*progress)[n++];
+			done = root->count[CRAWL_SCANNED] + root->count[CRAWL_UNREADABLE];
+			p->root = root->path;
+			p->queued = root->count[CRAWL_QUEUED];
+			p->pending = p->queued > done ? p->queued - done : 0;
+			p->scanned = root->count[CRAWL_SCANNED];
+			p->watched = root->count[CRAWL_WATCHED];
+			p->failed = root->count[CRAWL_UNREADABLE] +
+				root->count[CRAWL_UNWATCHED];
+			p->running = root->crawls > 0;
+			p->covered = root->crawled && !p->running;
+
+			/* Assume the directories still to go take as long as the
+			 * ones done so far. */
+			if (!p->running)
+				p->eta = 0;
+			else if (done == 0)
+				p->eta = -1;
+			else
+				p->eta = (long)((now - root->started) * p->pending / done);
+		}
+	}
+	pthread_mutex_unlock(&pending_mutex);
+
+	return n;
+}
+
+/*
+ * Marks the file systems below `root' with fanotify, and crawls the
+ * mounts that couldn't be marked. The root itself is left to the caller,
+ * whose crawl finds nothing to do if its file system got marked.
+ */
+static void
+mark_root(struct crawl_root_t *root)
+{
+	list_t *unmarked;
+	list_node_t *node = NULL;
+
+	unmarked = list_create(free);
+	if (unmarked == NULL)
+		return;
+	if (fanotify_mark_tree(root->path, unmarked) == 0) {
+		list_foreach(unmarked, node) {
+			pthread_mutex_lock(&pending_mutex);
+			progress_begin(root, 0);
+			pthread_mutex_unlock(&pending_mutex);
+			crawl_path(list_key(node), root);
+		}
+	}
+	list_destroy(unmarked);
+}
+
+static void
+unlock_reconcile(void *arg)
+{
+	pthread_mutex_unlock(&reconcile_mutex);
+}
+
 static void *
 crawl(void *arg)
 {
-	struct crawl_data_t *cdata;
+	struct crawl_root_t *root;
 
-	cdata = (struct crawl_data_t *)arg;
+	pthread_mutex_lock(&reconcile_mutex);
+	/* The crawl queue must not be left waiting if this thread is
+	 * cancelled on shutdown. */
+	pthread_cleanup_push(unlock_reconcile, NULL);
 	list_node_t *node = NULL;
-	list_foreach(cdata->dirs, node) {
-		recursive_crawl(cdata->fd, list_key(node), cdata->inotify_wds,
-			cdata->prune_dirs, cdata->recursive);
+	list_foreach(roots, node) {
+		root = list_key(node);
+		if (fanotify_enabled())
+			mark_root(root);
+		crawl_path(root->path, root);
 	}
+	pthread_cleanup_pop(1);
 	free(arg);
 
 	return NULL;
@@ -179,21 +1127,104 @@ crawl(void *arg)
 
 int
 create_crawler_thread(pthread_t *id, int fd, const list_t *dirs,
-	const list_t *prune_dirs, GHashTable *inotify_wds, int recursive)
+	int recursive)
 {
 	struct crawl_data_t *cdata;
+	list_node_t *node = NULL;
+	thread_pool_t pool;
+	list_t *list;
 
 	cdata = malloc(sizeof(struct crawl_data_t));
 	if (cdata == NULL) {
 		err_malloc(errno);
 		err_msg("error[create_crawler_thread]: Unable to malloc crawl data.\n");
+		return -1;
 	}
 
 	cdata->fd = fd;
 	cdata->recursive = recursive;     /* Specifies to recursively add. */
 	cdata->dirs = dirs;               /* Destroyed in galaxyd.c:main(). */
-	cdata->prune_dirs = prune_dirs;   /* Destroyed in galaxyd.c:main(). */
-	cdata->inotify_wds = inotify_wds; /* Used throughout life of app. */
+	crawl_recursive = recursive;
+
+	/* A single thread, since its crawls are serialized anyway. */
+	pool = thread_pool_create(1);
+	if (pool == NULL) {
+		err_msg("error[create_crawler_thread]: Unable to create the crawl queue.\n");
+		free(cdata);
+		return -1;
+	}
+
+	/* The directory tree is keyed on absolute paths. Resolve the roots
+	 * up front so reconciles never see a half-built list. */
+	list = list_create(free);
+	if (list == NULL) {
+		err_msg("error[create_crawler_thread]: Unable to create roots list.\n");
+		thread_pool_destroy(pool);
+		free(cdata);
+		return -1;
+	}
+	list_foreach(dirs, node) {
+		char path[4097];
+		struct crawl_root_t *root;
+
+		if (realpath(list_key(node), path) == NULL) {
+			err_msg("error[create_crawler_thread]: Unable to resolve root directory '%s'.\n",
+				(char *)list_key(node));
+			continue;
+		}
+		fs_policy_add_root(path);
+		root = calloc(1, sizeof(struct crawl_root_t) + strlen(path));
+		if (root == NULL || list_push(list, root) < 0) {
+			err_malloc(errno);
+			free(root);
+			continue;
+		}
+		strcpy(root->path, path);
+	}
+
+	/* Every root counts as being crawled until the crawler thread got
+	 * through it. */
+	pthread_mutex_lock(&reconcile_mutex);
+	pthread_mutex_lock(&pending_mutex);
+	roots = list;
+	crawlers = pool;
+	node = NULL;
+	list_foreach(roots, node)
+		progress_begin(list_key(node), 1);
+	pthread_cond_broadcast(&progress_cond);
+	pthread_mutex_unlock(&pending_mutex);
+	pthread_mutex_unlock(&reconcile_mutex);
 
 	return create_joinable_thread(id, crawl, cdata);
 }
+
+/*
+ * Stops the crawl queue, waiting for the crawl it is running. Called
+ * once on shutdown, before the worker pool goes away, since crawls
+ * queue jobs on it. Crawls queued from then on are refused.
+ */
+void
+destroy_crawl_queue(void)
+{
+	thread_pool_t pool;
+
+	pthread_mutex_lock(&pending_mutex);
+	pool = crawlers;
+	crawlers = NULL;
+	pthread_mutex_unlock(&pending_mutex);
+
+	thread_pool_destroy(pool);
+}
+
+/*
+ * Releases the resolved root list. Called once on shutdown, after the
+ * worker pool is gone.
+ */
+void
+destroy_crawler_data(void)
+{
+	pthread_mutex_lock(&pending_mutex);
+	list_destroy(roots);
+	roots = NULL;
+	pthread_mutex_unlock(&pending_mutex);
+}
@@ -29,10 +29,37 @@
 #  include <pthread.h>
 #endif
 
+#if HAVE_SYS_STAT_H
+#  include <sys/stat.h>
+#endif
+
 #include "list.h"
 
+/* How far the crawls of one root got. */
+struct crawl_progress_t {
+	const char *root;
+	unsigned long queued;    /* Directories found to crawl. */
+	unsigned long pending;   /* Found but not read yet. */
+	unsigned long scanned;   /* Read. */
+	unsigned long watched;   /* Given a watch. */
+	unsigned long failed;    /* Couldn't be read or watched. */
+	long eta;                /* Seconds left; -1 if unknown. */
+	int running;             /* A crawl is in progress. */
+	int covered;             /* Crawled completely. */
+};
+
 int
 create_crawler_thread(pthread_t *id, int fd, const list_t *dirs,
-	const list_t *prune_dirs, GHashTable *inotify_wds, int recursive);
+	int recursive);
+void destroy_crawl_queue(void);
+void destroy_crawler_data(void);
+int scan_new_directory(const char *dirname);
+int watch_new_directory(const char *path, const struct stat *statbuf);
+int rewatch_subtree(const char *dirname);
+int update_watch_set(int grown);
+int refresh_watch_masks(const char *dirname);
+int crawl_mount_change(const char *mountpoint);
+int crawl_wait_ready(const char *prefix, unsigned int timeout);
+int crawl_progress(struct crawl_progress_t **progress);
 
 #endif
@@ -0,0 +1,596 @@
+/*
+ * Galaxy - A filesystem monitoring tool.
+ * Copyright (C) 2005  Gabriel Munoz <gabriel@xusia.net>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ */
+
+/*
+ * Hashes the files of close-write events, on a pool of its own, for
+ * the watches that want their contents:
+ *
+ * - GAL_DIGEST watches get the SHA-256 of the file attached to the
+ *   event (DIGEST_CONTENT).
+ *
+ * - GAL_CHANGED watches only get modifications that changed the file.
+ *   Each file closed after writing is given a fingerprint, its size and
+ *   a fast 64-bit hash of its contents, and the event is marked
+ *   unchanged when the fingerprint is the one the file had the last
+ *   time (DIGEST_FINGERPRINT).
+ *
+ * The event is held while its file is read, then matched against the
+ * client watches with find_matching_event_digested(). Files closed
+ * without being changed since they were last read, going by their
+ * (dev, ino, size, mtime), are served from a cache.
+ *
+ * The pool is bounded: past DIGEST_MAX_PENDING queued files, events are
+ * sent right away, without a digest and as if the file changed.
+ */
+
+#if HAVE_CONFIG_H
+#  include <config.h>
+#endif
+
+#if HAVE_STDLIB_H
+#  include <stdlib.h>
+#endif
+
+#if HAVE_STRING_H
+#  include <string.h>
+#endif
+
+#if HAVE_INTTYPES_H
+#  include <inttypes.h>
+#endif
+
+#if HAVE_SYS_TYPES_H
+#  include <sys/types.h>
+#endif
+
+#if HAVE_SYS_STAT_H
+#  include <sys/stat.h>
+#endif
+
+#if HAVE_FCNTL_H
+#  include <fcntl.h>
+#endif
+
+#if HAVE_UNISTD_H
+#  include <unistd.h>
+#endif
+
+#if HAVE_PTHREAD_H
+#  include <pthread.h>
+#endif
+
+#if HAVE_ERRNO_H
+#  include <errno.h>
+#endif
+
+#if HAVE_LIBGLIB_2_0
+#  include <glib.h>
+#endif
+
+#if HAVE_OPENSSL_EVP_H && HAVE_LIBCRYPTO
+#  include <openssl/evp.h>
+#  define HAVE_SHA256 1
+#endif
+
+#include "digest.h"
+#include "thread_pool.h"
+#include "self_events.h"
+#include "watch.h"
+#include "galaxy.h"
+#include "error.h"
+
+/* Links of the LRU lists; first member of the entries kept in them. */
+struct lru_node_t {
+	struct lru_node_t *next;
+	struct lru_node_t *prev;
+} lru_node_t;
+
+struct lru_t {
+	struct lru_node_t *head;  /* Most recently used. */
+	struct lru_node_t *tail;
+} lru_t;
+
+/* Running state of the 64-bit content hash. */
+struct fingerprint_t {
+	uint64_t hash;
+	uint64_t carry;         /* Bytes left over from the last update. */
+	unsigned int carried;
+} fingerprint_t;
+
+/* A file read before. */
+struct cached_digest_t {
+	struct lru_node_t node;
+	dev_t dev;                  /* Hash table key, with `ino'. */
+	ino_t ino;
+	off_t size;
+	struct timespec mtime;
+	uint64_t fingerprint;
+	int have_digest;            /* Only hashed if a GAL_DIGEST watch asked. */
+	unsigned char digest[GALAXY_DIGEST_LENGTH];
+} cached_digest_t;
+
+/* The fingerprint a path had when it was last closed after writing. */
+struct known_content_t {
+	struct lru_node_t node;
+	off_t size;
+	uint64_t fingerprint;
+	char path[1];               /* Hash table key. */
+} known_content_t;
+
+/* A close-write event waiting for its file to be read. */
+struct digest_job_t {
+	int wanted;                   /* DIGEST_* */
+	struct galaxy_event_t event;  /* Its name is `name'. */
+	char name[1];
+} digest_job_t;
+
+static thread_pool_t hashers = NULL;
+
+static pthread_mutex_t cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+static GHashTable *cache = NULL;  /* Of struct cached_digest_t, by itself. */
+static struct lru_t cache_lru;
+static GHashTable *known = NULL;  /* Of struct known_content_t, by path. */
+static struct lru_t known_lru;
+
+static guint
+cached_hash(gconstpointer key)
+{
+	const struct cached_digest_t *c = key;
+
+	return (guint)c->ino * 31 + (guint)c->dev;
+}
+
+static gboolean
+cached_equal(gconstpointer a, gconstpointer b)
+{
+	const struct cached_digest_t *c = a, *d = b;
+
+	return c->ino == d->ino && c->dev == d->dev;
+}
+
+static void
+lru_unlink(struct lru_t *lru, struct lru_node_t *n)
+{
+	if (n->prev != NULL)
+		n->prev->next = n->next;
+	else
+		lru->head = n->next;
+	if (n->next != NULL)
+		n->next->prev = n->prev;
+	else
+		lru->tail = n->prev;
+}
+
+static void
+lru_push(struct lru_t *lru, struct lru_node_t *n)
+{
+	n->prev = NULL;
+	n->next = lru->head;
+	if (lru->head != NULL)
+		lru->head->prev = n;
+	lru->head = n;
+	if (lru->tail == NULL)
+		lru->tail = n;
+}
+
+static uint64_t
+rotl64(uint64_t x, int r)
+{
+	return (x << r) | (x >> (64 - r));
+}
+
+static uint64_t
+fingerprint_mix(uint64_t hash, uint64_t word)
+{
+	hash ^= rotl64(word * 0x87c37b91114253d5ULL, 31) * 0x4cf5ad432745937fULL;
+	return rotl64(hash, 27) * 5 + 0x52dce729;
+}
+
+static void
+fingerprint_init(struct fingerprint_t *fp)
+{
+	fp->hash = 0x9e3779b97f4a7c15ULL;
+	fp->carry = 0;
+	fp->carried = 0;
+}
+
+/*
+ * Hashes `len' more bytes of the file, eight at a time. Bytes that don't
+ * make up a whole word are carried over to the next update, so the hash
+ * doesn't depend on how the file was split up to be read.
+ */
+static void
+fingerprint_update(struct fingerprint_t *fp, const unsigned char *data,
+	size_t len)
+{
+	uint64_t word;
+
+	while (fp->carried > 0 && fp->carried < 8 && len > 0) {
+		fp->carry |= (uint64_t)*data++ << (8 * fp->carried++);
+		len--;
+	}
+	if (fp->carried == 8) {
+		fp->hash = fingerprint_mix(fp->hash, fp->carry);
+		fp->carry = 0;
+		fp->carried = 0;
+	}
+	for (; len >= 8; data += 8, len -= 8) {
+		memcpy(&word, data, 8);
+		fp->hash = fingerprint_mix(fp->hash, word);
+	}
+	while (len > 0) {
+		fp->carry |= (uint64_t)*data++ << (8 * fp->carried++);
+		len--;
+	}
+}
+
+static uint64_t
+fingerprint_final(struct fingerprint_t *fp, off_t size)
+{
+	uint64_t hash;
+
+	hash = fp->hash;
+	if (fp->carried > 0)
+		hash = fingerprint_mix(hash, fp->carry);
+	hash ^= (uint64_t)size;
+	hash ^= hash >> 33;
+	hash *= 0xff51afd7ed558ccdULL;
+	hash ^= hash >> 33;
+	hash *= 0xc4ceb9fe1a85ec53ULL;
+	hash ^= hash >> 33;
+
+	return hash;
+}
+
+static int
+same_version(const struct cached_digest_t *c, const struct stat *statbuf)
+{
+	return c->size == statbuf->st_size &&
+		c->mtime.tv_sec == statbuf->st_mtim.tv_sec &&
+		c->mtime.tv_nsec == statbuf->st_mtim.tv_nsec;
+}
+
+static int
+unchanged(const struct stat *before, const struct stat *after)
+{
+	return before->st_size == after->st_size &&
+		before->st_mtim.tv_sec == after->st_mtim.tv_sec &&
+		before->st_mtim.tv_nsec == after->st_mtim.tv_nsec;
+}
+
+/*
+ * Looks up the file described by `statbuf' in the cache. A hit only
+ * counts if the file hasn't changed since it was read, and if it was
+ * given a SHA-256 when `wanted' asks for one.
+ *
+ * Return Value:
+ *   Returns 1 and fills in `found' on a hit, otherwise zero.
+ */
+static int
+cache_lookup(const struct stat *statbuf, int wanted,
+	struct cached_digest_t *found)
+{
+	struct cached_digest_t key, *c;
+	int hit = 0;
+
+	key.dev = statbuf->st_dev;
+	key.ino = statbuf->st_ino;
+	pthread_mutex_lock(&cache_mutex);
+	c = g_hash_table_lookup(cache, &key);
+	if (c != NULL && same_version(c, statbuf) &&
+	    (c->have_digest || !(wanted & DIGEST_CONTENT))) {
+		*found = *c;
+		lru_unlink(&cache_lru, &c->node);
+		lru_push(&cache_lru, &c->node);
+		hit = 1;
+	}
+	pthread_mutex_unlock(&cache_mutex);
+
+	return hit;
+}
+
+static void
+cache_store(const struct cached_digest_t *entry)
+{
+	struct cached_digest_t *c;
+
+	pthread_mutex_lock(&cache_mutex);
+	c = g_hash_table_lookup(cache, entry);
+	if (c != NULL) {
+		lru_unlink(&cache_lru, &c->node);
+	} else {
+		if (g_hash_table_size(cache) >= DIGEST_CACHE_SIZE) {
+			struct cached_digest_t *old = (struct cached_digest_t *)cache_lru.tail;
+			lru_unlink(&cache_lru, &old->node);
+			g_hash_table_remove(cache, old);
+			free(old);
+		}
+		c = malloc(sizeof(struct cached_digest_t));
+		if (c == NULL) {
+			pthread_mutex_unlock(&cache_mutex);
+			err_malloc(errno);
+			return;
+		}
+		c->dev = entry->dev;
+		c->ino = entry->ino;
+		g_hash_table_insert(cache, c, c);
+	}
+	c->size = entry->size;
+	c->mtime = entry->mtime;
+	c->fingerprint = entry->fingerprint;
+	c->have_digest = entry->have_digest;
+	memcpy(c->digest, entry->digest, GALAXY_DIGEST_LENGTH);
+	lru_push(&cache_lru, &c->node);
+	pthread_mutex_unlock(&cache_mutex);
+}
+
+/*
+ * Records the fingerprint `path' has now.
+ *
+ * Return Value:
+ *   Returns 1 if it is the one the path had before, otherwise zero.
+ */
+static int
+update_known_content(const char *path, off_t size, uint64_t fingerprint)
+{
+	struct known_content_t *k;
+	int same = 0;
+
+	pthread_mutex_lock(&cache_mutex);
+	k = g_hash_table_lookup(known, path);
+	if (k != NULL) {
+		same = k->size == size && k->fingerprint == fingerprint;
+		lru_unlink(&known_lru, &k->node);
+	} else {
+		if (g_hash_table_size(known) >= DIGEST_KNOWN_SIZE) {
+			struct known_content_t *old = (struct known_content_t *)known_lru.tail;
+			lru_unlink(&known_lru, &old->node);
+			g_hash_table_remove(known, old->path);
+			free(old);
+		}
+		k = malloc(sizeof(struct known_content_t) + strlen(path));
+		if (k == NULL) {
+			pthread_mutex_unlock(&cache_mutex);
+			err_malloc(errno);
+			return 0;
+		}
+		strcpy(k->path, path);
+		g_hash_table_insert(known, k->path, k);
+	}
+	k->size = size;
+	k->fingerprint = fingerprint;
+	lru_push(&known_lru, &k->node);
+	pthread_mutex_unlock(&cache_mutex);
+
+	return same;
+}
+
+/*
+ * Forgets the fingerprint of `path', so that a file created again in
+ * its place is never taken for the old one.
+ */
+void
+digest_forget(const char *path)
+{
+	struct known_content_t *k;
+
+	pthread_mutex_lock(&cache_mutex);
+	if (known != NULL && g_hash_table_size(known) > 0 &&
+	    (k = g_hash_table_lookup(known, path)) != NULL) {
+		lru_unlink(&known_lru, &k->node);
+		g_hash_table_remove(known, k->path);
+		free(k);
+	}
+	pthread_mutex_unlock(&cache_mutex);
+}
+
+/*
+ * Reads the open file `fd' into the fingerprint of `entry', and also its
+ * SHA-256 if `wanted' asks for one.
+ *
+ * The file is read rather than mapped: it may be truncated while it is
+ * hashed, and touching a mapping past the new end raises SIGBUS.
+ *
+ * Return Value:
+ *   Returns zero on success, or -1 if the file couldn't be read.
+ */
+static int
+hash_file(int fd, int wanted, struct cached_digest_t *entry)
+{
+	struct fingerprint_t fp;
+	unsigned char buf[65536];
+	ssize_t bytes;
+	uint64_t total = 0;
+	int ret = 0;
+#if HAVE_SHA256
+	EVP_MD_CTX *ctx = NULL;
+	unsigned int len;
+
+	if (wanted & DIGEST_CONTENT) {
+		ctx = EVP_MD_CTX_new();
+		if (ctx == NULL || EVP_DigestInit_ex(ctx, EVP_sha256(), NULL) != 1) {
+			err_msg("error[hash_file]: Unable to set up SHA-256.\n");
+			EVP_MD_CTX_free(ctx);
+			return -1;
+		}
+	}
+#endif
+	fingerprint_init(&fp);
+
+	while ((bytes = read(fd, buf, sizeof(buf))) != 0) {
+		if (bytes < 0 && errno == EINTR)
+			continue;
+		if (bytes < 0) {
+			ret = -1;
+			break;
+		}
+		fingerprint_update(&fp, buf, bytes);
+#if HAVE_SHA256
+		if (ctx != NULL)
+			EVP_DigestUpdate(ctx, buf, bytes);
+#endif
+		total += bytes;
+	}
+
+	entry->fingerprint = fingerprint_final(&fp, total);
+	entry->have_digest = 0;
+#if HAVE_SHA256
+	if (ctx != NULL) {
+		if (ret == 0 && EVP_DigestFinal_ex(ctx, entry->digest, &len) == 1)
+			entry->have_digest = 1;
+		EVP_MD_CTX_free(ctx);
+	}
+#endif
+
+	return ret;
+}
+
+/*
+ * Reads the file of a close-write event, unless the cache already has
+ * it, and matches the event against the client watches. A file that is
+ * gone, or isn't a regular file, is taken as changed and given no
+ * digest.
+ */
+static void
+digest_job(void *arg)
+{
+	struct digest_job_t *job = arg;
+	struct cached_digest_t entry;
+	struct stat before, after;
+	int fd, found = 0, same = 0;
+
+	/* Our own reads are not reported. */
+	self_scan_begin(job->name);
+	fd = open(job->name, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+	if (fd >= 0 && fstat(fd, &before) == 0 && S_ISREG(before.st_mode)) {
+		if (cache_lookup(&before, job->wanted, &entry)) {
+			found = 1;
+		} else if (hash_file(fd, job->wanted, &entry) == 0) {
+			found = 1;
+			/* Only a file that held still while it was read is
+			 * known to have these contents. */
+			if (fstat(fd, &after) == 0 && unchanged(&before, &after)) {
+				entry.dev = before.st_dev;
+				entry.ino = before.st_ino;
+				entry.size = before.st_size;
+				entry.mtime = before.st_mtim;
+				cache_store(&entry);
+			}
+		}
+	}
+	if (fd >= 0)
+		close(fd);
+	self_scan_end(job->name);
+
+	if (found && job->wanted & DIGEST_CONTENT && entry.have_digest) {
+		memcpy(job->event.digest, entry.digest, GALAXY_DIGEST_LENGTH);
+		job->event.digest_len = GALAXY_DIGEST_LENGTH;
+	}
+	if (found && job->wanted & DIGEST_FINGERPRINT)
+		same = update_known_content(job->name, before.st_size,
+			entry.fingerprint);
+	else if (job->wanted & DIGEST_FINGERPRINT)
+		digest_forget(job->name);
+
+	find_matching_event_digested(&job->event, same);
+	free(job);
+}
+
+int
+init_digest(void)
+{
+	cache = g_hash_table_new(cached_hash, cached_equal);
+	known = g_hash_table_new(g_str_hash, g_str_equal);
+	hashers = thread_pool_create(DIGEST_THREADS);
+	if (hashers == NULL) {
+		err_msg("error[init_digest]: Unable to create the hashing threads.\n");
+		return -1;
+	}
+
+	return 0;
+}
+
+void
+destroy_digest(void)
+{
+	struct lru_node_t *n;
+
+	if (hashers != NULL)
+		thread_pool_destroy(hashers);
+	hashers = NULL;
+
+	pthread_mutex_lock(&cache_mutex);
+	while ((n = cache_lru.head) != NULL) {
+		lru_unlink(&cache_lru, n);
+		free(n);
+	}
+	while ((n = known_lru.head) != NULL) {
+		lru_unlink(&known_lru, n);
+		free(n);
+	}
+	if (cache != NULL)
+		g_hash_table_destroy(cache);
+	cache = NULL;
+	if (known != NULL)
+		g_hash_table_destroy(known);
+	known = NULL;
+	pthread_mutex_unlock(&cache_mutex);
+}
+
+/*
+ * Queues the close-write event `gevent' to have its file read for the
+ * DIGEST_* in `wanted'. It is matched against the client watches once
+ * the file has been read.
+ *
+ * Return Value:
+ *   Returns zero if the event was queued, or -1 if the caller has to
+ *   match it right away, as it is.
+ */
+int
+digest_event(const struct galaxy_event_t *gevent, int wanted)
+{
+	struct digest_job_t *job;
+
+#if !HAVE_SHA256
+	wanted &= ~DIGEST_CONTENT;
+#endif
+	if (wanted == 0 || hashers == NULL ||
+	    thread_pool_pending(hashers) >= DIGEST_MAX_PENDING)
+		return -1;
+
+	job = malloc(sizeof(struct digest_job_t) + strlen(gevent->name));
+	if (job == NULL) {
+		err_malloc(errno);
+		return -1;
+	}
+	strcpy(job->name, gevent->name);
+	job->wanted = wanted;
+	job->event = *gevent;
+	job->event.name = job->name;
+	job->event.old_name = NULL;
+	job->event.digest_len = 0;
+
+	if (thread_pool_submit(hashers, digest_job, job) < 0) {
+		free(job);
+		return -1;
+	}
+
+	return 0;
+}
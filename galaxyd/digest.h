@@ -0,0 +1,53 @@
+/*
+ * Galaxy - A filesystem monitoring tool.
+ * Copyright (C) 2005  Gabriel Munoz <gabriel@xusia.net>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ */
+
+#ifndef DIGEST_H
+#define DIGEST_H
+
+#if HAVE_CONFIG_H
+#  include <config.h>
+#endif
+
+/* Threads hashing files. */
+#define DIGEST_THREADS      2
+
+/* Most files waiting to be hashed. */
+#define DIGEST_MAX_PENDING  1024
+
+/* Most digests kept for files that may be closed again unchanged. */
+#define DIGEST_CACHE_SIZE   4096
+
+/* Most paths whose fingerprint is kept for GAL_CHANGED watches. */
+#define DIGEST_KNOWN_SIZE   65536
+
+/* What a close-write event's file is read for. */
+#define DIGEST_CONTENT      0x1  /* SHA-256, for GAL_DIGEST watches */
+#define DIGEST_FINGERPRINT  0x2  /* Changed or not, for GAL_CHANGED watches */
+
+/* Initialization and destruction routines -- called once on
+ * startup/shutdown. */
+int init_digest(void);
+void destroy_digest(void);
+
+struct galaxy_event_t;
+int digest_event(const struct galaxy_event_t *gevent, int wanted);
+void digest_forget(const char *path);
+
+#endif
@@ -0,0 +1,609 @@
+/*
+ * Galaxy - A filesystem monitoring tool.
+ * Copyright (C) 2005  Gabriel Munoz <gabriel@xusia.net>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ */
+
+#if HAVE_CONFIG_H
+#  include <config.h>
+#endif
+
+#if HAVE_STDLIB_H
+#  include <stdlib.h>
+#endif
+
+#if HAVE_STRING_H
+#  include <string.h>
+#endif
+
+#if HAVE_PTHREAD_H
+#  include <pthread.h>
+#endif
+
+#if HAVE_ERRNO_H
+#  include <errno.h>
+#endif
+
+#if HAVE_LIBGLIB_2_0
+#  include <glib.h>
+#endif
+
+#include "dir_tree.h"
+#include "error.h"
+
+/* Large enough for a PATH_MAX directory plus a NAME_MAX event name. */
+#define PATH_BUFFER_LEN  (4096 + 256 + 2)
+
+/* An interned path component. The string is the hash table key, and
+ * the structure is its value. */
+struct name_t {
+	unsigned long refs;
+	char str[1];
+} name_t;
+
+static struct dir_node_t *root = NULL;  /* Represents "/". */
+static GHashTable *names;               /* Interned components. */
+static GHashTable *wd_nodes;            /* wd => struct dir_node_t. */
+static GHashTable *child_nodes;         /* (parent, name) => child. */
+static unsigned long nnodes = 0;
+
+static pthread_mutex_t dir_tree_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t path_key;
+static pthread_once_t path_key_once = PTHREAD_ONCE_INIT;
+
+/*
+ * Returns the interned copy of `name', taking a reference on it. Equal
+ * path components share a single copy no matter how many directories
+ * use them.
+ */
+static const char *
+intern_name(const char *name)
+{
+	struct name_t *n;
+	size_t len;
+
+	n = g_hash_table_lookup(names, name);
+	if (n == NULL) {
+		len = strlen(name);
+		n = malloc(sizeof(struct name_t) + len);
+		if (n == NULL) {
+			err_malloc(errno);
+			err_msg("error[intern_name]: Unable to malloc name '%s'.\n", name);
+			return NULL;
+		}
+		n->refs = 0;
+		memcpy(n->str, name, len + 1);
+		g_hash_table_insert(names, n->str, n);
+	}
+	n->refs++;
+
+	return n->str;
+}
+
+static void
+release_name(const char *name)
+{
+	struct name_t *n;
+
+	n = g_hash_table_lookup(names, name);
+	if (n == NULL)
+		return;
+	if (--n->refs == 0) {
+		g_hash_table_remove(names, n->str);
+		free(n);
+	}
+}
+
+/* Interned names are unique, so a child is keyed on the pointers of its
+ * parent and of its name. */
+static guint
+child_hash(gconstpointer key)
+{
+	const struct dir_node_t *node = key;
+
+	return (guint)(((unsigned long)node->parent >> 3) * 31 +
+		((unsigned long)node->name >> 3));
+}
+
+static gboolean
+child_equal(gconstpointer a, gconstpointer b)
+{
+	const struct dir_node_t *x = a, *y = b;
+
+	return x->parent == y->parent && x->name == y->name;
+}
+
+static struct dir_node_t *
+create_node(struct dir_node_t *parent, const char *name)
+{
+	struct dir_node_t *node;
+
+	node = malloc(sizeof(struct dir_node_t));
+	if (node == NULL) {
+		err_malloc(errno);
+		err_msg("error[create_node]: Unable to malloc a dir_node_t.\n");
+		return NULL;
+	}
+	node->name = intern_name(name);
+	if (node->name == NULL) {
+		free(node);
+		return NULL;
+	}
+	node->parent = parent;
+	node->children = NULL;
+	node->prev = NULL;
+	node->next = NULL;
+	node->wd = -1;
+	node->mask = 0;
+	node->active = 0;
+	node->burst_second = 0;
+	node->burst = 0;
+	node->listing = NULL;
+	nnodes++;
+
+	return node;
+}
+
+static void
+link_node(struct dir_node_t *node)
+{
+	struct dir_node_t *parent = node->parent;
+
+	node->prev = NULL;
+	node->next = parent->children;
+	if (parent->children != NULL)
+		parent->children->prev = node;
+	parent->children = node;
+	g_hash_table_insert(child_nodes, node, node);
+}
+
+static void
+unlink_node(struct dir_node_t *node)
+{
+	g_hash_table_remove(child_nodes, node);
+	if (node->prev != NULL)
+		node->prev->next = node->next;
+	else if (node->parent != NULL)
+		node->parent->children = node->next;
+	if (node->next != NULL)
+		node->next->prev = node->prev;
+	node->prev = node->next = NULL;
+}
+
+static void
+destroy_node(struct dir_node_t *node)
+{
+	if (node->wd >= 0)
+		g_hash_table_remove(wd_nodes, &node->wd);
+	release_name(node->name);
+	listing_destroy(node->listing);
+	free(node);
+	nnodes--;
+}
+
+static void
+destroy_path_buffer(void *buf)
+{
+	free(buf);
+}
+
+static void
+create_path_key(void)
+{
+	pthread_key_create(&path_key, destroy_path_buffer);
+}
+
+/*
+ * Returns the calling thread's path buffer, allocating it on first use.
+ */
+static char *
+path_buffer(void)
+{
+	char *buf;
+
+	pthread_once(&path_key_once, create_path_key);
+	buf = pthread_getspecific(path_key);
+	if (buf == NULL) {
+		buf = malloc(PATH_BUFFER_LEN);
+		if (buf == NULL) {
+			err_malloc(errno);
+			err_msg("error[path_buffer]: Unable to malloc path buffer.\n");
+			return NULL;
+		}
+		pthread_setspecific(path_key, buf);
+	}
+
+	return buf;
+}
+
+/*
+ * Initialize the directory tree with a lone root node.
+ */
+int
+init_dir_tree(void)
+{
+	names = g_hash_table_new(g_str_hash, g_str_equal);
+	wd_nodes = g_hash_table_new(g_int_hash, g_int_equal);
+	child_nodes = g_hash_table_new(child_hash, child_equal);
+	if (names == NULL || wd_nodes == NULL || child_nodes == NULL)
+		return -1;
+
+	root = create_node(NULL, "");
+	if (root == NULL)
+		return -1;
+
+	return 0;
+}
+
+static void
+destroy_subtree(struct dir_node_t *node)
+{
+	struct dir_node_t *child, *next;
+
+	for (child = node->children; child != NULL; child = next) {
+		next = child->next;
+		destroy_subtree(child);
+	}
+	destroy_node(node);
+}
+
+/*
+ * Destroys every node in the tree. Like the client watches container,
+ * this should only be called once at the final tear-down.
+ */
+void
+destroy_dir_tree(void)
+{
+	destroy_subtree(root);
+	root = NULL;
+	g_hash_table_destroy(child_nodes);
+	g_hash_table_destroy(wd_nodes);
+	g_hash_table_destroy(names);
+}
+
+void
+dir_tree_lock(void)
+{
+	pthread_mutex_lock(&dir_tree_mutex);
+}
+
+void
+dir_tree_unlock(void)
+{
+	pthread_mutex_unlock(&dir_tree_mutex);
+}
+
+/*
+ * Looks up the child of `node' with the path component `name'.
+ *
+ * Return Value:
+ *   The child node, or NULL if there is no such child.
+ */
+struct dir_node_t *
+dir_node_child(const struct dir_node_t *node, const char *name)
+{
+	struct name_t *n;
+	struct dir_node_t key;
+
+	/* A component that was never interned can't name any node. */
+	n = g_hash_table_lookup(names, name);
+	if (n == NULL)
+		return NULL;
+
+	key.parent = (struct dir_node_t *)node;
+	key.name = n->str;
+
+	return g_hash_table_lookup(child_nodes, &key);
+}
+
+/*
+ * Walks the absolute `path' one component at a time. Missing nodes are
+ * created (without a watch descriptor) if `create' is set.
+ */
+static struct dir_node_t *
+walk_path(const char *path, int create)
+{
+	struct dir_node_t *node, *child;
+	const char *p, *end;
+	char component[256];
+	size_t len;
+
+	if (path == NULL || path[0] != '/')
+		return NULL;
+
+	node = root;
+	for (p = path; *p != '\0'; p = end) {
+		while (*p == '/')
+			p++;
+		end = strchr(p, '/');
+		if (end == NULL)
+			end = p + strlen(p);
+		len = end - p;
+		if (len == 0 || (len == 1 && p[0] == '.'))
+			continue;
+		if (len >= sizeof(component))
+			return NULL;
+		memcpy(component, p, len);
+		component[len] = '\0';
+
+		child = dir_node_child(node, component);
+		if (child == NULL) {
+			if (!create)
+				return NULL;
+			child = create_node(node, component);
+			if (child == NULL)
+				return NULL;
+			link_node(child);
+		}
+		node = child;
+	}
+
+	return node;
+}
+
+/*
+ * Returns the node for the absolute `path', creating it and any missing
+ * parent nodes.
+ */
+struct dir_node_t *
+dir_tree_insert(const char *path)
+{
+	return walk_path(path, 1);
+}
+
+struct dir_node_t *
+dir_tree_lookup(const char *path)
+{
+	return walk_path(path, 0);
+}
+
+struct dir_node_t *
+dir_tree_lookup_wd(int wd)
+{
+	return g_hash_table_lookup(wd_nodes, &wd);
+}
+
+/*
+ * Returns the number of nodes in the tree, including the root node and
+ * unwatched intermediate nodes.
+ */
+unsigned long
+dir_tree_size(void)
+{
+	return nnodes;
+}
+
+/*
+ * Returns the number of nodes that hold an inotify watch.
+ */
+unsigned long
+dir_tree_watches(void)
+{
+	return g_hash_table_size(wd_nodes);
+}
+
+/*
+ * Associates the watch descriptor `wd' with `node'. The node's own wd
+ * field is the hash table key, so no extra allocation is needed.
+ *
+ * Return Value:
+ *   Returns -1 if `wd' already belongs to another node (e.g. the same
+ *   directory reached through a bind mount), otherwise zero.
+ */
+int
+dir_node_set_wd(struct dir_node_t *node, int wd, uint32_t mask)
+{
+	struct dir_node_t *other;
+
+	other = g_hash_table_lookup(wd_nodes, &wd);
+	if (other != NULL && other != node)
+		return -1;
+
+	if (node->wd >= 0 && node->wd != wd)
+		g_hash_table_remove(wd_nodes, &node->wd);
+	node->wd = wd;
+	node->mask = mask;
+	node->active = time(NULL);
+	g_hash_table_insert(wd_nodes, &node->wd, node);
+
+	return 0;
+}
+
+void
+dir_node_clear_wd(struct dir_node_t *node)
+{
+	if (node->wd < 0)
+		return;
+	g_hash_table_remove(wd_nodes, &node->wd);
+	node->wd = -1;
+	node->mask = 0;
+	listing_destroy(node->listing);
+	node->listing = NULL;
+}
+
+/*
+ * Re-homes `node' (and implicitly its whole subtree) under `parent'
+ * with the new path component `name'. Descendant paths are derived, so
+ * nothing else needs to change. The old parent is pruned if the move
+ * left it as an empty intermediate node.
+ *
+ * Return Value:
+ *   Returns -1 if the destination is already occupied or on allocation
+ *   failure, otherwise zero.
+ */
+int
+dir_node_move(struct dir_node_t *node, struct dir_node_t *parent,
+	const char *name)
+{
+	const char *old_name;
+	struct dir_node_t *p, *old_parent;
+
+	if (dir_node_child(parent, name) != NULL)
+		return -1;
+
+	/* Refuse to move a node underneath itself. */
+	for (p = parent; p != NULL; p = p->parent)
+		if (p == node)
+			return -1;
+
+	unlink_node(node);
+	old_name = node->name;
+	node->name = intern_name(name);
+	if (node->name == NULL) {
+		node->name = old_name;
+		link_node(node);
+		return -1;
+	}
+	release_name(old_name);
+	old_parent = node->parent;
+	node->parent = parent;
+	link_node(node);
+	dir_node_prune(old_parent);
+
+	return 0;
+}
+
+/*
+ * Frees `node' if it neither holds a watch nor has any children, and
+ * then does the same for its ancestors. Intermediate nodes only exist
+ * to connect watched directories, so they go away with them.
+ */
+void
+dir_node_prune(struct dir_node_t *node)
+{
+	struct dir_node_t *parent;
+
+	while (node != NULL && node != root && node->wd < 0 &&
+	       node->children == NULL) {
+		parent = node->parent;
+		unlink_node(node);
+		destroy_node(node);
+		node = parent;
+	}
+}
+
+/*
+ * Removes `node' and its whole subtree from the tree. If `func' is
+ * non-NULL, it is called on every node of the subtree (children before
+ * their parent) before that node is freed, e.g. to remove its watch.
+ * The parent of `node' is pruned afterwards.
+ */
+void
+dir_node_remove(struct dir_node_t *node,
+	void (*func)(struct dir_node_t *node, void *data), void *data)
+{
+	struct dir_node_t *parent, *n, *next;
+
+	if (node == NULL || node == root)
+		return;
+
+	parent = node->parent;
+	unlink_node(node);
+
+	/* Post-order walk using the parent links, so that deep trees don't
+	 * recurse on the stack. */
+	n = node;
+	while (n != NULL) {
+		while (n->children != NULL)
+			n = n->children;
+		if (func != NULL)
+			func(n, data);
+		if (n == node) {
+			destroy_node(n);
+			break;
+		}
+		next = n->parent;
+		unlink_node(n);
+		destroy_node(n);
+		n = next;
+	}
+	dir_node_prune(parent);
+}
+
+/*
+ * Builds the full path of `node' into the calling thread's path buffer.
+ * If `name' is non-NULL and non-empty, it is appended as a final
+ * component (e.g. the name from an inotify event).
+ *
+ * The returned buffer is overwritten by the next call from the same
+ * thread; copy it if it needs to outlive that.
+ *
+ * Return Value:
+ *   Returns the path, or NULL if it does not fit in the buffer.
+ */
+char *
+dir_node_path(const struct dir_node_t *node, const char *name)
+{
+	const struct dir_node_t *n;
+	char *buf, *p;
+	size_t len = 0, l;
+
+	buf = path_buffer();
+	if (buf == NULL)
+		return NULL;
+
+	for (n = node; n != NULL && n != root; n = n->parent)
+		len += strlen(n->name) + 1;
+	if (name != NULL && name[0] != '\0')
+		len += strlen(name) + 1;
+	if (len >= PATH_BUFFER_LEN)
+		return NULL;
+	if (len == 0) {
+		strcpy(buf, "/");
+		return buf;
+	}
+
+	/* Fill the buffer from the end, walking up towards the root. */
+	p = buf + len;
+	*p = '\0';
+	if (name != NULL && name[0] != '\0') {
+		l = strlen(name);
+		p -= l;
+		memcpy(p, name, l);
+		*--p = '/';
+	}
+	for (n = node; n != NULL && n != root; n = n->parent) {
+		l = strlen(n->name);
+		p -= l;
+		memcpy(p, n->name, l);
+		*--p = '/';
+	}
+
+	return buf;
+}
+
+/*
+ * Convenience wrapper that takes the tree lock and builds the path of
+ * the directory watched by `wd', with `name' appended.
+ *
+ * Return Value:
+ *   Returns the thread's path buffer, or NULL if `wd' is unknown.
+ */
+char *
+dir_tree_wd_path(int wd, const char *name)
+{
+	struct dir_node_t *node;
+	char *path = NULL;
+
+	dir_tree_lock();
+	node = dir_tree_lookup_wd(wd);
+	if (node != NULL)
+		path = dir_node_path(node, name);
+	dir_tree_unlock();
+
+	return path;
+}
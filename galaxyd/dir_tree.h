@@ -0,0 +1,85 @@
+/*
+ * Galaxy - A filesystem monitoring tool.
+ * Copyright (C) 2005  Gabriel Munoz <gabriel@xusia.net>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ */
+
+#ifndef DIR_TREE_H
+#define DIR_TREE_H
+
+#if HAVE_CONFIG_H
+#  include <config.h>
+#endif
+
+#if HAVE_INTTYPES_H
+#  include <inttypes.h>
+#endif
+
+#include <time.h>
+
+#include "listing.h"
+
+/*
+ * A watched directory. Directories are kept as a tree of nodes that
+ * only store their own (interned) path component, so full paths are
+ * never stored and a rename is a single node update.
+ */
+struct dir_node_t {
+	struct dir_node_t *parent;
+	struct dir_node_t *children;  /* First child. */
+	struct dir_node_t *next;      /* Next sibling. */
+	struct dir_node_t *prev;      /* Previous sibling. */
+	const char *name;             /* Interned path component. */
+	int wd;                       /* Inotify watch descriptor or -1. */
+	uint32_t mask;                /* Mask the watch was added with. */
+	time_t active;                /* Last event seen on the watch. */
+	time_t burst_second;          /* Second `burst' was counted in. */
+	unsigned int burst;           /* Events in the subtree that second. */
+	listing_t listing;            /* Kept for overflow recovery. */
+};
+
+/* Initialization and destruction routines -- called once on
+ * startup/shutdown. */
+int init_dir_tree(void);
+void destroy_dir_tree(void);
+
+/* Every dir_tree_* and dir_node_* function below requires the caller to
+ * hold the tree lock, unless noted otherwise. */
+void dir_tree_lock(void);
+void dir_tree_unlock(void);
+
+struct dir_node_t *dir_tree_insert(const char *path);
+struct dir_node_t *dir_tree_lookup(const char *path);
+struct dir_node_t *dir_tree_lookup_wd(int wd);
+unsigned long dir_tree_size(void);
+unsigned long dir_tree_watches(void);
+
+struct dir_node_t *dir_node_child(const struct dir_node_t *node,
+	const char *name);
+int dir_node_set_wd(struct dir_node_t *node, int wd, uint32_t mask);
+void dir_node_clear_wd(struct dir_node_t *node);
+int dir_node_move(struct dir_node_t *node, struct dir_node_t *parent,
+	const char *name);
+void dir_node_prune(struct dir_node_t *node);
+void dir_node_remove(struct dir_node_t *node,
+	void (*func)(struct dir_node_t *node, void *data), void *data);
+char *dir_node_path(const struct dir_node_t *node, const char *name);
+
+/* Takes the tree lock itself. */
+char *dir_tree_wd_path(int wd, const char *name);
+
+#endif
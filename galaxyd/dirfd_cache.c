@@ -0,0 +1,244 @@
+/*
+ * Galaxy - A filesystem monitoring tool.
+ * Copyright (C) 2005  Gabriel Munoz <gabriel@xusia.net>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ */
+
+/*
+ * Directory descriptors for stat enrichment (see GAL_STAT). Events are
+ * stat'ed with fstatat(2) relative to a descriptor of their directory,
+ * so the path is only walked when the directory is first opened. The
+ * most recently used DIRFD_CACHE_SIZE descriptors are kept open.
+ *
+ * The descriptors are opened with O_PATH, which raises no inotify or
+ * fanotify events. A descriptor follows its directory when it is
+ * renamed, so entries are dropped when their directory goes away from
+ * its path (see dirfd_cache_forget()).
+ */
+
+#define _GNU_SOURCE  /* O_PATH */
+
+#if HAVE_CONFIG_H
+#  include <config.h>
+#endif
+
+#if HAVE_STDLIB_H
+#  include <stdlib.h>
+#endif
+
+#if HAVE_STRING_H
+#  include <string.h>
+#endif
+
+#if HAVE_SYS_TYPES_H
+#  include <sys/types.h>
+#endif
+
+#if HAVE_SYS_STAT_H
+#  include <sys/stat.h>
+#endif
+
+#if HAVE_FCNTL_H
+#  include <fcntl.h>
+#endif
+
+#if HAVE_UNISTD_H
+#  include <unistd.h>
+#endif
+
+#if HAVE_PTHREAD_H
+#  include <pthread.h>
+#endif
+
+#if HAVE_ERRNO_H
+#  include <errno.h>
+#endif
+
+#if HAVE_LIBGLIB_2_0
+#  include <glib.h>
+#endif
+
+#include "dirfd_cache.h"
+#include "error.h"
+
+/* An open directory. Entries are kept in LRU order, most recent first. */
+struct dirfd_t {
+	struct dirfd_t *next;
+	struct dirfd_t *prev;
+	int fd;
+	char path[1];
+} dirfd_t;
+
+static pthread_mutex_t dirfd_mutex = PTHREAD_MUTEX_INITIALIZER;
+static GHashTable *dirfds = NULL;     /* Of struct dirfd_t, by path. */
+static struct dirfd_t *lru_head = NULL;
+static struct dirfd_t *lru_tail = NULL;
+
+static void
+lru_unlink(struct dirfd_t *d)
+{
+	if (d->prev != NULL)
+		d->prev->next = d->next;
+	else
+		lru_head = d->next;
+	if (d->next != NULL)
+		d->next->prev = d->prev;
+	else
+		lru_tail = d->prev;
+}
+
+static void
+lru_push(struct dirfd_t *d)
+{
+	d->prev = NULL;
+	d->next = lru_head;
+	if (lru_head != NULL)
+		lru_head->prev = d;
+	lru_head = d;
+	if (lru_tail == NULL)
+		lru_tail = d;
+}
+
+static void
+drop_dirfd(struct dirfd_t *d)
+{
+	lru_unlink(d);
+	g_hash_table_remove(dirfds, d->path);
+	close(d->fd);
+	free(d);
+}
+
+int
+init_dirfd_cache(void)
+{
+	dirfds = g_hash_table_new(g_str_hash, g_str_equal);
+
+	return 0;
+}
+
+void
+destroy_dirfd_cache(void)
+{
+	pthread_mutex_lock(&dirfd_mutex);
+	while (lru_head != NULL)
+		drop_dirfd(lru_head);
+	g_hash_table_destroy(dirfds);
+	dirfds = NULL;
+	pthread_mutex_unlock(&dirfd_mutex);
+}
+
+/*
+ * Return Value:
+ *   Returns the cached descriptor of the directory `dirname', opening it
+ *   if needed, or NULL if it can't be opened. Called with the mutex held.
+ */
+static struct dirfd_t *
+lookup_dirfd(const char *dirname)
+{
+	struct dirfd_t *d;
+	size_t len;
+	int fd;
+
+	d = g_hash_table_lookup(dirfds, dirname);
+	if (d != NULL) {
+		lru_unlink(d);
+		lru_push(d);
+		return d;
+	}
+
+	fd = open(dirname, O_PATH | O_DIRECTORY | O_CLOEXEC);
+	if (fd < 0)
+		return NULL;
+
+	len = strlen(dirname);
+	d = malloc(sizeof(struct dirfd_t) + len);
+	if (d == NULL) {
+		err_malloc(errno);
+		close(fd);
+		return NULL;
+	}
+	d->fd = fd;
+	memcpy(d->path, dirname, len + 1);
+
+	if (g_hash_table_size(dirfds) >= DIRFD_CACHE_SIZE)
+		drop_dirfd(lru_tail);
+	g_hash_table_insert(dirfds, d->path, d);
+	lru_push(d);
+
+	return d;
+}
+
+/*
+ * Like lstat(2) on the absolute path `path', but relative to a cached
+ * descriptor of its directory.
+ *
+ * Return Value:
+ *   Returns zero on success, or -1 if `path' couldn't be stat'ed.
+ */
+int
+dirfd_cache_stat(const char *path, struct stat *statbuf)
+{
+	struct dirfd_t *d;
+	const char *slash;
+	char dirname[4097];
+	size_t len;
+	int ret;
+
+	slash = strrchr(path, '/');
+	if (slash == NULL || slash[1] == '\0')
+		return -1;
+	len = slash - path;
+	if (len == 0)
+		len = 1;  /* The root directory. */
+	if (len >= sizeof(dirname))
+		return -1;
+	memcpy(dirname, path, len);
+	dirname[len] = '\0';
+
+	pthread_mutex_lock(&dirfd_mutex);
+	d = lookup_dirfd(dirname);
+	ret = d ? fstatat(d->fd, slash + 1, statbuf, AT_SYMLINK_NOFOLLOW) : -1;
+	pthread_mutex_unlock(&dirfd_mutex);
+
+	return ret < 0 ? -1 : 0;
+}
+
+/*
+ * Drops the descriptors of the directory `dirname' and of every
+ * directory below it, once they may no longer be at those paths (the
+ * directory was deleted or moved away).
+ */
+void
+dirfd_cache_forget(const char *dirname)
+{
+	struct dirfd_t *d, *next;
+	size_t len;
+
+	len = strlen(dirname);
+	pthread_mutex_lock(&dirfd_mutex);
+	if (dirfds == NULL || g_hash_table_size(dirfds) == 0) {
+		pthread_mutex_unlock(&dirfd_mutex);
+		return;
+	}
+	for (d = lru_head; d != NULL; d = next) {
+		next = d->next;
+		if (strncmp(d->path, dirname, len) == 0 &&
+		    (d->path[len] == '\0' || d->path[len] == '/'))
+			drop_dirfd(d);
+	}
+	pthread_mutex_unlock(&dirfd_mutex);
+}
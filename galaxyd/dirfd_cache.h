@@ -0,0 +1,43 @@
+/*
+ * Galaxy - A filesystem monitoring tool.
+ * Copyright (C) 2005  Gabriel Munoz <gabriel@xusia.net>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ */
+
+#ifndef DIRFD_CACHE_H
+#define DIRFD_CACHE_H
+
+#if HAVE_CONFIG_H
+#  include <config.h>
+#endif
+
+#if HAVE_SYS_STAT_H
+#  include <sys/stat.h>
+#endif
+
+/* Most directory descriptors kept open. */
+#define DIRFD_CACHE_SIZE 256
+
+/* Initialization and destruction routines -- called once on
+ * startup/shutdown. */
+int init_dirfd_cache(void);
+void destroy_dirfd_cache(void);
+
+int dirfd_cache_stat(const char *path, struct stat *statbuf);
+void dirfd_cache_forget(const char *dirname);
+
+#endif
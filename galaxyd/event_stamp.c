@@ -0,0 +1,60 @@
+/*
+ * Galaxy - A filesystem monitoring tool.
+ * Copyright (C) 2005  Gabriel Munoz <gabriel@xusia.net>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ */
+
+#if HAVE_CONFIG_H
+#  include <config.h>
+#endif
+
+#include <time.h>
+
+#if HAVE_PTHREAD_H
+#  include <pthread.h>
+#endif
+
+#include "event_stamp.h"
+
+static pthread_mutex_t sequence_mutex = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t next_sequence = 1;
+
+static uint64_t
+clock_ns(clockid_t clock)
+{
+	struct timespec ts;
+
+	clock_gettime(clock, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * Stamps `count' events read together with the current time, and
+ * reserves a sequence number for each of them. The first one is left in
+ * `stamp'; the others are the ones that follow it.
+ */
+void
+stamp_events(struct event_stamp_t *stamp, unsigned int count)
+{
+	stamp->monotonic_ns = clock_ns(CLOCK_MONOTONIC);
+	stamp->realtime_ns = clock_ns(CLOCK_REALTIME);
+
+	pthread_mutex_lock(&sequence_mutex);
+	stamp->sequence = next_sequence;
+	next_sequence += count;
+	pthread_mutex_unlock(&sequence_mutex);
+}
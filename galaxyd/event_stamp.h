@@ -0,0 +1,44 @@
+/*
+ * Galaxy - A filesystem monitoring tool.
+ * Copyright (C) 2005  Gabriel Munoz <gabriel@xusia.net>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ */
+
+#ifndef EVENT_STAMP_H
+#define EVENT_STAMP_H
+
+#if HAVE_CONFIG_H
+#  include <config.h>
+#endif
+
+#if HAVE_INTTYPES_H
+#  include <inttypes.h>
+#endif
+
+/*
+ * When the daemon read an event from the kernel, and where the event
+ * falls among all the events the daemon has read.
+ */
+struct event_stamp_t {
+	uint64_t sequence;      /* Starts at 1; never reused. */
+	uint64_t monotonic_ns;  /* CLOCK_MONOTONIC. */
+	uint64_t realtime_ns;   /* CLOCK_REALTIME. */
+};
+
+void stamp_events(struct event_stamp_t *stamp, unsigned int count);
+
+#endif
@@ -0,0 +1,635 @@
+/*
+ * Galaxy - A filesystem monitoring tool.
+ * Copyright (C) 2005  Gabriel Munoz <gabriel@xusia.net>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ */
+
+/*
+ * An alternative to the per-directory inotify watches: the file systems
+ * holding the roots are marked as a whole with fanotify(7), so changes
+ * anywhere on them are reported without a crawl or a watch for every
+ * directory. Events carry a handle for the parent directory and the
+ * name of the entry (FAN_REPORT_DFID_NAME). The handle is opened and
+ * resolved to a path, and from there on the event takes the same way as
+ * an inotify one, along with the pid of the process that caused it.
+ *
+ * Marking a file system needs CAP_SYS_ADMIN, and opening handles needs
+ * CAP_DAC_READ_SEARCH. Without them, or on file systems that can't
+ * report file handles, the roots are crawled and watched with inotify
+ * as before.
+ */
+
+#define _GNU_SOURCE  /* open_by_handle_at(2) */
+
+#if HAVE_CONFIG_H
+#  include <config.h>
+#endif
+
+#if HAVE_STDLIB_H
+#  include <stdlib.h>
+#endif
+
+#include <stdio.h>
+
+#if HAVE_STRING_H
+#  include <string.h>
+#endif
+
+#if HAVE_SYS_TYPES_H
+#  include <sys/types.h>
+#endif
+
+#if HAVE_SYS_STAT_H
+#  include <sys/stat.h>
+#endif
+
+#include <sys/vfs.h>
+
+#if HAVE_FCNTL_H
+#  include <fcntl.h>
+#endif
+
+#if HAVE_UNISTD_H
+#  include <unistd.h>
+#endif
+
+#if HAVE_PTHREAD_H
+#  include <pthread.h>
+#endif
+
+#if HAVE_ERRNO_H
+#  include <errno.h>
+#endif
+
+#if HAVE_SYS_FANOTIFY_H
+#  include <sys/fanotify.h>
+#endif
+
+#include "fanotify_thread.h"
+#include "thread.h"
+#include "ihandler_thread.h"
+#include "event_stamp.h"
+#include "mount_thread.h"
+#include "inotify.h"
+#include "watch.h"
+#include "prune.h"
+#include "fs_policy.h"
+#include "list.h"
+#include "error.h"
+
+#ifdef FAN_REPORT_DFID_NAME
+
+/* fanotify uses the inotify bit values for the events both have. */
+#define FANOTIFY_EVENTS (FAN_ACCESS | FAN_MODIFY | FAN_ATTRIB | \
+		FAN_CLOSE_WRITE | FAN_CLOSE_NOWRITE | FAN_OPEN | FAN_MOVED_FROM | \
+		FAN_MOVED_TO | FAN_CREATE | FAN_DELETE | FAN_DELETE_SELF)
+
+/* Marked whatever the clients want, since a mark needs some event. */
+#define FANOTIFY_BASE_EVENTS (FAN_CREATE | FAN_MOVED_FROM | FAN_MOVED_TO)
+
+/* A marked file system. */
+struct fan_mark_t {
+	dev_t dev;
+	fsid_t fsid;
+	int fd;       /* A directory on it, for open_by_handle_at(2). */
+} fan_mark_t;
+
+static int fan_fd = -1;
+static pid_t self_pid;
+
+/* The marks, the roots they serve and the event mask they were added
+ * with. Handles are opened with the mutex held, so mark directories
+ * can't be swapped underneath. */
+static pthread_mutex_t fan_mutex = PTHREAD_MUTEX_INITIALIZER;
+static list_t *marks = NULL;
+static list_t *fan_roots = NULL;
+static uint32_t fan_mask = FANOTIFY_BASE_EVENTS;
+
+static void
+destroy_mark(void *ptr)
+{
+	struct fan_mark_t *mark = (struct fan_mark_t *)ptr;
+
+	close(mark->fd);
+	free(mark);
+}
+
+/*
+ * Sets up the fanotify group. Failing is not fatal: the caller is
+ * expected to go on with inotify alone.
+ *
+ * Return Value:
+ *   Returns -1 if fanotify can't be used, otherwise zero.
+ */
+int
+init_fanotify(void)
+{
+	fan_fd = fanotify_init(FAN_CLASS_NOTIF | FAN_CLOEXEC | FAN_REPORT_DFID_NAME,
+		O_RDONLY | O_LARGEFILE);
+	if (fan_fd < 0) {
+		err_msg("warning[init_fanotify]: fanotify_init(2) failed: %s.\n",
+			strerror(errno));
+		err_msg("       Falling back to inotify watches.\n");
+		return -1;
+	}
+
+	marks = list_create(destroy_mark);
+	fan_roots = list_create(free);
+	if (marks == NULL || fan_roots == NULL) {
+		err_msg("error[init_fanotify]: Unable to create the mark lists.\n");
+		destroy_fanotify();
+		return -1;
+	}
+	self_pid = getpid();
+
+	return 0;
+}
+
+void
+destroy_fanotify(void)
+{
+	pthread_mutex_lock(&fan_mutex);
+	list_destroy(marks);
+	marks = NULL;
+	list_destroy(fan_roots);
+	fan_roots = NULL;
+	if (fan_fd >= 0)
+		close(fan_fd);
+	fan_fd = -1;
+	pthread_mutex_unlock(&fan_mutex);
+}
+
+int
+fanotify_enabled(void)
+{
+	return fan_fd >= 0;
+}
+
+/*
+ * Must hold the fanotify mutex.
+ */
+static struct fan_mark_t *
+find_mark_dev(dev_t dev)
+{
+	list_node_t *node = NULL;
+	struct fan_mark_t *mark;
+
+	list_foreach(marks, node) {
+		mark = list_key(node);
+		if (mark->dev == dev)
+			return mark;
+	}
+
+	return NULL;
+}
+
+/*
+ * Must hold the fanotify mutex.
+ */
+static struct fan_mark_t *
+find_mark_fsid(const void *fsid)
+{
+	list_node_t *node = NULL;
+	struct fan_mark_t *mark;
+
+	list_foreach(marks, node) {
+		mark = list_key(node);
+		if (memcmp(&mark->fsid, fsid, sizeof(mark->fsid)) == 0)
+			return mark;
+	}
+
+	return NULL;
+}
+
+/*
+ * Drops the record of a mark that is gone. Must hold the fanotify
+ * mutex.
+ */
+static void
+forget_mark(dev_t dev)
+{
+	list_node_t *node = NULL;
+
+	list_foreach(marks, node) {
+		if (((struct fan_mark_t *)list_key(node))->dev == dev) {
+			destroy_mark(list_remove(marks, node));
+			return;
+		}
+	}
+}
+
+/*
+ * Marks the whole file system holding `path'. Marking a file system
+ * again is harmless, and makes sure a device number reused by another
+ * file system doesn't pass for marked. Must hold the fanotify mutex.
+ *
+ * Return Value:
+ *   Returns -1 if the file system couldn't be marked, otherwise zero.
+ */
+static int
+mark_filesystem(const char *path)
+{
+	struct fan_mark_t *mark;
+	struct stat statbuf;
+	struct statfs sfs;
+	int fd;
+
+	if (stat(path, &statbuf) == -1 || statfs(path, &sfs) == -1)
+		return -1;
+
+	mark = find_mark_dev(statbuf.st_dev);
+	if (fanotify_mark(fan_fd, FAN_MARK_ADD | FAN_MARK_FILESYSTEM,
+	                  fan_mask | FAN_ONDIR, AT_FDCWD, path) == -1) {
+		/* EXDEV or ENODEV/EOPNOTSUPP: no usable file handles. */
+		err_msg("warning[fanotify]: Unable to mark the file system of '%s': %s.\n",
+			path, strerror(errno));
+		forget_mark(statbuf.st_dev);
+		return -1;
+	}
+
+	fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd < 0) {
+		err_open(errno);
+		return -1;
+	}
+	if (mark == NULL) {
+		mark = malloc(sizeof(struct fan_mark_t));
+		if (mark == NULL || list_push(marks, mark) < 0) {
+			err_malloc(errno);
+			free(mark);
+			close(fd);
+			return -1;
+		}
+	} else {
+		close(mark->fd);
+	}
+	mark->dev = statbuf.st_dev;
+	memcpy(&mark->fsid, &sfs.f_fsid, sizeof(mark->fsid));
+	mark->fd = fd;
+
+	return 0;
+}
+
+/*
+ * Marks the file system holding `path', e.g. one that was just mounted.
+ *
+ * Return Value:
+ *   Returns -1 if it couldn't be marked, otherwise zero.
+ */
+int
+fanotify_mark_path(const char *path)
+{
+	int ret;
+
+	pthread_mutex_lock(&fan_mutex);
+	ret = mark_filesystem(path);
+	pthread_mutex_unlock(&fan_mutex);
+
+	return ret;
+}
+
+/*
+ * Marks the file system of the root directory `root' and those mounted
+ * below it, as far as the file system policy allows. Mount points that
+ * couldn't be marked are added to `unmarked'; they still need crawling.
+ *
+ * Return Value:
+ *   Returns -1 if the root's own file system couldn't be marked, and the
+ *   root has to be crawled; otherwise zero.
+ */
+int
+fanotify_mark_tree(const char *root, list_t *unmarked)
+{
+	list_t *mounts;
+	list_node_t *node = NULL;
+	char *copy;
+
+	if (fanotify_mark_path(root) < 0)
+		return -1;
+
+	copy = strdup(root);
+	pthread_mutex_lock(&fan_mutex);
+	if (copy == NULL || list_push(fan_roots, copy) < 0) {
+		err_malloc(errno);
+		free(copy);
+	}
+	pthread_mutex_unlock(&fan_mutex);
+
+	mounts = mounts_below(root);
+	if (mounts == NULL)
+		return 0;
+	list_foreach(mounts, node) {
+		if (!fs_policy_allows(list_key(node), NULL))
+			continue;
+		if (fanotify_mark_path(list_key(node)) < 0) {
+			copy = strdup(list_key(node));
+			if (copy == NULL || list_push(unmarked, copy) < 0) {
+				err_malloc(errno);
+				free(copy);
+			}
+		}
+	}
+	list_destroy(mounts);
+
+	return 0;
+}
+
+/*
+ * Tells whether the directory `path' lies on a marked file system, and
+ * so needs neither crawling nor watches. `statbuf' may be NULL.
+ */
+int
+fanotify_covers(const char *path, const struct stat *statbuf)
+{
+	struct stat st;
+	int covered;
+
+	if (fan_fd < 0)
+		return 0;
+	if (statbuf == NULL) {
+		if (lstat(path, &st) == -1)
+			return 0;
+		statbuf = &st;
+	}
+
+	pthread_mutex_lock(&fan_mutex);
+	covered = find_mark_dev(statbuf->st_dev) != NULL;
+	pthread_mutex_unlock(&fan_mutex);
+
+	return covered;
+}
+
+/*
+ * Brings the mask of every mark in line with what the client
+ * subscriptions below the roots may match. Called when they changed.
+ */
+void
+fanotify_update_mask(void)
+{
+	list_node_t *node = NULL;
+	struct fan_mark_t *mark;
+	uint32_t mask, added, removed;
+
+	if (fan_fd < 0)
+		return;
+
+	pthread_mutex_lock(&fan_mutex);
+	mask = FANOTIFY_BASE_EVENTS;
+	list_foreach(fan_roots, node)
+		mask |= galaxy_subtree_mask(list_key(node), NULL) & FANOTIFY_EVENTS;
+	added = mask & ~fan_mask;
+	removed = fan_mask & ~mask;
+	node = NULL;
+	list_foreach(marks, node) {
+		mark = list_key(node);
+		if (added != 0)
+			fanotify_mark(fan_fd, FAN_MARK_ADD | FAN_MARK_FILESYSTEM,
+				added | FAN_ONDIR, mark->fd, NULL);
+		if (removed != 0)
+			fanotify_mark(fan_fd, FAN_MARK_REMOVE | FAN_MARK_FILESYSTEM,
+				removed, mark->fd, NULL);
+	}
+	fan_mask = mask;
+	pthread_mutex_unlock(&fan_mutex);
+}
+
+/*
+ * Turns the file handle `handle' of the file system `fsid' into a path
+ * in `buf'.
+ *
+ * Return Value:
+ *   Returns -1 if the object is gone or can't be opened, otherwise zero.
+ */
+static int
+resolve_handle(const void *fsid, struct file_handle *handle, char *buf,
+	size_t size)
+{
+	struct fan_mark_t *mark;
+	char link[64];
+	ssize_t len;
+	int fd = -1;
+
+	pthread_mutex_lock(&fan_mutex);
+	mark = find_mark_fsid(fsid);
+	if (mark != NULL)
+		fd = open_by_handle_at(mark->fd, handle, O_PATH | O_CLOEXEC);
+	pthread_mutex_unlock(&fan_mutex);
+	if (fd < 0)
+		return -1;
+
+	snprintf(link, sizeof(link), "/proc/self/fd/%d", fd);
+	len = readlink(link, buf, size - 1);
+	close(fd);
+	if (len < 0)
+		return -1;
+	buf[len] = '\0';
+
+	/* Unlinked in the meantime. */
+	if (len > 10 && strcmp(buf + len - 10, " (deleted)") == 0)
+		return -1;
+
+	return 0;
+}
+
+/*
+ * Tells whether an event on `path' belongs to the roots: marks cover
+ * whole file systems, not just the parts below a root. Directories
+ * below a pruned one are skipped, as they would never be watched.
+ */
+static int
+fanotify_wanted(const char *path)
+{
+	list_node_t *node = NULL;
+	const char *root = NULL;
+	char dir[4097], *p;
+	size_t len = 0;
+	int pruned;
+
+	pthread_mutex_lock(&fan_mutex);
+	list_foreach(fan_roots, node) {
+		const char *r = list_key(node);
+		size_t l = strlen(r);
+		if (strncmp(path, r, l) == 0 &&
+		    (path[l] == '\0' || path[l] == '/' || (l > 0 && r[l - 1] == '/')) &&
+		    (root == NULL || l > len)) {
+			root = r;
+			len = l;
+		}
+	}
+	pthread_mutex_unlock(&fan_mutex);
+
+	if (root == NULL)
+		return 0;
+	if (path[len] == '\0' || strlen(path) >= sizeof(dir))
+		return 1;
+
+	strcpy(dir, path);
+	for (p = dir + len + 1; (p = strchr(p, '/')) != NULL; p++) {
+		*p = '\0';
+		pruned = prune_match(dir);
+		*p = '/';
+		if (pruned)
+			return 0;
+	}
+
+	return 1;
+}
+
+static void
+handle_fanotify_event(const struct fanotify_event_metadata *meta,
+	const struct event_stamp_t *stamp)
+{
+	const struct fanotify_event_info_header *hdr;
+	const struct fanotify_event_info_fid *fid = NULL;
+	struct file_handle *handle;
+	const char *name = NULL;
+	char path[4097];
+	size_t off, len;
+	uint32_t mask;
+
+	if (meta->mask & FAN_Q_OVERFLOW) {
+		err_msg("warning[fanotify]: Kernel fanotify queue overflowed; events were lost.\n");
+		return;
+	}
+
+	/* Our own scans and reads. */
+	if (meta->pid == self_pid)
+		return;
+
+	for (off = meta->metadata_len; off + sizeof(*hdr) <= meta->event_len;
+	     off += hdr->len) {
+		hdr = (const struct fanotify_event_info_header *)((const char *)meta + off);
+		if (hdr->len == 0)
+			break;
+		if (hdr->info_type == FAN_EVENT_INFO_TYPE_DFID_NAME ||
+		    hdr->info_type == FAN_EVENT_INFO_TYPE_DFID ||
+		    hdr->info_type == FAN_EVENT_INFO_TYPE_FID) {
+			fid = (const struct fanotify_event_info_fid *)hdr;
+			break;
+		}
+	}
+	if (fid == NULL)
+		return;
+
+	handle = (struct file_handle *)fid->handle;
+	if (fid->hdr.info_type == FAN_EVENT_INFO_TYPE_DFID_NAME) {
+		name = (const char *)handle->f_handle + handle->handle_bytes;
+		if (strcmp(name, ".") == 0)
+			name = NULL;  /* The directory itself. */
+	}
+
+	if (resolve_handle(&fid->fsid, handle, path, sizeof(path)) < 0)
+		return;
+	if (name != NULL) {
+		len = strlen(path);
+		if (snprintf(path + len, sizeof(path) - len, "%s%s",
+		             len > 0 && path[len - 1] == '/' ? "" : "/", name) >=
+		    (int)(sizeof(path) - len))
+			return;
+	}
+
+	if (!fanotify_wanted(path))
+		return;
+
+	mask = meta->mask & FANOTIFY_EVENTS;
+	if (mask == 0)
+		return;
+	if (meta->mask & FAN_ONDIR)
+		mask |= IN_ISDIR;
+
+	if (handle_path_event(path, mask, meta->pid, stamp) < 0)
+		err_msg("warning[fanotify]: Unable to queue the event handler for '%s'.\n",
+			path);
+}
+
+static void *
+fanotify_watch(void *arg)
+{
+	struct fanotify_event_metadata *meta;
+	struct event_stamp_t stamp;
+	long buf[4096];  /* Keeps the events aligned. */
+	ssize_t len, len2;
+	unsigned int count;
+
+	while (1) {
+		len = read(fan_fd, buf, sizeof(buf));
+		if (len < 0 && errno == EINTR)
+			continue;
+		if (len <= 0) {
+			err_read(errno);
+			err_msg("error[fanotify_watch]: Unable to read fanotify events.\n");
+			break;
+		}
+
+		/* Stamped like inotify events, see read_events(). */
+		count = 0;
+		meta = (struct fanotify_event_metadata *)buf;
+		for (len2 = len; FAN_EVENT_OK(meta, len2); meta = FAN_EVENT_NEXT(meta, len2))
+			count++;
+		stamp_events(&stamp, count);
+
+		meta = (struct fanotify_event_metadata *)buf;
+		for (; FAN_EVENT_OK(meta, len); meta = FAN_EVENT_NEXT(meta, len)) {
+			if (meta->vers != FANOTIFY_METADATA_VERSION) {
+				err_msg("error[fanotify_watch]: Unexpected fanotify metadata version %d.\n",
+					meta->vers);
+				return NULL;
+			}
+			handle_fanotify_event(meta, &stamp);
+			stamp.sequence++;
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * Creates the thread that reads the fanotify events. Only called once
+ * init_fanotify() succeeded.
+ */
+int
+create_fanotify_thread(pthread_t *id)
+{
+	int err;
+
+	err = create_joinable_thread(id, fanotify_watch, NULL);
+	if (err < 0)
+		err_create_joinable_thread(errno);
+
+	return err;
+}
+
+#else  /* !FAN_REPORT_DFID_NAME */
+
+/* Built without fanotify(7) file handle reporting: inotify only. */
+
+int
+init_fanotify(void)
+{
+	err_msg("warning[init_fanotify]: Built without fanotify support; using inotify watches.\n");
+	return -1;
+}
+
+void destroy_fanotify(void) { }
+int fanotify_enabled(void) { return 0; }
+int fanotify_mark_path(const char *path) { return -1; }
+int fanotify_mark_tree(const char *root, list_t *unmarked) { return -1; }
+int fanotify_covers(const char *path, const struct stat *statbuf) { return 0; }
+void fanotify_update_mask(void) { }
+int create_fanotify_thread(pthread_t *id) { return -1; }
+
+#endif
@@ -0,0 +1,51 @@
+/*
+ * Galaxy - A filesystem monitoring tool.
+ * Copyright (C) 2005  Gabriel Munoz <gabriel@xusia.net>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ */
+
+#ifndef FANOTIFY_THREAD_H
+#define FANOTIFY_THREAD_H
+
+#if HAVE_CONFIG_H
+#  include <config.h>
+#endif
+
+#if HAVE_PTHREAD_H
+#  include <pthread.h>
+#endif
+
+#if HAVE_SYS_STAT_H
+#  include <sys/stat.h>
+#endif
+
+#include "list.h"
+
+/* Initialization and destruction routines -- called once on
+ * startup/shutdown. */
+int init_fanotify(void);
+void destroy_fanotify(void);
+
+int fanotify_enabled(void);
+int fanotify_mark_path(const char *path);
+int fanotify_mark_tree(const char *root, list_t *unmarked);
+int fanotify_covers(const char *path, const struct stat *statbuf);
+void fanotify_update_mask(void);
+
+int create_fanotify_thread(pthread_t *id);
+
+#endif
@@ -0,0 +1,479 @@
+/*
+ * Galaxy - A filesystem monitoring tool.
+ * Copyright (C) 2005  Gabriel Munoz <gabriel@xusia.net>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ */
+
+#if HAVE_CONFIG_H
+#  include <config.h>
+#endif
+
+#if HAVE_STDLIB_H
+#  include <stdlib.h>
+#endif
+
+#include <stdio.h>
+#include <sys/vfs.h>
+
+#if HAVE_STRING_H
+#  include <string.h>
+#endif
+
+#if HAVE_SYS_TYPES_H
+#  include <sys/types.h>
+#endif
+
+#if HAVE_SYS_STAT_H
+#  include <sys/stat.h>
+#endif
+
+#if HAVE_PTHREAD_H
+#  include <pthread.h>
+#endif
+
+#if HAVE_ERRNO_H
+#  include <errno.h>
+#endif
+
+#if HAVE_LIBGLIB_2_0
+#  include <glib.h>
+#endif
+
+#include "fs_policy.h"
+#include "list.h"
+#include "error.h"
+
+#define NO_DEPTH_LIMIT -1
+
+/*
+ * Known file system types, by statfs(2) f_type. Pseudo file systems are
+ * never crawled unless they hold a root themselves: their directories
+ * don't change through file operations, or change on every read.
+ */
+static const struct fs_type_t {
+	long magic;
+	const char *name;
+	int pseudo;
+} fs_types[] = {
+	{ 0x0187,     "autofs",     1 },
+	{ 0x42494e4d, "binfmt_misc", 1 },
+	{ 0xcafe4a11, "bpf",        1 },
+	{ 0x27e0eb,   "cgroup",     1 },
+	{ 0x63677270, "cgroup2",    1 },
+	{ 0x62656570, "configfs",   1 },
+	{ 0x64626720, "debugfs",    1 },
+	{ 0x1cd1,     "devpts",     1 },
+	{ 0xde5e81e4, "efivarfs",   1 },
+	{ 0x65735543, "fusectl",    1 },
+	{ 0x958458f6, "hugetlbfs",  1 },
+	{ 0x19800202, "mqueue",     1 },
+	{ 0x6e736673, "nsfs",       1 },
+	{ 0x9fa0,     "proc",       1 },
+	{ 0x6165676c, "pstore",     1 },
+	{ 0x67596969, "rpc_pipefs", 1 },
+	{ 0x73636673, "securityfs", 1 },
+	{ 0xf97cff8c, "selinuxfs",  1 },
+	{ 0x62656572, "sysfs",      1 },
+	{ 0x74726163, "tracefs",    1 },
+	{ 0x9123683e, "btrfs",      0 },
+	{ 0xff534d42, "cifs",       0 },
+	{ 0xef53,     "ext4",       0 },  /* Also ext2 and ext3. */
+	{ 0x65735546, "fuse",       0 },
+	{ 0x9660,     "iso9660",    0 },
+	{ 0x6969,     "nfs",        0 },
+	{ 0x794c7630, "overlay",    0 },
+	{ 0x858458f6, "ramfs",      0 },
+	{ 0xfe534d42, "smb2",       0 },
+	{ 0x73717368, "squashfs",   0 },
+	{ 0x01021994, "tmpfs",      0 },
+	{ 0x58465342, "xfs",        0 },
+	{ 0, NULL, 0 }
+};
+
+/* What was decided for one mounted file system. A device mounted at
+ * several places (bind mounts) gets one for each mount point. */
+struct fs_info_t {
+	struct fs_info_t *next;  /* Same device, other mount point. */
+	dev_t dev;
+	long type;
+	int skip;        /* Never crawl it. */
+	int max_depth;   /* Levels below the mount point, or NO_DEPTH_LIMIT. */
+	int base_depth;  /* Path components of the mount point. */
+	char mountpoint[1];
+} fs_info_t;
+
+struct fs_depth_t {
+	char *name;
+	int depth;
+} fs_depth_t;
+
+static GHashTable *filesystems = NULL;  /* dev_t -> struct fs_info_t */
+static pthread_mutex_t fs_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static int one_fs = 0;
+static list_t *root_devs = NULL;   /* struct stat of each root */
+static list_t *depth_limits = NULL;
+
+static guint
+dev_hash(gconstpointer key)
+{
+	dev_t dev = *(const dev_t *)key;
+
+	return (guint)(dev ^ (dev >> 32));
+}
+
+static gboolean
+dev_equal(gconstpointer a, gconstpointer b)
+{
+	return *(const dev_t *)a == *(const dev_t *)b;
+}
+
+static void
+destroy_fs_info(void *ptr)
+{
+	struct fs_info_t *info = (struct fs_info_t *)ptr, *next;
+
+	for (; info != NULL; info = next) {
+		next = info->next;
+		free(info);
+	}
+}
+
+static void
+destroy_depth(void *ptr)
+{
+	free(((struct fs_depth_t *)ptr)->name);
+	free(ptr);
+}
+
+static const struct fs_type_t *
+lookup_type(long magic)
+{
+	int i;
+
+	for (i = 0; fs_types[i].name != NULL; i++) {
+		if (fs_types[i].magic == magic)
+			return &fs_types[i];
+	}
+
+	return NULL;
+}
+
+static int
+count_components(const char *path)
+{
+	int n = 0;
+
+	for (; *path != '\0'; path++) {
+		if (*path == '/' && path[1] != '/' && path[1] != '\0')
+			n++;
+	}
+
+	return n;
+}
+
+/*
+ * Sets up the crawl policies: with `one_filesystem' set, crawls stay on
+ * the file system of their root. `depths' holds "TYPE=DEPTH" strings
+ * that limit how many levels below a mount point of that type get
+ * watched (0 watches the mount point only).
+ *
+ * Return Value:
+ *   Returns -1 on error, otherwise zero.
+ */
+int
+init_fs_policy(int one_filesystem, const list_t *depths)
+{
+	list_node_t *node = NULL;
+	struct fs_depth_t *limit;
+	char *eq, *end;
+	long depth;
+
+	one_fs = one_filesystem;
+	filesystems = g_hash_table_new_full(dev_hash, dev_equal, NULL,
+		destroy_fs_info);
+	root_devs = list_create(free);
+	depth_limits = list_create(destroy_depth);
+	if (filesystems == NULL || root_devs == NULL || depth_limits == NULL) {
+		err_msg("error[init_fs_policy]: Unable to create policy tables.\n");
+		return -1;
+	}
+
+	if (depths == NULL)
+		return 0;
+	list_foreach(depths, node) {
+		const char *arg = list_key(node);
+
+		eq = strchr(arg, '=');
+		depth = eq != NULL ? strtol(eq + 1, &end, 10) : -1;
+		if (eq == NULL || eq == arg || *end != '\0' || depth < 0) {
+			err_msg("warning[init_fs_policy]: Ignoring depth limit '%s' (expected TYPE=DEPTH).\n",
+				arg);
+			continue;
+		}
+		limit = malloc(sizeof(struct fs_depth_t));
+		if (limit == NULL) {
+			err_malloc(errno);
+			return -1;
+		}
+		limit->name = strndup(arg, eq - arg);
+		limit->depth = depth;
+		if (limit->name == NULL || list_push(depth_limits, limit) < 0) {
+			destroy_depth(limit);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+void
+destroy_fs_policy(void)
+{
+	g_hash_table_destroy(filesystems);
+	list_destroy(root_devs);
+	list_destroy(depth_limits);
+}
+
+/*
+ * Records the device of a crawl root. Pseudo file systems are crawled
+ * when they hold a root, and with the one-filesystem policy nothing
+ * outside the roots' devices is.
+ *
+ * Return Value:
+ *   Returns -1 on error, otherwise zero.
+ */
+int
+fs_policy_add_root(const char *root)
+{
+	struct stat *st;
+	int err;
+
+	st = malloc(sizeof(struct stat));
+	if (st == NULL) {
+		err_malloc(errno);
+		return -1;
+	}
+	if (stat(root, st) == -1) {
+		free(st);
+		return -1;
+	}
+	pthread_mutex_lock(&fs_mutex);
+	err = list_push(root_devs, st);
+	pthread_mutex_unlock(&fs_mutex);
+	if (err < 0)
+		free(st);
+
+	return err < 0 ? -1 : 0;
+}
+
+static int
+is_root_dev(dev_t dev)
+{
+	list_node_t *node = NULL;
+
+	list_foreach(root_devs, node) {
+		if (((struct stat *)list_key(node))->st_dev == dev)
+			return 1;
+	}
+
+	return 0;
+}
+
+/*
+ * Return Value:
+ *   Returns non-zero if `path' is the mount point `dir' or is below it.
+ */
+static int
+below_mount(const char *path, const char *dir)
+{
+	size_t length = strlen(dir);
+
+	return strncmp(path, dir, length) == 0 &&
+		(path[length] == '/' || path[length] == '\0' || length == 1);
+}
+
+/*
+ * Finds the mount point above `path' by climbing while the parent is on
+ * the same device, and leaves it in `dir' (4097 bytes).
+ */
+static void
+find_mount_point(const char *path, dev_t dev, char *dir)
+{
+	char parent[4097], *slash;
+	struct stat st;
+
+	if (strlen(path) >= sizeof(parent)) {
+		strncpy(dir, path, sizeof(parent) - 1);
+		dir[sizeof(parent) - 1] = '\0';
+		return;
+	}
+	strcpy(dir, path);
+
+	while (count_components(dir) > 0) {
+		strcpy(parent, dir);
+		slash = strrchr(parent, '/');
+		if (slash == NULL)
+			break;
+		slash[slash == parent ? 1 : 0] = '\0';
+		if (stat(parent, &st) == -1 || st.st_dev != dev)
+			break;
+		strcpy(dir, parent);
+	}
+}
+
+/*
+ * Makes the policy decision for a file system the first time one of its
+ * directories shows up. Must be called with the policy mutex held.
+ */
+static struct fs_info_t *
+create_fs_info(const char *path, dev_t dev)
+{
+	struct fs_info_t *info, *first;
+	const struct fs_type_t *type;
+	struct statfs sfs;
+	list_node_t *node = NULL;
+	char mountpoint[4097];
+
+	find_mount_point(path, dev, mountpoint);
+	info = malloc(sizeof(struct fs_info_t) + strlen(mountpoint));
+	if (info == NULL) {
+		err_malloc(errno);
+		err_msg("error[create_fs_info]: Unable to malloc fs_info_t.\n");
+		return NULL;
+	}
+	strcpy(info->mountpoint, mountpoint);
+	info->dev = dev;
+	info->type = statfs(path, &sfs) == 0 ? (long)sfs.f_type : 0;
+	info->base_depth = count_components(mountpoint);
+	info->max_depth = NO_DEPTH_LIMIT;
+
+	type = lookup_type(info->type);
+	info->skip = type != NULL && type->pseudo;
+	if (type != NULL) {
+		list_foreach(depth_limits, node) {
+			struct fs_depth_t *limit = list_key(node);
+			if (strcmp(limit->name, type->name) == 0)
+				info->max_depth = limit->depth;
+		}
+	}
+
+#ifdef DEBUG_FS_POLICY
+	err_msg("DEBUG[create_fs_info]: %s is on %s (0x%lx), skip = %d, depth = %d\n",
+		path, type != NULL ? type->name : "unknown", info->type, info->skip,
+		info->max_depth);
+#endif
+
+	/* The first mount point seen keeps the hash key. */
+	first = g_hash_table_lookup(filesystems, &dev);
+	if (first != NULL) {
+		info->next = first->next;
+		first->next = info;
+	} else {
+		info->next = NULL;
+		g_hash_table_insert(filesystems, &info->dev, info);
+	}
+
+	return info;
+}
+
+/*
+ * Return Value:
+ *   Returns the decision made for the mount of `dev' that `path' is on,
+ *   or NULL if there is none yet. Must be called with the policy mutex
+ *   held.
+ */
+static struct fs_info_t *
+find_fs_info(const char *path, dev_t dev)
+{
+	struct fs_info_t *info;
+
+	for (info = g_hash_table_lookup(filesystems, &dev); info != NULL;
+	     info = info->next) {
+		if (below_mount(path, info->mountpoint))
+			return info;
+	}
+
+	return NULL;
+}
+
+static gboolean
+mounted_below(gpointer key, gpointer value, gpointer user_data)
+{
+	struct fs_info_t *info;
+
+	for (info = value; info != NULL; info = info->next) {
+		if (below_mount(info->mountpoint, user_data))
+			return TRUE;
+	}
+
+	return FALSE;
+}
+
+/*
+ * Drops the decisions made for the file systems mounted at or below
+ * `mountpoint', since something was mounted there or went away. Device
+ * numbers of pseudo and overlay file systems are handed out again right
+ * away, so a new mount mustn't inherit the decision for an old one.
+ * Other mounts of the same devices are decided again as well.
+ */
+void
+fs_policy_forget(const char *mountpoint)
+{
+	pthread_mutex_lock(&fs_mutex);
+	g_hash_table_foreach_remove(filesystems, mounted_below,
+		(gpointer)mountpoint);
+	pthread_mutex_unlock(&fs_mutex);
+}
+
+/*
+ * Tells whether the directory `path' may be crawled and watched under
+ * the file system policies. `st' is the result of stat(2) or lstat(2)
+ * on the directory, or NULL to have it done here. The statfs(2) and the
+ * policy decision are made only once per file system.
+ */
+int
+fs_policy_allows(const char *path, const struct stat *st)
+{
+	struct stat buf;
+	struct fs_info_t *info;
+	int allowed, root;
+
+	if (st == NULL) {
+		if (stat(path, &buf) == -1)
+			return 0;
+		st = &buf;
+	}
+
+	pthread_mutex_lock(&fs_mutex);
+	root = is_root_dev(st->st_dev);
+	if (one_fs && !root) {
+		pthread_mutex_unlock(&fs_mutex);
+		return 0;
+	}
+
+	info = find_fs_info(path, st->st_dev);
+	if (info == NULL)
+		info = create_fs_info(path, st->st_dev);
+	/* A root on a pseudo file system was asked for explicitly. */
+	allowed = info == NULL || ((root || !info->skip) &&
+		(info->max_depth == NO_DEPTH_LIMIT ||
+		 count_components(path) - info->base_depth <= info->max_depth));
+	pthread_mutex_unlock(&fs_mutex);
+
+	return allowed;
+}
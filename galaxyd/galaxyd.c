@@ -79,19 +79,36 @@
 
 #include "galnet.h"
 #include "crawler_thread.h"
+#include "watch_budget.h"
+#include "prune.h"
+#include "fs_policy.h"
+#include "self_events.h"
+#include "recovery.h"
 #include "signal_thread.h"
 #include "server_thread.h"
 #include "iwatch_thread.h"
+#include "mount_thread.h"
+#include "fanotify_thread.h"
+#include "coalesce.h"
+#include "settle.h"
+#include "dirfd_cache.h"
+#include "digest.h"
+#include "tail.h"
+#include "storm.h"
+#include "summary.h"
 #include "watch.h"
 #include "inotify_utils.h"
 #include "list.h"
 #include "event_queue.h"
+#include "dir_tree.h"
+#include "thread_pool.h"
 #include "error.h"
 
-pthread_t crawler, watcher, signaler, server;
-pthread_mutex_t inotify_wds_mutex = PTHREAD_MUTEX_INITIALIZER;
-
-GHashTable *inotify_wds = NULL;
+pthread_t crawler, signaler, server, mounter, fanotifier, coalescer, settler;
+pthread_t summarizer;
+pthread_t watchers[GALAXY_MAX_SHARDS];
+int nwatchers = 0;
+thread_pool_t workers;
 
 //#define LOCKFILE "/var/run/galaxyd.pid"
 #define LOCKFILE "/tmp/galaxyd.pid"
@@ -140,13 +157,6 @@ already_running(void)
 	return 0;
 }
 
-void
-destroy(gpointer key, gpointer value, gpointer user_data)
-{
-	free(key);
-	free(value);
-}
-
 void
 notifier_destroy(gpointer key, gpointer value, gpointer user_data)
 {
@@ -157,27 +167,72 @@ notifier_destroy(gpointer key, gpointer value, gpointer user_data)
 void
 usage(FILE *iostream)
 {
-	fprintf(iostream, "Usage: galaxyd [-h] [-v] [-r] [-p PRUNE_LIST] [DIRECTORY]\n");
+	fprintf(iostream, "Usage: galaxyd [-h] [-o] [-v] [-r] [-x] [-a MSECS] [-b BACKEND] [-c MSECS]\n");
+	fprintf(iostream, "               [-d DEPTH_LIST] [-j JOBS] [-p PRUNE_LIST] [-s SHARDS] [-t RATE]\n");
+	fprintf(iostream, "               [DIRECTORY]\n");
+	fprintf(iostream, "  -a MSECS        Interval over which the events in a directory are\n");
+	fprintf(iostream, "                  counted for subscriptions asking for summaries.\n");
+	fprintf(iostream, "                  Defaults to %d; 0 sends them every event instead.\n",
+		SUMMARY_INTERVAL);
+	fprintf(iostream, "  -b BACKEND      Event source: `inotify' (the default) watches every\n");
+	fprintf(iostream, "                  directory; `fanotify' marks whole file systems\n");
+	fprintf(iostream, "                  instead and needs no crawl, but requires root. Falls\n");
+	fprintf(iostream, "                  back to inotify where fanotify can't be used.\n");
+	fprintf(iostream, "  -c MSECS        Window in which repeated events on a path are merged\n");
+	fprintf(iostream, "                  for subscriptions asking for it. Defaults to %d;\n",
+		COALESCE_WINDOW);
+	fprintf(iostream, "                  0 disables merging.\n");
+	fprintf(iostream, "  -d DEPTH_LIST   Colon-separated TYPE=DEPTH limits on how many levels\n");
+	fprintf(iostream, "                  below a mount point of file system TYPE (e.g. nfs,\n");
+	fprintf(iostream, "                  fuse, tmpfs) are watched.\n");
 	fprintf(iostream, "  -h              Displays this information.\n");
-	fprintf(iostream, "  -p PRUNE_LIST   Prune the colon-separated directories from the galaxy\n");
-	fprintf(iostream, "                  search path.\n");
+	fprintf(iostream, "  -j JOBS         Number of worker threads handling events and scans.\n");
+	fprintf(iostream, "                  Defaults to the number of online processors.\n");
+	fprintf(iostream, "  -o              Recover from inotify queue overflows by rescanning the\n");
+	fprintf(iostream, "                  watched directories. Keeps a listing of each one.\n");
+	fprintf(iostream, "  -p PRUNE_LIST   Prune the colon-separated rules from the galaxy search\n");
+	fprintf(iostream, "                  path. A rule is an absolute path, a directory name\n");
+	fprintf(iostream, "                  pruned anywhere (e.g. .git), either one with glob\n");
+	fprintf(iostream, "                  wildcards, or re:REGEX. Directories may also list\n");
+	fprintf(iostream, "                  rules for their subtree in a " PRUNE_IGNORE_FILE " file.\n");
 	fprintf(iostream, "  -r              Recursively add Galaxy watches.\n");
+	fprintf(iostream, "  -s SHARDS       Number of inotify instances the watches are split\n");
+	fprintf(iostream, "                  across, each read by its own thread (at most %d).\n",
+		GALAXY_MAX_SHARDS);
+	fprintf(iostream, "                  Defaults to 1.\n");
+	fprintf(iostream, "  -t RATE         Events per second in a subtree past which its events\n");
+	fprintf(iostream, "                  are dropped, and clients sent a single rescan once\n");
+	fprintf(iostream, "                  it calms down. Defaults to %d; 0 never drops them.\n",
+		STORM_RATE);
 	fprintf(iostream, "  -v              Output version information and exit.\n");
+	fprintf(iostream, "  -x              Stay on the file systems of the directories given.\n");
 }
 
 int
 main (int argc, char **argv)
 {
-	queue_t q;
-	int err, fd, listenfd, c, version, recursive, option_index, i;
-	int lone_args;
+	queue_t qs[GALAXY_MAX_SHARDS];
+	int err, listenfd, shards = 1, c, version, recursive, option_index, i;
+	int lone_args, jobs = 0, one_filesystem = 0, overflow_recovery = 0;
+	int use_fanotify = 0, coalesce_window = COALESCE_WINDOW;
+	int storm_rate = STORM_RATE, summary_interval = SUMMARY_INTERVAL;
 	char *galaxy_search_path, *galaxy_prune_path, *prune_dir_args = NULL;
-	list_t *dirs, *prune_dirs = NULL;
+	char *fs_depth_args = NULL;
+	list_t *dirs, *prune_dirs = NULL, *fs_depths = NULL;
 	static struct option long_options[] = {
+		{"summary-interval", 1, 0, 'a'},
+		{"backend", 1, 0, 'b'},
+		{"coalesce", 1, 0, 'c'},
+		{"fs-depth", 1, 0, 'd'},
 		{"help", 0, 0, 'h'},
+		{"jobs", 1, 0, 'j'},
+		{"overflow-recovery", 0, 0, 'o'},
 		{"prune", 1, 0, 'p'},
 		{"recursive", 0, 0, 'r'},
-		{"version", 0, 0, 'v'}
+		{"shards", 1, 0, 's'},
+		{"storm-rate", 1, 0, 't'},
+		{"version", 0, 0, 'v'},
+		{"one-file-system", 0, 0, 'x'}
 	};
 
 	/* Only allow one instance. */
@@ -198,23 +253,71 @@ main (int argc, char **argv)
 		return (1);
 	}
 
+	fs_depths = list_create(free);
+	if (fs_depths == NULL) {
+		err_msg("error[main]: Unable to create file system depth list.\n");
+		return (1);
+	}
+
 	option_index = version = recursive = err = 0;
-	while ((c = getopt_long(argc, argv, "hp:rv",
+	while ((c = getopt_long(argc, argv, "a:b:c:d:hj:op:rs:t:vx",
 		     long_options, &option_index)) != -1) {
 		switch (c) {
+			case 'a':
+				summary_interval = atoi(optarg);
+				if (summary_interval < 0)
+					err = 1;
+				break;
+			case 'b':
+				if (strcmp(optarg, "fanotify") == 0)
+					use_fanotify = 1;
+				else if (strcmp(optarg, "inotify") == 0)
+					use_fanotify = 0;
+				else
+					err = 1;
+				break;
+			case 'c':
+				coalesce_window = atoi(optarg);
+				if (coalesce_window < 0)
+					err = 1;
+				break;
+			case 'd':
+				fs_depth_args = optarg;
+				break;
 			case 'h':
 				usage(stdout);
 				exit(0);
 				break;
+			case 'j':
+				jobs = atoi(optarg);
+				if (jobs <= 0)
+					err = 1;
+				break;
+			case 'o':
+				overflow_recovery = 1;
+				break;
 			case 'p':
 				prune_dir_args = optarg;
 				break;
 			case 'r':
 				recursive = 1;
 				break;
+			case 's':
+				shards = atoi(optarg);
+				if (shards <= 0 || shards > GALAXY_MAX_SHARDS)
+					err = 1;
+				break;
+			case 't':
+				storm_rate = atoi(optarg);
+				if (storm_rate < 0)
+					err = 1;
+				break;
 			case 'v':
 				printf("%d.%d.%d\n", GALAXY_MAJOR, GALAXY_MINOR, GALAXY_RELEASE);
 				exit(0);
+			case 'x':
+				one_filesystem = 1;
+				break;
 			case '?':
 				err = 1;
 				break;
@@ -266,6 +369,15 @@ main (int argc, char **argv)
 		}
 	}
 
+	/* Add command-line supplied file system depth limits, if any. */
+	if (fs_depth_args) {
+		char *limit;
+		while ((limit = strtok(fs_depth_args, ":")) != NULL) {
+			list_push(fs_depths, strdup(limit));
+			fs_depth_args = NULL;
+		}
+	}
+
 	/* If directories list is zero, add the current working directory as
 	 * the directory to search. */
 	char *cwd;
@@ -291,13 +403,81 @@ main (int argc, char **argv)
 		exit(1);
 	}
 
-	inotify_wds = g_hash_table_new(g_int_hash, g_int_equal);
+	if (init_dir_tree() < 0) {
+		err_msg("error[main]: Unable to create directory tree.\n");
+		exit(1);
+	}
+
+	if (init_prune_rules(prune_dirs) < 0) {
+		err_msg("error[main]: Unable to compile prune rules.\n");
+		exit(1);
+	}
+
+	if (init_fs_policy(one_filesystem, fs_depths) < 0) {
+		err_msg("error[main]: Unable to set up file system policies.\n");
+		exit(1);
+	}
+
+	if (init_watch_budget() < 0) {
+		err_msg("error[main]: Unable to set up the inotify watch budget.\n");
+		exit(1);
+	}
+
+	if (init_self_events() < 0) {
+		err_msg("error[main]: Unable to set up self-event tracking.\n");
+		exit(1);
+	}
+
+	if (init_recovery(overflow_recovery) < 0) {
+		err_msg("error[main]: Unable to set up overflow recovery.\n");
+		exit(1);
+	}
 
-	fd = open_dev();
-	if (fd < 0)
+	if (init_coalesce(coalesce_window) < 0) {
+		err_msg("error[main]: Unable to set up event coalescing.\n");
+		exit(1);
+	}
+
+	if (init_summary(summary_interval) < 0) {
+		err_msg("error[main]: Unable to set up event summaries.\n");
+		exit(1);
+	}
+
+	init_settle();
+	init_dirfd_cache();
+
+	if (init_digest() < 0) {
+		err_msg("error[main]: Unable to set up content digests.\n");
+		exit(1);
+	}
+
+	if (init_tail() < 0) {
+		err_msg("error[main]: Unable to set up file tailing.\n");
+		exit(1);
+	}
+
+	init_storm(storm_rate);
+
+	if (open_devs(shards) < 0)
 		return 0;
 
-	q = queue_create (128);
+	/* Directories fanotify can't cover still get inotify watches. */
+	if (use_fanotify)
+		init_fanotify();
+
+	for (i = 0; i < shards; i++)
+		qs[i] = queue_create (128);
+
+	if (jobs == 0) {
+		jobs = sysconf(_SC_NPROCESSORS_ONLN);
+		if (jobs < 2)
+			jobs = 2;
+	}
+	workers = thread_pool_create(jobs);
+	if (workers == NULL) {
+		err_msg("error: Unable to create worker threads.\n");
+		return 1;
+	}
 
 	/* Signal thread */
 	err = create_signal_thread(&signaler);
@@ -313,32 +493,101 @@ main (int argc, char **argv)
 		return 1;
 	}
 
-	/* Inotify event watcher thread */
-	err = create_iwatch_thread(&watcher, fd, q);
+	/* Coalesced event sender thread */
+	if (coalesce_enabled()) {
+		err = create_coalesce_thread(&coalescer);
+		if (err < 0) {
+			err_msg("error: Unable to create event coalescing thread.\n");
+			return 1;
+		}
+	}
+
+	/* Summary sender thread */
+	if (summary_enabled()) {
+		err = create_summary_thread(&summarizer);
+		if (err < 0) {
+			err_msg("error: Unable to create event summary thread.\n");
+			return 1;
+		}
+	}
+
+	/* Settled event sender thread */
+	err = create_settle_thread(&settler);
 	if (err < 0) {
-		err_msg("error: Unable to create inotify event watcher thread.\n");
+		err_msg("error: Unable to create event settling thread.\n");
 		return 1;
 	}
 
+	/* Inotify event watcher threads, one per inotify instance */
+	for (i = 0; i < shards; i++) {
+		err = create_iwatch_thread(&watchers[i], i, qs[i]);
+		if (err < 0) {
+			err_msg("error: Unable to create inotify event watcher thread.\n");
+			return 1;
+		}
+		nwatchers++;
+	}
+
+	/* Fanotify event reader thread */
+	if (fanotify_enabled()) {
+		err = create_fanotify_thread(&fanotifier);
+		if (err < 0) {
+			err_msg("error: Unable to create fanotify event reader thread.\n");
+			return 1;
+		}
+	}
+
 	/* Directory crawler thread */
-	err = create_crawler_thread(&crawler, fd, dirs, prune_dirs,
-		inotify_wds, recursive);
+	err = create_crawler_thread(&crawler, galaxy_shard_fd(0), dirs, recursive);
 	if (err < 0) {
 		err_msg("error: Unable to create crawler thread.\n");
 		return 1;
 	}
 
+	/* Mount table tracker thread */
+	err = create_mount_thread(&mounter);
+	if (err < 0) {
+		err_msg("error: Unable to create mount tracker thread.\n");
+		return 1;
+	}
+
 	pthread_join(crawler, NULL);
-	pthread_join(watcher, NULL);
+	pthread_join(mounter, NULL);
+	for (i = 0; i < nwatchers; i++)
+		pthread_join(watchers[i], NULL);
+	if (fanotify_enabled())
+		pthread_join(fanotifier, NULL);
+	if (coalesce_enabled())
+		pthread_join(coalescer, NULL);
+	if (summary_enabled())
+		pthread_join(summarizer, NULL);
+	pthread_join(settler, NULL);
 	pthread_join(server, NULL);
 	pthread_join(signaler, NULL);
 
-	queue_destroy (q);
-
-	close_dev (fd);
-
-	g_hash_table_foreach(inotify_wds, destroy, NULL);
-	g_hash_table_destroy(inotify_wds);
+	destroy_crawl_queue();
+	thread_pool_destroy(workers);
+	destroy_digest();
+	destroy_tail();
+	destroy_storm();
+	destroy_coalesce();
+	destroy_summary();
+	destroy_settle();
+	destroy_dirfd_cache();
+	destroy_crawler_data();
+	destroy_watch_budget();
+	destroy_prune_rules();
+	destroy_fs_policy();
+	destroy_self_events();
+	destroy_recovery();
+
+	for (i = 0; i < shards; i++)
+		queue_destroy (qs[i]);
+
+	close_devs();
+	destroy_fanotify();
+
+	destroy_dir_tree();
 
 	close(listenfd);
 
@@ -346,6 +595,7 @@ main (int argc, char **argv)
 
 	list_destroy(dirs);
 	list_destroy(prune_dirs);
+	list_destroy(fs_depths);
 
 	err_msg("Exiting now!\n");
 
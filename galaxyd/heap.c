@@ -0,0 +1,161 @@
+/*
+ * Galaxy - A filesystem monitoring tool.
+ * Copyright (C) 2005  Gabriel Munoz <gabriel@xusia.net>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ */
+
+#if HAVE_CONFIG_H
+#  include <config.h>
+#endif
+
+#if HAVE_STDLIB_H
+#  include <stdlib.h>
+#endif
+
+#include "heap.h"
+
+#define HEAP_INITIAL_CAPACITY  64
+
+/* Static (private) function prototypes for this data structure */
+static inline void swap_keys(heap_t *heap, unsigned long i, unsigned long j);
+
+/***********************************************************************
+ * Allocates, initializes, and returns a binary heap container. Keys
+ * come out of the heap in the order given by `compare'. Time complexity
+ * is O(1).
+ *
+ * Parameters:
+ *   compare: Returns a positive value if key `a' must come out before
+ *     key `b', a negative value if after, and zero if it doesn't
+ *     matter.
+ *   destroy: A function of a specific prototype that may be applied to
+ *     the keys of this heap to deallocate from memory.
+ *
+ * Return Value:
+ *   Returns a pointer to a heap structure, or NULL on error (most likely
+ *   an error in memory allocation).
+ **********************************************************************/
+heap_t *heap_create(int (*compare)(const void *a, const void *b),
+	void (*destroy)(void *key))
+{
+	heap_t *heap;
+	if ((heap = malloc(sizeof(heap_t))) == NULL)
+		return NULL;
+
+	heap->keys = malloc(sizeof(void *) * HEAP_INITIAL_CAPACITY);
+	if (heap->keys == NULL) {
+		free(heap);
+		return NULL;
+	}
+
+	heap->size = 0;
+	heap->capacity = HEAP_INITIAL_CAPACITY;
+	heap->compare = compare;
+	heap->destroy = destroy;
+
+	return heap;
+}
+
+/***********************************************************************
+ * Destroys all elements in the heap, including the heap container. It is
+ * safe to pass a NULL heap. Time complexity is O(n).
+ **********************************************************************/
+void heap_destroy(heap_t *heap)
+{
+	unsigned long i;
+
+	if (heap == NULL)
+		return;
+
+	if (heap->destroy != NULL)
+		for (i = 0; i < heap->size; i++)
+			heap->destroy(heap->keys[i]);
+	free(heap->keys);
+	free(heap);
+}
+
+/***********************************************************************
+ * Inserts `key' into the heap. Time complexity is O(log n).
+ *
+ * Return Value:
+ *   Returns -1 on error (the heap is left unchanged), otherwise zero.
+ **********************************************************************/
+int heap_push(heap_t *heap, void *key)
+{
+	unsigned long i, parent;
+	void **keys;
+
+	if (heap->size == heap->capacity) {
+		keys = realloc(heap->keys, sizeof(void *) * heap->capacity * 2);
+		if (keys == NULL)
+			return -1;
+		heap->keys = keys;
+		heap->capacity *= 2;
+	}
+
+	i = heap->size++;
+	heap->keys[i] = key;
+	while (i > 0) {
+		parent = (i - 1) / 2;
+		if (heap->compare(heap->keys[i], heap->keys[parent]) <= 0)
+			break;
+		swap_keys(heap, i, parent);
+		i = parent;
+	}
+
+	return 0;
+}
+
+/***********************************************************************
+ * Removes the first key of the heap. Time complexity is O(log n).
+ *
+ * Return Value:
+ *   Returns the key, or NULL if the heap is empty.
+ **********************************************************************/
+void *heap_pop(heap_t *heap)
+{
+	unsigned long i, child;
+	void *key;
+
+	if (heap->size == 0)
+		return NULL;
+
+	key = heap->keys[0];
+	heap->keys[0] = heap->keys[--heap->size];
+
+	i = 0;
+	while ((child = 2 * i + 1) < heap->size) {
+		if (child + 1 < heap->size &&
+		    heap->compare(heap->keys[child + 1], heap->keys[child]) > 0)
+			child++;
+		if (heap->compare(heap->keys[child], heap->keys[i]) <= 0)
+			break;
+		swap_keys(heap, i, child);
+		i = child;
+	}
+
+	return key;
+}
+
+static inline void swap_keys(heap_t *heap, unsigned long i, unsigned long j)
+{
+	void *key;
+
+	key = heap->keys[i];
+	heap->keys[i] = heap->keys[j];
+	heap->keys[j] = key;
+}
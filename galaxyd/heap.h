@@ -0,0 +1,45 @@
+/*
+ * Galaxy - A filesystem monitoring tool.
+ * Copyright (C) 2005  Gabriel Munoz <gabriel@xusia.net>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ */
+
+#ifndef HEAP_H
+#define HEAP_H
+
+typedef struct heap_t {
+	unsigned long size;
+	unsigned long capacity;
+	void **keys;
+	int (*compare)(const void *a, const void *b);
+	void (*destroy)(void *key);
+} heap_t;
+
+/* Allocates, initializes, and returns a heap container */
+heap_t *heap_create(int (*compare)(const void *a, const void *b),
+	void (*destroy)(void *key));
+/* Destroys all elements in the heap */
+void heap_destroy(heap_t *heap);
+/* Inserts a key into the heap */
+int heap_push(heap_t *heap, void *key);
+/* Removes the first key of the heap and returns it */
+void *heap_pop(heap_t *heap);
+
+#define heap_size(heap)    ((heap)->size)
+#define heap_peek(heap)    ((heap)->size ? (heap)->keys[0] : NULL)
+
+#endif
@@ -30,6 +30,14 @@
 #  include <string.h>
 #endif
 
+#if HAVE_SYS_TIME_H
+#  include <sys/time.h>
+#endif
+
+#if HAVE_SYS_STAT_H
+#  include <sys/stat.h>
+#endif
+
 #if HAVE_PTHREAD_H
 #  include <pthread.h>
 #endif
@@ -52,15 +60,159 @@
 #include "galaxy.h"
 #include "notifier.h"
 #include "list.h"
+#include "dir_tree.h"
+#include "inotify_utils.h"
+#include "self_events.h"
+#include "recovery.h"
+#include "storm.h"
+#include "crawler_thread.h"
+#include "thread_pool.h"
+#include "watch_budget.h"
+#include "fs_policy.h"
+#include "dirfd_cache.h"
 #include "error.h"
 
-extern pthread_mutex_t inotify_wds_mutex;
-extern GHashTable *inotify_wds;
+/* How long the MOVED_FROM half of a directory rename waits for its
+ * MOVED_TO half before the directory is considered moved out. */
+#define MOVE_WINDOW_USEC  500000
+
+/* A directory that was moved from a watched directory, keyed on the
+ * inotify cookie. Only touched with the directory tree lock held. */
+struct pending_move_t {
+	uint32_t cookie;              /* Hash table key. */
+	struct dir_node_t *node;
+	int wd;
+	struct timeval when;
+} pending_move_t;
+
+struct ihandler_data_t {
+	uint32_t mask;
+	pid_t pid;      /* Process that caused the event, or zero. */
+	struct event_stamp_t stamp;
+	char *old_name; /* Of a rename; points past `filename'. */
+	char filename[1];
+} ihandler_data_t;
+
+/* The half of a rename that came first, waiting for the other one so
+ * that clients get the rename as a single event. Keyed on the inotify
+ * cookie. */
+struct pending_rename_t {
+	uint32_t cookie;              /* Hash table key. */
+	struct ihandler_data_t *hdata;
+	struct timeval when;
+} pending_rename_t;
+
+extern thread_pool_t workers;
+
+static GHashTable *pending_moves = NULL;
+
+static pthread_mutex_t renames_mutex = PTHREAD_MUTEX_INITIALIZER;
+static GHashTable *pending_renames = NULL;
+
+static long
+usec_since(const struct timeval *then)
+{
+	struct timeval now;
+
+	gettimeofday(&now, NULL);
+	return (now.tv_sec - then->tv_sec) * 1000000L +
+		(now.tv_usec - then->tv_usec);
+}
+
+static gboolean
+expire_move(gpointer key, gpointer value, gpointer user_data)
+{
+	struct pending_move_t *move = value;
+
+	if (usec_since(&move->when) < MOVE_WINDOW_USEC)
+		return FALSE;
+
+	/* Nobody claimed the cookie: the directory left the watched tree. */
+	if (dir_tree_lookup_wd(move->wd) == move->node) {
+#ifdef DEBUG_HANDLE_INTERNAL_ACTIONS
+		err_msg("     + Directory moved out of the watched tree.\n");
+#endif
+		galaxy_remove_subtree(move->node, 1);
+	}
+	free(move);
+
+	return TRUE;
+}
+
+/*
+ * Turns the mask of a rename half that has no other half into the event
+ * it amounts to: moved out of the watched tree is deleted, moved in is
+ * created.
+ */
+static uint32_t
+unpaired_mask(uint32_t mask)
+{
+	if (mask & IN_MOVED_FROM)
+		mask = (mask & ~IN_MOVED_FROM) | IN_DELETE;
+	if (mask & IN_MOVED_TO)
+		mask = (mask & ~IN_MOVED_TO) | IN_CREATE;
+
+	return mask;
+}
+
+static gboolean
+expire_rename(gpointer key, gpointer value, gpointer user_data)
+{
+	struct pending_rename_t *rename = value;
+
+	if (usec_since(&rename->when) < MOVE_WINDOW_USEC)
+		return FALSE;
+
+	rename->hdata->mask = unpaired_mask(rename->hdata->mask);
+	if (list_push((list_t *)user_data, rename->hdata) < 0)
+		free(rename->hdata);
+	free(rename);
+
+	return TRUE;
+}
+
+static void ihandler_job(void *arg);
+
+/*
+ * Expires every pending directory move and rename half older than the
+ * move window. This is called by the inotify watcher threads each time
+ * they run dry.
+ */
+void
+expire_pending_moves(void)
+{
+	struct ihandler_data_t *hdata;
+	list_t *expired;
+
+	dir_tree_lock();
+	if (pending_moves != NULL)
+		g_hash_table_foreach_remove(pending_moves, expire_move, NULL);
+	dir_tree_unlock();
+
+	pthread_mutex_lock(&renames_mutex);
+	if (pending_renames == NULL || g_hash_table_size(pending_renames) == 0) {
+		pthread_mutex_unlock(&renames_mutex);
+		return;
+	}
+	expired = list_create(NULL);
+	if (expired == NULL) {
+		pthread_mutex_unlock(&renames_mutex);
+		return;
+	}
+	g_hash_table_foreach_remove(pending_renames, expire_rename, expired);
+	pthread_mutex_unlock(&renames_mutex);
+
+	while ((hdata = list_shift(expired)) != NULL)
+		if (thread_pool_submit(workers, ihandler_job, hdata) < 0)
+			free(hdata);
+	list_destroy(expired);
+}
 
 /*
  * Handles the following internal events:
  *   - Adding a new directory
- *   - Removing an existing watch directory
+ *   - Moving a directory within, into or out of the watched tree
+ *   - Removing an existing watch directory (IN_IGNORED)
  *   - Unmounting of a directory
  *
  * An internal event is one that is meaningful to the galaxy daemon,
@@ -68,12 +220,25 @@ extern GHashTable *inotify_wds;
  * in the file/directory that this event has occured on. It is required
  * info to maintain the state of the watch directories.
  *
+ * This runs on the inotify watcher thread of the event's inotify
+ * instance, in the order the kernel queued the events, since each
+ * action depends on the ones before it. The two halves of a directory
+ * move between instances may come in either order; a MOVED_TO seen
+ * first watches the directory as new, and the MOVED_FROM then expires
+ * and drops the old path.
+ *
  * Return Value:
  *   Return -1 on error, otherwise zero on success.
  */
 static int
 handle_internal_actions(const struct inotify_event *event, const char *filename)
 {
+	struct dir_node_t *node, *parent;
+	struct pending_move_t *move;
+	char *from, *path;
+	uint32_t mask;
+	int ret;
+
 #ifdef DEBUG_HANDLE_INTERNAL_ACTIONS
 	err_msg("  => DEBUG[handle_internal_actions]: Checking if internal event...\n");
 #endif
@@ -83,35 +248,143 @@ handle_internal_actions(const struct inotify_event *event, const char *filename)
 #ifdef DEBUG_HANDLE_INTERNAL_ACTIONS
 		err_msg("     + Create a new directory event detected.\n");
 #endif
-		wd = galaxy_add_watch(filename, IN_ALL_EVENTS);
+		if (!fs_policy_allows(filename, NULL))
+			return 0;
+		mask = galaxy_watch_mask(filename);
+		if (mask == 0)
+			return 0;
+		wd = galaxy_add_watch(filename, mask);
+		if (wd == -2)
+			return watch_budget_poll(filename, 0);
 		if (wd < 0) {
 			err_msg("error[handle_internal_actions]: Unable to add watch event for directory '%s'\n", filename);
 			return -1;
 		}
-	} else if (event->mask & IN_DELETE_SELF && event->mask & IN_ISDIR) {
-		/* Event: Delete a directory. */
-		int err;
+		/* Catch whatever was created before the watch landed. */
+		scan_new_directory(filename);
+	} else if (event->mask & IN_MOVED_FROM && event->mask & IN_ISDIR) {
+		/* Event: A directory was moved away. Wait for the other half. */
+#ifdef DEBUG_HANDLE_INTERNAL_ACTIONS
+		err_msg("     + Move a directory (from) event detected.\n");
+#endif
+		dir_tree_lock();
+		parent = dir_tree_lookup_wd(event->wd);
+		node = parent ? dir_node_child(parent, event->name) : NULL;
+		if (node != NULL && node->wd < 0) {
+			/* Unwatched nodes can't be validated later, so don't keep
+			 * them around; MOVED_TO treats the directory as new. */
+			galaxy_remove_subtree(node, 1);
+		} else if (node != NULL) {
+			move = malloc(sizeof(struct pending_move_t));
+			if (move == NULL) {
+				err_malloc(errno);
+				galaxy_remove_subtree(node, 1);
+				dir_tree_unlock();
+				return -1;
+			}
+			move->cookie = event->cookie;
+			move->node = node;
+			move->wd = node->wd;
+			gettimeofday(&move->when, NULL);
+			if (pending_moves == NULL)
+				pending_moves = g_hash_table_new(g_int_hash, g_int_equal);
+			g_hash_table_insert(pending_moves, &move->cookie, move);
+		}
+		dir_tree_unlock();
+	} else if (event->mask & IN_MOVED_TO && event->mask & IN_ISDIR) {
+		/* Event: A directory was moved in. Re-home it if it came from
+		 * within the tree, otherwise it is new to us. */
 #ifdef DEBUG_HANDLE_INTERNAL_ACTIONS
-		err_msg("     + Delete a directory event detected.\n");
+		err_msg("     + Move a directory (to) event detected.\n");
 #endif
-		err = galaxy_remove_watch(event->wd);
-		if (err < 0) {
-			err_msg("error[handle_internal_actions]: Unable to remove watch event for directory '%s'\n", filename);
+		dir_tree_lock();
+		move = NULL;
+		if (pending_moves != NULL)
+			move = g_hash_table_lookup(pending_moves, &event->cookie);
+		if (move != NULL) {
+			g_hash_table_remove(pending_moves, &event->cookie);
+			parent = dir_tree_lookup_wd(event->wd);
+			from = NULL;
+			if (dir_tree_lookup_wd(move->wd) != move->node) {
+				/* Went away while the move was pending. */
+				move->node = NULL;
+			} else {
+				path = dir_node_path(move->node, NULL);
+				if (path != NULL)
+					from = strdup(path);
+				if (parent == NULL ||
+				    dir_node_move(move->node, parent, event->name) < 0) {
+					galaxy_remove_subtree(move->node, 1);
+					move->node = NULL;
+				}
+			}
+			dir_tree_unlock();
+			/* Matching the subscriptions is left out of the tree lock,
+			 * so the node is looked up again to drop it. */
+			if (move->node != NULL && galaxy_watch_mask(filename) == 0) {
+				dir_tree_lock();
+				if (dir_tree_lookup_wd(move->wd) == move->node)
+					galaxy_remove_subtree(move->node, 1);
+				dir_tree_unlock();
+				free(from);
+				free(move);
+				return 0;
+			}
+			if (move->node != NULL) {
+				free(move);
+				/* Subdirectories may be wanted at the new path, unless
+				 * the subscriptions can't tell the two paths apart. */
+				if (from == NULL || galaxy_subtree_differs(from, filename))
+					rewatch_subtree(filename);
+				free(from);
+				return 0;
+			}
+			free(from);
+			free(move);
+		} else {
+			dir_tree_unlock();
+		}
+		if (!fs_policy_allows(filename, NULL))
+			return 0;
+		mask = galaxy_watch_mask(filename);
+		if (mask == 0)
+			return 0;
+		ret = galaxy_add_watch(filename, mask);
+		if (ret == -2)
+			return watch_budget_poll(filename, 0);
+		if (ret < 0) {
+			err_msg("error[handle_internal_actions]: Unable to add watch event for directory '%s'\n", filename);
 			return -1;
 		}
+		scan_new_directory(filename);
 	} else if (event->mask & IN_UNMOUNT) {
-		/* Event: Unmount a directory. */
+		/* Event: Unmount a directory. The kernel drops every watch on
+		 * the file system, so drop the whole subtree in one go. */
 #ifdef DEBUG_HANDLE_INTERNAL_ACTIONS
 		err_msg("     + Unmount a directory event detected.\n");
 #endif
+		dir_tree_lock();
+		node = dir_tree_lookup_wd(event->wd);
+		if (node != NULL)
+			galaxy_remove_subtree(node, 0);
+		dir_tree_unlock();
 	} else if (event->mask & IN_Q_OVERFLOW) {
 #ifdef DEBUG_HANDLE_INTERNAL_ACTIONS
 		err_msg("     + Kernel inotify queue overflowed event detected.\n");
 #endif
 	} else if (event->mask & IN_IGNORED) {
+		/* Event: The watch is gone (deleted directory, inotify_rm_watch,
+		 * unmount). Free its entry so the wd can be safely reused. */
 #ifdef DEBUG_HANDLE_INTERNAL_ACTIONS
 		err_msg("     + Kernel inotify event ignored event detected.\n");
 #endif
+		dir_tree_lock();
+		node = dir_tree_lookup_wd(event->wd);
+		if (node != NULL) {
+			dir_node_clear_wd(node);
+			dir_node_prune(node);
+		}
+		dir_tree_unlock();
 	} else {
 #ifdef DEBUG_HANDLE_INTERNAL_ACTIONS
 		err_msg("     + Not a recognized internal event. No action will be taken.\n");
@@ -127,22 +400,157 @@ handle_internal_actions(const struct inotify_event *event, const char *filename)
  * getting handled here will be sent a message with the relevant data
  * from this event (it may depend on the state information kept when the
  * watch is created by the client application).
+ */
+static void
+ihandler_job(void *arg)
+{
+	struct ihandler_data_t *hdata;
+	struct galaxy_event_t gevent;
+
+	hdata = (struct ihandler_data_t *)arg;
+
+	/* Search list of galaxy watches for matching event(s). */
+	memset(&gevent, 0, sizeof(gevent));
+	gevent.mask = hdata->mask;
+	gevent.name = hdata->filename;
+	gevent.pid = hdata->pid;
+	gevent.old_name = hdata->old_name;
+	gevent.sequence = hdata->stamp.sequence;
+	gevent.monotonic_ns = hdata->stamp.monotonic_ns;
+	gevent.realtime_ns = hdata->stamp.realtime_ns;
+	find_matching_event(&gevent);
+
+	free(hdata);
+}
+
+/*
+ * Drops the cached directory descriptors (see dirfd_cache.c) that the
+ * event `mask' on `path' leaves pointing at the wrong directory.
+ */
+static void
+forget_dirfds(const char *path, uint32_t mask)
+{
+	if ((mask & IN_ISDIR && mask & (IN_DELETE | IN_MOVED_FROM)) ||
+	    mask & (IN_DELETE_SELF | IN_UNMOUNT))
+		dirfd_cache_forget(path);
+}
+
+static struct ihandler_data_t *
+create_hdata(const char *filename, uint32_t mask, pid_t pid,
+	const char *old_name, const struct event_stamp_t *stamp)
+{
+	struct ihandler_data_t *hdata;
+	size_t len;
+
+	len = strlen(filename);
+	hdata = malloc(sizeof(struct ihandler_data_t) + len +
+		(old_name != NULL ? strlen(old_name) + 1 : 0));
+	if (hdata == NULL) {
+		err_malloc(errno);
+		err_msg("error[create_hdata]: Unable to malloc handler data.\n");
+		return NULL;
+	}
+	hdata->mask = mask;
+	hdata->pid = pid;
+	hdata->stamp = *stamp;
+	memcpy(hdata->filename, filename, len + 1);
+	hdata->old_name = NULL;
+	if (old_name != NULL) {
+		hdata->old_name = hdata->filename + len + 1;
+		strcpy(hdata->old_name, old_name);
+	}
+
+	return hdata;
+}
+
+/*
+ * Pairs the rename half `hdata' with the other half of the rename
+ * `cookie'. The first half to come is held until the second one does,
+ * or until the move window runs out (see expire_pending_moves()).
  *
- * There may also be internal actions triggered from this handler. They
- * include things that will need to occur to maintain the state of the
- * galaxy watch list, such as:
+ * Return Value:
+ *   Returns the event to send: a single IN_MOVED_FROM | IN_MOVED_TO
+ *   event with both paths and the stamp of the half that came first
+ *   once the rename is paired, or the unpaired
+ *   equivalent of `hdata'. Returns NULL while `hdata' is held, and when
+ *   the paired event couldn't be allocated.
+ */
+static struct ihandler_data_t *
+pair_rename(struct ihandler_data_t *hdata, uint32_t cookie)
+{
+	struct pending_rename_t *rename;
+	struct ihandler_data_t *from, *to, *pair;
+
+	pthread_mutex_lock(&renames_mutex);
+	rename = NULL;
+	if (pending_renames != NULL)
+		rename = g_hash_table_lookup(pending_renames, &cookie);
+	if (rename != NULL) {
+		g_hash_table_remove(pending_renames, &cookie);
+		pthread_mutex_unlock(&renames_mutex);
+		from = hdata->mask & IN_MOVED_FROM ? hdata : rename->hdata;
+		to = from == hdata ? rename->hdata : hdata;
+		pair = create_hdata(to->filename,
+			IN_MOVED_FROM | IN_MOVED_TO | (to->mask & IN_ISDIR), 0,
+			from->filename, &rename->hdata->stamp);
+		free(rename);
+		free(from);
+		free(to);
+		return pair;
+	}
+
+	/* An inotify instance queues a MOVED_FROM right before its
+	 * MOVED_TO, so with a single instance a MOVED_TO on its own came
+	 * from outside the watched tree. */
+	if (hdata->mask & IN_MOVED_TO && galaxy_shards() == 1) {
+		pthread_mutex_unlock(&renames_mutex);
+		hdata->mask = unpaired_mask(hdata->mask);
+		return hdata;
+	}
+
+	rename = malloc(sizeof(struct pending_rename_t));
+	if (rename == NULL) {
+		pthread_mutex_unlock(&renames_mutex);
+		err_malloc(errno);
+		hdata->mask = unpaired_mask(hdata->mask);
+		return hdata;
+	}
+	rename->cookie = cookie;
+	rename->hdata = hdata;
+	gettimeofday(&rename->when, NULL);
+	if (pending_renames == NULL)
+		pending_renames = g_hash_table_new(g_int_hash, g_int_equal);
+	g_hash_table_insert(pending_renames, &rename->cookie, rename);
+	pthread_mutex_unlock(&renames_mutex);
+
+	return NULL;
+}
+
+/*
+ * Handles an inotify event read by the inotify watcher thread. The path
+ * of the event is resolved and any internal actions are taken right
+ * away, in kernel order. They include things that will need to occur to
+ * maintain the state of the galaxy watch list, such as:
  *   - Adding a new directory
- *   - Removing an existing watch directory
+ *   - Moving or removing an existing watch directory
  *   - Unmounting of a directory
+ *
+ * Matching the event against the client watches is then handed to the
+ * worker pool. The event is freed before returning.
+ *
+ * Return Value:
+ *   Returns -1 if the event could not be handed to the worker pool,
+ *   otherwise zero.
  */
-static void *
-ihandler_thread(void *arg)
+int
+handle_inotify_event(struct inotify_event *event)
 {
-	struct inotify_event *event;
-	char *dirname;
 	int err;
-	
-	event = (struct inotify_event *)arg;
+	char *path;
+	struct dir_node_t *node;
+	struct ihandler_data_t *hdata;
+	struct stat statbuf;
+	int stormy, listed;
 
 #ifdef DEBUG_IHANDLER_THREAD
 	err_msg("DEBUG[ihandler_thread]: Inotify event handler\n");
@@ -151,58 +559,124 @@ ihandler_thread(void *arg)
 	print_mask(event->mask);
 #endif
 
-	pthread_mutex_lock(&inotify_wds_mutex);
-	dirname = g_hash_table_lookup(inotify_wds, &(event->wd));
-	pthread_mutex_unlock(&inotify_wds_mutex);
+	/* Build dirname + '/' + the event filename (if it exists). The path
+	 * comes back in a per-thread buffer. */
+	dir_tree_lock();
+	node = dir_tree_lookup_wd(event->wd);
+	path = NULL;
+	stormy = listed = 0;
+	if (node != NULL) {
+		path = dir_node_path(node, event->len ? event->name : NULL);
+		/* Our own crawls and scans open and read directories too;
+		 * those reads are neither reported nor count as activity. */
+		if (path != NULL && self_event_match(path, event->mask)) {
+			dir_tree_unlock();
+#ifdef DEBUG_IHANDLER_THREAD
+			err_msg("  + Raised by our own scan of %s. Dropping event.\n", path);
+#endif
+			free(event);
+			return 0;
+		}
+		/* Busy directories are the last to lose their watch. */
+		node->active = time(NULL);
+		listed = path != NULL && event->len &&
+			recovery_wants_event(node, event->mask);
+		/* Entering a storm reuses the path buffer. */
+		if (path != NULL && storm_note_event(node, path)) {
+			stormy = 1;
+			path = dir_node_path(node, event->len ? event->name : NULL);
+		}
+	}
+	dir_tree_unlock();
 
-	/* Check for NULL'ness. Shouldn't happend. Abort if it occurs. */
-	if (dirname == NULL) {
-		err_msg("error[ihandler_thread]: Hash table lookup returned NULL.\n");
-		return NULL;
+	/* The entry is looked at without the tree lock, which every
+	 * watcher thread needs; only its listing is updated under it. */
+	if (listed) {
+		listed = lstat(path, &statbuf) == 0;
+		dir_tree_lock();
+		node = dir_tree_lookup_wd(event->wd);
+		if (node != NULL)
+			recovery_note_event(node, path, listed ? &statbuf : NULL);
+		dir_tree_unlock();
 	}
+
+	/* Events may still arrive for a watch that was just dropped (e.g.
+	 * the IN_IGNORED for a removed subtree). */
+	if (path == NULL) {
 #ifdef DEBUG_IHANDLER_THREAD
-	err_msg("  + dirname = %s\n", dirname);
+		err_msg("  + No directory for this watch descriptor. Dropping event.\n");
 #endif
+		free(event);
+		return 0;
+	}
 
-	/* Append dirname + '/' + the event filename (if it exists). */
-	char filename[strlen(dirname) + event->len + 2];
-	filename[0] = '\0';
-	strcat(filename, dirname);
-	if (event->len) {
-		if (filename[strlen(filename) - 1] != '/')
-			strcat(filename, "/");
-		strcat(filename, event->name);
+	hdata = create_hdata(path, event->mask, 0, NULL,
+		inotify_event_stamp(event));
+	if (hdata == NULL) {
+		free(event);
+		return -1;
 	}
+	forget_dirfds(hdata->filename, hdata->mask);
 
 #ifdef DEBUG_IHANDLER_THREAD
-	err_msg("  + filename = %s\n", filename);
+	err_msg("  + filename = %s\n", hdata->filename);
 #endif
 
 	/* Handle any internal actions for this event. */
-	err = handle_internal_actions(event, filename);
+	err = handle_internal_actions(event, hdata->filename);
 	if (err < 0)
 		err_msg("warning[ihandler_thread]: Unable to handle internal actions.\n");
 
-	/* Search list of galaxy watches for matching event(s). */
-	find_matching_events(filename, event->mask);
+	/* Clients get a GAL_RESCAN once the storm is over instead. */
+	if (stormy) {
+		free(hdata);
+		free(event);
+		return 0;
+	}
 
+	/* Clients get a rename as one event with both paths. */
+	if (hdata->mask & (IN_MOVED_FROM | IN_MOVED_TO)) {
+		hdata = pair_rename(hdata, event->cookie);
+		if (hdata == NULL) {
+			free(event);
+			return 0;
+		}
+	}
 	free(event);
 
-	return NULL;
+	err = thread_pool_submit(workers, ihandler_job, hdata);
+	if (err < 0)
+		free(hdata);
+
+	return err;
 }
 
 /*
- * Returns the value of pthread_create(3).
+ * Handles an event that a backend without watch descriptors (see
+ * fanotify_thread.c) already resolved to the path `path'. There is no
+ * directory tree to maintain, so the event only goes to the client
+ * watches, on the worker pool. Such backends have no rename cookie, so
+ * each half of a rename is sent as a deletion or a creation.
+ *
+ * Return Value:
+ *   Returns -1 if the event could not be handed to the worker pool,
+ *   otherwise zero.
  */
 int
-create_ihandler_thread(struct inotify_event *event)
+handle_path_event(const char *path, uint32_t mask, pid_t pid,
+	const struct event_stamp_t *stamp)
 {
+	struct ihandler_data_t *hdata;
 	int err;
-	pthread_t handler;
 
-	err = create_detached_thread(&handler, ihandler_thread, event);
+	forget_dirfds(path, mask);
+	hdata = create_hdata(path, unpaired_mask(mask), pid, NULL, stamp);
+	if (hdata == NULL)
+		return -1;
+
+	err = thread_pool_submit(workers, ihandler_job, hdata);
 	if (err < 0)
-		err_create_detached_thread(errno);
+		free(hdata);
 
 	return err;
 }
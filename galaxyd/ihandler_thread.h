@@ -21,8 +21,24 @@
 #ifndef HANDLER_H
 #define HANDLER_H
 
+#if HAVE_CONFIG_H
+#  include <config.h>
+#endif
+
+#if HAVE_INTTYPES_H
+#  include <inttypes.h>
+#endif
+
+#if HAVE_SYS_TYPES_H
+#  include <sys/types.h>
+#endif
+
 #include "inotify.h"
+#include "event_stamp.h"
 
-int create_ihandler_thread(struct inotify_event *event);
+int handle_inotify_event(struct inotify_event *event);
+int handle_path_event(const char *path, uint32_t mask, pid_t pid,
+	const struct event_stamp_t *stamp);
+void expire_pending_moves(void);
 
 #endif
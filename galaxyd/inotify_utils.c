@@ -63,9 +63,7 @@
 #  include <errno.h>
 #endif
 
-#if HAVE_LIBGLIB_2_0
-#  include <glib.h>
-#endif
+#include <assert.h>
 
 #include "inotify.h"
 #include "inotify-syscalls.h"
@@ -73,28 +71,124 @@
 
 #include "event_queue.h"
 #include "ihandler_thread.h"
+#include "dir_tree.h"
+#include "watch.h"
+#include "watch_budget.h"
+#include "storm.h"
 #include "error.h"
 
 #define ALL_MASK 0xffffffff
 #define EVENTQ_SIZE 128
 
-extern pthread_mutex_t inotify_wds_mutex;
-extern GHashTable *inotify_wds;
-
 struct inotify_event *eventq[EVENTQ_SIZE];
 int eventq_head = 0;
 int eventq_tail = 0;
 
-static int inotify_fd = -1;
+/*
+ * The watches are split across several inotify instances (shards), each
+ * read by its own watcher thread, so the events of a busy part of the
+ * tree neither queue up behind the rest nor overflow the other queues.
+ *
+ * Watch descriptors are only unique within an instance. The rest of the
+ * daemon sees `wd * shard_count + shard', which stays the kernel's own
+ * wd with a single shard.
+ */
+static int shard_fds[GALAXY_MAX_SHARDS];
+static int shard_count = 0;
+
+/*
+ * Opens `count' inotify instances.
+ *
+ * Return Value:
+ *   Returns -1 on error, otherwise zero.
+ */
+int
+open_devs(int count)
+{
+	int i;
+
+	assert(count > 0 && count <= GALAXY_MAX_SHARDS);
+
+	for (i = 0; i < count; i++) {
+		shard_fds[i] = inotify_init();
+		if (shard_fds[i] < 0) {
+			err_inotify_init(errno);
+			while (i-- > 0)
+				close_dev(shard_fds[i]);
+			return -1;
+		}
+	}
+	shard_count = count;
+
+	return 0;
+}
+
+void
+close_devs(void)
+{
+	int i;
+
+	for (i = 0; i < shard_count; i++)
+		close_dev(shard_fds[i]);
+	shard_count = 0;
+}
+
+int
+galaxy_shards(void)
+{
+	return shard_count;
+}
+
+int
+galaxy_shard_fd(int shard)
+{
+	return shard_fds[shard];
+}
 
+/*
+ * Turns the watch descriptor `wd' of the inotify instance `shard' into
+ * the daemon wide one.
+ */
 int
-open_dev(void)
+galaxy_wd(int shard, int wd)
 {
-	inotify_fd = inotify_init ();
-	if (inotify_fd < 0)
-		err_inotify_init(errno);
+	return wd * shard_count + shard;
+}
 
-	return inotify_fd;
+int
+galaxy_wd_shard(int wd)
+{
+	return wd % shard_count;
+}
+
+static int
+kernel_wd(int wd)
+{
+	return wd / shard_count;
+}
+
+/*
+ * Picks the inotify instance for a new watch on `dirname' by hashing its
+ * first GALAXY_SHARD_DEPTH path components, so each subtree below that
+ * depth (e.g. a home directory) stays on a single instance.
+ */
+static int
+shard_of(const char *dirname)
+{
+	const char *p;
+	uint32_t hash = 2166136261u;
+	int depth = 0;
+
+	if (shard_count == 1)
+		return 0;
+
+	for (p = dirname; *p != '\0'; p++) {
+		if (*p == '/' && p != dirname && ++depth == GALAXY_SHARD_DEPTH)
+			break;
+		hash = (hash ^ (unsigned char)*p) * 16777619u;
+	}
+
+	return hash % shard_count;
 }
 
 int close_dev (int fd)
@@ -153,13 +247,11 @@ print_event(struct inotify_event *event)
 {
 	char *path;
 
-	pthread_mutex_lock(&inotify_wds_mutex);
-	path = g_hash_table_lookup(inotify_wds, &(event->wd));
-	pthread_mutex_unlock(&inotify_wds_mutex);
+	path = dir_tree_wd_path(event->wd, event->len ? event->name : NULL);
 
 	fprintf(stderr, "event[%d]", event->wd);
 	if (event->len)
-		fprintf(stderr, ": '%s/%s'", path, event->name);
+		fprintf(stderr, ": '%s'", path ? path : event->name);
 	fprintf(stderr, " => ");
 	print_mask (event->mask);
 }
@@ -177,12 +269,36 @@ print_events(queue_t q)
 	}
 }
 
+/* read_events() keeps the stamp of each event right after its name,
+ * 8-byte aligned. */
+#define STAMP_OFFSET(event) \
+	((sizeof(struct inotify_event) + (event)->len + 7) & ~(size_t)7)
+
+/*
+ * Return Value:
+ *   Returns the stamp that read_events() gave `event'.
+ */
+struct event_stamp_t *
+inotify_event_stamp(const struct inotify_event *event)
+{
+	return (struct event_stamp_t *)((char *)event + STAMP_OFFSET(event));
+}
+
+/*
+ * Reads the pending events of the inotify instance `fd' into `q'. Each
+ * event is stamped; see inotify_event_stamp().
+ *
+ * Return Value:
+ *   Returns the number of events read, or the return value of read(2)
+ *   if it failed.
+ */
 int
 read_events(queue_t q, int fd)
 {
 	char buffer[16384];
 	size_t buffer_i;
 	struct inotify_event *pevent, *event;
+	struct event_stamp_t stamp;
 	ssize_t r;
 	size_t event_size;
 	int count = 0;
@@ -203,6 +319,14 @@ read_events(queue_t q, int fd)
 	err_msg("  => Parsing inotify events and queuing them...\n");
 #endif
 
+	/* Every event of this read is stamped with the time it was read;
+	 * count them first to reserve their sequence numbers in one go. */
+	for (buffer_i = 0; buffer_i < r; count++)
+		buffer_i += sizeof(struct inotify_event) +
+			((struct inotify_event *)&buffer[buffer_i])->len;
+	stamp_events(&stamp, count);
+	count = 0;
+
 	buffer_i = 0;
 	while (buffer_i < r) {
 		/* Parse events and queue them ! */
@@ -211,8 +335,16 @@ read_events(queue_t q, int fd)
 #endif
 		pevent = (struct inotify_event *)&buffer[buffer_i];
 		event_size = sizeof(struct inotify_event) + pevent->len;
-		event = malloc(event_size);
+		event = malloc(STAMP_OFFSET(pevent) + sizeof(struct event_stamp_t));
+		if (event == NULL) {
+			err_malloc(errno);
+			buffer_i += event_size;
+			stamp.sequence++;
+			continue;
+		}
 		memmove(event, pevent, event_size);
+		*inotify_event_stamp(event) = stamp;
+		stamp.sequence++;
 #ifdef DEBUG_READ_EVENTS
 		err_msg("        + Inotify watch descriptor = %d\n", event->wd);
 #endif
@@ -267,11 +399,51 @@ read_and_print_events(queue_t q, int fd)
 }
 
 /*
- * Adds a directory name into the inotify watch list.
+ * Computes the kernel event mask for the directory `dirname': the events
+ * client subscriptions can match below it, plus the events the daemon
+ * needs internally.
  *
  * Return Value:
- *   Returns -1 on error. On success, it will return a new file
- *   descriptor for new inotify watch.
+ *   Returns zero if the directory doesn't need a watch at all.
+ */
+uint32_t
+galaxy_watch_mask(const char *dirname)
+{
+	return galaxy_watch_interest(dirname, NULL);
+}
+
+/*
+ * Like galaxy_watch_mask(), but also tells in `explicit' whether a
+ * client asked for this part of the tree by name (see
+ * galaxy_subtree_mask()).
+ */
+uint32_t
+galaxy_watch_interest(const char *dirname, int *explicit)
+{
+	uint32_t mask;
+
+	mask = galaxy_subtree_mask(dirname, explicit) & IN_ALL_EVENTS;
+	if (mask == 0)
+		return 0;
+
+	/* Subtrees flooded with events only get what the daemon needs
+	 * until they calm down (see storm.c). */
+	if (storm_covers(dirname))
+		return GALAXY_INTERNAL_EVENTS;
+
+	return mask | GALAXY_INTERNAL_EVENTS;
+}
+
+/*
+ * Adds a directory name into the inotify watch list. When the watch
+ * budget is used up the coldest directories are evicted to make room
+ * (see watch_budget.c).
+ *
+ * Return Value:
+ *   Returns -1 on error, or -2 if no watch could be found for the
+ *   directory; the caller should then poll it with watch_budget_poll().
+ *   On success, it will return a new file descriptor for new inotify
+ *   watch.
  *
  * See Also:
  *   inotify_add_watch(2)
@@ -279,31 +451,92 @@ read_and_print_events(queue_t q, int fd)
 int
 galaxy_add_watch(const char *dirname, uint32_t mask)
 {
-	int *wd;
+	int wd, fd, shard;
+	struct dir_node_t *node;
 
 	assert(dirname);
 
-	wd = malloc(sizeof(int));
-	if (wd == NULL) {
-		err_malloc(errno);
-		err_msg("error[galaxy_add_watch]: Unable to malloc an int.\n");
-		return -1;
+	if (watch_budget_reserve() < 0)
+		return -2;
+
+	shard = shard_of(dirname);
+	fd = shard_fds[shard];
+	wd = inotify_add_watch(fd, dirname, mask);
+	if (wd < 0 && errno == ENOSPC) {
+		if (watch_budget_exhausted() == 0)
+			return -2;
+		wd = inotify_add_watch(fd, dirname, mask);
+		if (wd < 0 && errno == ENOSPC)
+			return -2;
 	}
-
-	*wd = inotify_add_watch(inotify_fd, dirname, mask);
-	if (*wd < 0) {
+	if (wd < 0) {
 		err_inotify_add_watch(errno);
 		err_msg("error[galaxy_add_watch]: Unable to add inotify watch for '%s'\n",
 			dirname);
-		free(wd);
 		return -1;
 	}
+	wd = galaxy_wd(shard, wd);
+
+	dir_tree_lock();
+	node = dir_tree_insert(dirname);
+	if (node == NULL) {
+		dir_tree_unlock();
+		err_msg("error[galaxy_add_watch]: Unable to insert '%s' into directory tree.\n",
+			dirname);
+		inotify_rm_watch(fd, kernel_wd(wd));
+		return -1;
+	}
+	if (dir_node_set_wd(node, wd, mask) < 0) {
+		/* The same directory is already watched through another path
+		 * (e.g. a bind mount). Keep the first path. */
+		dir_node_prune(node);
+	}
+	dir_tree_unlock();
 
-	pthread_mutex_lock(&inotify_wds_mutex);
-	g_hash_table_insert(inotify_wds, wd, g_strdup(dirname));
-	pthread_mutex_unlock(&inotify_wds_mutex);
+	return wd;
+}
 
-	return *wd;
+/*
+ * Replaces the event mask of the existing watch on `node' with `mask'.
+ * The caller must hold the tree lock.
+ *
+ * Return Value:
+ *   Returns -1 on error, otherwise zero.
+ */
+int
+galaxy_update_watch(struct dir_node_t *node, uint32_t mask)
+{
+	struct dir_node_t *other;
+	int wd, fd, shard;
+
+	assert(node->wd >= 0);
+
+	if (node->mask == mask)
+		return 0;
+
+	/* The watch can only be changed through the instance holding it. */
+	shard = galaxy_wd_shard(node->wd);
+	fd = shard_fds[shard];
+	wd = inotify_add_watch(fd, dir_node_path(node, NULL), mask);
+	if (wd < 0) {
+		err_inotify_add_watch(errno);
+		err_msg("error[galaxy_update_watch]: Unable to update inotify watch #%d\n",
+			node->wd);
+		return -1;
+	}
+	if (galaxy_wd(shard, wd) != node->wd) {
+		/* The path now leads to another directory. Undo the change on
+		 * that one; the stale node goes away with its own IN_IGNORED. */
+		other = dir_tree_lookup_wd(galaxy_wd(shard, wd));
+		if (other != NULL)
+			inotify_add_watch(fd, dir_node_path(node, NULL), other->mask);
+		else
+			inotify_rm_watch(fd, wd);
+		return -1;
+	}
+	node->mask = mask;
+
+	return 0;
 }
 
 /*
@@ -337,7 +570,11 @@ galaxy_remove_watch(__u32 wd)
 {
 	int ret;
 
-	ret = inotify_rm_watch(inotify_fd, wd);
+	ret = inotify_rm_watch(shard_fds[galaxy_wd_shard(wd)], kernel_wd(wd));
+	if (ret < 0 && errno == EINVAL) {
+		/* The kernel dropped it already (unmount, deleted directory). */
+		return -1;
+	}
 	if (ret < 0) {
 		err_inotify_rm_watch(errno);
 		err_msg("error[galaxy_remove_watch]: Unable to remove watch for watch #%d\n",
@@ -348,6 +585,27 @@ galaxy_remove_watch(__u32 wd)
 	return ret;
 }
 
+static void
+remove_node_watch(struct dir_node_t *node, void *data)
+{
+	/* Removing the watch makes the kernel queue an IN_IGNORED, which is
+	 * dropped since the wd will no longer be in the tree. */
+	if (node->wd >= 0 && *(int *)data)
+		galaxy_remove_watch(node->wd);
+}
+
+/*
+ * Drops `node' and every directory below it from the directory tree.
+ * If `rm_watches' is set their inotify watches are removed as well,
+ * otherwise the kernel is expected to have dropped them already (e.g.
+ * on an unmount). The caller must hold the tree lock.
+ */
+void
+galaxy_remove_subtree(struct dir_node_t *node, int rm_watches)
+{
+	dir_node_remove(node, remove_node_watch, &rm_watches);
+}
+
 /*
  * Obsolete in favor of galaxy_remove_watch
  */
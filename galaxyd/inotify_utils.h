@@ -34,19 +34,43 @@
 
 #include "inotify.h"
 #include "event_queue.h"
+#include "dir_tree.h"
+#include "event_stamp.h"
 
+/* At most this many inotify instances; see open_devs(). */
+#define GALAXY_MAX_SHARDS 16
+
+/* Path components that decide which instance watches a directory. */
+#define GALAXY_SHARD_DEPTH 2
+
+/* Events the daemon needs on every watched directory to keep the
+ * directory tree up to date, whatever the clients subscribed to. */
+#define GALAXY_INTERNAL_EVENTS (IN_CREATE | IN_MOVED_FROM | IN_MOVED_TO)
+
+uint32_t galaxy_watch_mask(const char *dirname);
+uint32_t galaxy_watch_interest(const char *dirname, int *explicit);
 int galaxy_add_watch(const char *dirname, uint32_t mask);
+int galaxy_update_watch(struct dir_node_t *node, uint32_t mask);
 int galaxy_remove_watch(__u32 wd);
+void galaxy_remove_subtree(struct dir_node_t *node, int rm_watches);
 
+void print_mask(int mask);
 void print_event (struct inotify_event *event);
 int read_event (int fd, struct inotify_event *event);
 int read_events (queue_t q, int fd);
+struct event_stamp_t *inotify_event_stamp(const struct inotify_event *event);
 int event_check (int fd);
 int read_and_print_events (queue_t q, int fd);
 int dev_stats (int fd);
 int dev_setdebug (int fd, int debug);
 int close_dev (int fd);
-int open_dev ();
+int open_devs(int count);
+void close_devs(void);
+
+int galaxy_shards(void);
+int galaxy_shard_fd(int shard);
+int galaxy_wd(int shard, int wd);
+int galaxy_wd_shard(int wd);
 
 void err_inotify_init(int err);
 void err_inotify_add_watch(int err);
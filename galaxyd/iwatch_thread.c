@@ -39,33 +39,65 @@
 #include "ihandler_thread.h"
 #include "inotify_utils.h"
 #include "event_queue.h"
+#include "watch_budget.h"
+#include "self_events.h"
+#include "recovery.h"
+#include "storm.h"
 #include "error.h"
 
 struct watch_data_t {
-	int fd;
+	int shard;
 	queue_t q;
 } watch_data_t;
 
+/*
+ * Reads and handles the events of one inotify instance. Each instance
+ * has a thread of its own, so the events of a directory are still
+ * handled in the order the kernel queued them.
+ */
 static void *
 watch(void *arg)
 {
-	int fd, err;
+	int shard, fd, err, wd;
 	queue_t q;
 	struct inotify_event *event;
 
-	fd = ((struct watch_data_t *)arg)->fd;
+	shard = ((struct watch_data_t *)arg)->shard;
 	q = ((struct watch_data_t *)arg)->q;
 	free(arg);
+	fd = galaxy_shard_fd(shard);
 
 	while (1) {
 		while (!queue_empty(q)) {
 			event = queue_front(q);
 			queue_dequeue(q);
-			err = create_ihandler_thread(event);
+			/* Events were lost, but only on this instance. */
+			if (event->mask & IN_Q_OVERFLOW) {
+				recovery_start(shard);
+				free(event);
+				continue;
+			}
+			event->wd = galaxy_wd(shard, event->wd);
+			wd = event->wd;
+			err = handle_inotify_event(event);
 			if (err < 0)
-				err_msg("warning[watch]: Unable to spawn inotify event handler for event->wd #%d\n", event->wd);
+				err_msg("warning[watch]: Unable to queue inotify event handler for event->wd #%d\n", wd);
 		}
 
+		/* Directories moved out of the tree are only known once their
+		 * MOVED_TO half fails to show up. */
+		expire_pending_moves();
+
+		/* Subtrees that lost their watches are polled instead. */
+		watch_budget_tick();
+		self_events_expire();
+
+		/* Rescans after a queue overflow go on as the queue allows. */
+		recovery_tick();
+
+		/* Flooded subtrees get their watches back once calm. */
+		storm_tick();
+
 		if (event_check(fd) > 0) {
 			int r;
 			r = read_events(q, fd);
@@ -78,7 +110,7 @@ watch(void *arg)
 }
 
 int
-create_iwatch_thread(pthread_t *id, int fd, queue_t q)
+create_iwatch_thread(pthread_t *id, int shard, queue_t q)
 {
 	int err;
 	struct watch_data_t *wdata;
@@ -90,7 +122,7 @@ create_iwatch_thread(pthread_t *id, int fd, queue_t q)
 		return -1;
 	}
 
-	wdata->fd = fd;
+	wdata->shard = shard;
 	wdata->q = q;
 
 	err = create_joinable_thread(id, watch, wdata);
@@ -31,6 +31,6 @@
 
 #include "event_queue.h"
 
-int create_iwatch_thread(pthread_t *id, int fd, queue_t q);
+int create_iwatch_thread(pthread_t *id, int shard, queue_t q);
 
 #endif
@@ -0,0 +1,304 @@
+/*
+ * Galaxy - A filesystem monitoring tool.
+ * Copyright (C) 2005  Gabriel Munoz <gabriel@xusia.net>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ */
+
+#if HAVE_CONFIG_H
+#  include <config.h>
+#endif
+
+#if HAVE_STDLIB_H
+#  include <stdlib.h>
+#endif
+
+#if HAVE_STRING_H
+#  include <string.h>
+#endif
+
+#if HAVE_SYS_TYPES_H
+#  include <sys/types.h>
+#endif
+
+#if HAVE_SYS_STAT_H
+#  include <sys/stat.h>
+#endif
+
+#if HAVE_DIRENT_H
+#  include <dirent.h>
+#endif
+
+#if HAVE_ERRNO_H
+#  include <errno.h>
+#endif
+
+#if HAVE_LIBGLIB_2_0
+#  include <glib.h>
+#endif
+
+#include "listing.h"
+#include "inotify.h"
+#include "self_events.h"
+#include "error.h"
+
+struct entry_t {
+	ino_t ino;
+	mode_t mode;
+	uid_t uid;
+	gid_t gid;
+	off_t size;
+	time_t mtime;
+	time_t ctime;
+	char name[1];
+} entry_t;
+
+struct listing_struct {
+	GHashTable *entries;  /* Keyed on the entry's own name field. */
+};
+
+struct diff_data_t {
+	listing_t other;
+	void (*func)(const char *name, uint32_t mask, void *data);
+	void *data;
+} diff_data_t;
+
+/*
+ * Creates an empty listing, to be filled with listing_update().
+ *
+ * Return Value:
+ *   Returns the new listing, or NULL on error.
+ */
+listing_t
+listing_create(void)
+{
+	listing_t listing;
+
+	listing = malloc(sizeof(struct listing_struct));
+	if (listing == NULL) {
+		err_malloc(errno);
+		err_msg("error[listing_create]: Unable to malloc a listing.\n");
+		return NULL;
+	}
+	listing->entries = g_hash_table_new_full(g_str_hash, g_str_equal, NULL,
+		free);
+
+	return listing;
+}
+
+/*
+ * Reads the entries of the directory `dirname' (except "." and "..")
+ * together with the metadata needed to tell how they changed.
+ *
+ * Return Value:
+ *   Returns the new listing, or NULL if the directory couldn't be read.
+ */
+listing_t
+listing_read(const char *dirname)
+{
+	listing_t listing;
+	DIR *dir;
+	struct dirent *dent;
+	struct stat statbuf;
+	char path[4097];
+	size_t path_len, len;
+
+	path_len = strlen(dirname);
+	if (path_len + 2 > sizeof(path))
+		return NULL;
+	strcpy(path, dirname);
+	if (path_len == 0 || path[path_len - 1] != '/')
+		path[path_len++] = '/';
+
+	self_scan_begin(dirname);
+	dir = opendir(dirname);
+	if (dir == NULL) {
+		self_scan_end(dirname);
+		return NULL;
+	}
+
+	listing = listing_create();
+	if (listing == NULL) {
+		closedir(dir);
+		self_scan_end(dirname);
+		return NULL;
+	}
+
+	while ((dent = readdir(dir)) != NULL) {
+		if (strcmp(dent->d_name, ".") == 0 || strcmp(dent->d_name, "..") == 0)
+			continue;
+		len = strlen(dent->d_name);
+		if (path_len + len >= sizeof(path))
+			continue;
+		strcpy(path + path_len, dent->d_name);
+		if (lstat(path, &statbuf) == -1)
+			continue;  /* Gone already. */
+		listing_update(listing, dent->d_name, &statbuf);
+	}
+
+	closedir(dir);
+	self_scan_end(dirname);
+
+	return listing;
+}
+
+void
+listing_destroy(listing_t listing)
+{
+	if (listing == NULL)
+		return;
+	g_hash_table_destroy(listing->entries);
+	free(listing);
+}
+
+unsigned long
+listing_size(listing_t listing)
+{
+	return g_hash_table_size(listing->entries);
+}
+
+/*
+ * Brings the entry `name' of `listing' in line with `statbuf', as
+ * returned by lstat(2). A NULL `statbuf' means the entry is gone.
+ */
+void
+listing_update(listing_t listing, const char *name, const struct stat *statbuf)
+{
+	struct entry_t *entry;
+	size_t len;
+
+	if (statbuf == NULL) {
+		g_hash_table_remove(listing->entries, name);
+		return;
+	}
+
+	len = strlen(name);
+	entry = malloc(sizeof(struct entry_t) + len);
+	if (entry == NULL) {
+		err_malloc(errno);
+		return;
+	}
+	entry->ino = statbuf->st_ino;
+	entry->mode = statbuf->st_mode;
+	entry->uid = statbuf->st_uid;
+	entry->gid = statbuf->st_gid;
+	entry->size = statbuf->st_size;
+	entry->mtime = statbuf->st_mtime;
+	entry->ctime = statbuf->st_ctime;
+	memcpy(entry->name, name, len + 1);
+	g_hash_table_replace(listing->entries, entry->name, entry);
+}
+
+static uint32_t
+isdir_bit(const struct entry_t *entry)
+{
+	return S_ISDIR(entry->mode) ? IN_ISDIR : 0;
+}
+
+static void
+diff_removed(gpointer key, gpointer value, gpointer user_data)
+{
+	struct entry_t *entry = value;
+	struct diff_data_t *diff = user_data;
+
+	if (g_hash_table_lookup(diff->other->entries, entry->name) == NULL)
+		diff->func(entry->name, IN_DELETE | isdir_bit(entry), diff->data);
+}
+
+static void
+diff_added(gpointer key, gpointer value, gpointer user_data)
+{
+	struct entry_t *entry = value, *old;
+	struct diff_data_t *diff = user_data;
+
+	old = NULL;
+	if (diff->other != NULL)
+		old = g_hash_table_lookup(diff->other->entries, entry->name);
+
+	if (old == NULL) {
+		diff->func(entry->name, IN_CREATE | isdir_bit(entry), diff->data);
+	} else if (old->ino != entry->ino ||
+	           (old->mode & S_IFMT) != (entry->mode & S_IFMT)) {
+		/* Replaced by another file under the same name. */
+		diff->func(entry->name, IN_DELETE | isdir_bit(old), diff->data);
+		diff->func(entry->name, IN_CREATE | isdir_bit(entry), diff->data);
+	} else if (!S_ISDIR(entry->mode) &&
+	           (old->size != entry->size || old->mtime != entry->mtime)) {
+		diff->func(entry->name, IN_MODIFY, diff->data);
+	} else if (old->mode != entry->mode || old->uid != entry->uid ||
+	           old->gid != entry->gid ||
+	           (!S_ISDIR(entry->mode) && old->ctime != entry->ctime)) {
+		/* A directory's ctime moves with its entries, so only explicit
+		 * metadata changes count for directories. */
+		diff->func(entry->name, IN_ATTRIB | isdir_bit(entry), diff->data);
+	}
+}
+
+/*
+ * Compares two listings of the same directory and calls `func' with the
+ * inotify event that best describes each change: IN_DELETE for entries
+ * that went away, IN_CREATE for new ones, IN_MODIFY for files whose size
+ * or modification time changed and IN_ATTRIB for metadata changes
+ * (IN_ISDIR is or-ed in for directories). An `old' listing of NULL is
+ * treated as empty, so every entry of `new' is reported as created.
+ *
+ * Changes that cancel out between the two snapshots are not seen.
+ */
+void
+listing_diff(listing_t old, listing_t new,
+	void (*func)(const char *name, uint32_t mask, void *data), void *data)
+{
+	struct diff_data_t diff;
+
+	diff.func = func;
+	diff.data = data;
+
+	if (old != NULL) {
+		diff.other = new;
+		g_hash_table_foreach(old->entries, diff_removed, &diff);
+	}
+	diff.other = old;
+	g_hash_table_foreach(new->entries, diff_added, &diff);
+}
+
+struct dir_data_t {
+	void (*func)(const char *name, void *data);
+	void *data;
+} dir_data_t;
+
+static void
+foreach_dir(gpointer key, gpointer value, gpointer user_data)
+{
+	struct entry_t *entry = value;
+	struct dir_data_t *dir = user_data;
+
+	if (S_ISDIR(entry->mode))
+		dir->func(entry->name, dir->data);
+}
+
+/*
+ * Calls `func' with the name of every subdirectory in `listing'.
+ */
+void
+listing_foreach_dir(listing_t listing,
+	void (*func)(const char *name, void *data), void *data)
+{
+	struct dir_data_t dir;
+
+	dir.func = func;
+	dir.data = data;
+	g_hash_table_foreach(listing->entries, foreach_dir, &dir);
+}
@@ -0,0 +1,58 @@
+/*
+ * Galaxy - A filesystem monitoring tool.
+ * Copyright (C) 2005  Gabriel Munoz <gabriel@xusia.net>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ */
+
+#ifndef LISTING_H
+#define LISTING_H
+
+#if HAVE_CONFIG_H
+#  include <config.h>
+#endif
+
+#if HAVE_INTTYPES_H
+#  include <inttypes.h>
+#endif
+
+#if HAVE_SYS_TYPES_H
+#  include <sys/types.h>
+#endif
+
+#if HAVE_SYS_STAT_H
+#  include <sys/stat.h>
+#endif
+
+/*
+ * A snapshot of a directory's entries, used to find out what changed in
+ * a directory that has no inotify watch, or while events were lost.
+ */
+struct listing_struct;
+typedef struct listing_struct *listing_t;
+
+listing_t listing_create(void);
+listing_t listing_read(const char *dirname);
+void listing_destroy(listing_t listing);
+unsigned long listing_size(listing_t listing);
+void listing_update(listing_t listing, const char *name,
+	const struct stat *statbuf);
+void listing_diff(listing_t old, listing_t new,
+	void (*func)(const char *name, uint32_t mask, void *data), void *data);
+void listing_foreach_dir(listing_t listing,
+	void (*func)(const char *name, void *data), void *data);
+
+#endif
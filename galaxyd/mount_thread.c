@@ -0,0 +1,279 @@
+/*
+ * Galaxy - A filesystem monitoring tool.
+ * Copyright (C) 2005  Gabriel Munoz <gabriel@xusia.net>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ */
+
+#if HAVE_CONFIG_H
+#  include <config.h>
+#endif
+
+#if HAVE_STDLIB_H
+#  include <stdlib.h>
+#endif
+
+#include <stdio.h>
+#include <poll.h>
+
+#if HAVE_STRING_H
+#  include <string.h>
+#endif
+
+#if HAVE_UNISTD_H
+#  include <unistd.h>
+#endif
+
+#if HAVE_FCNTL_H
+#  include <fcntl.h>
+#endif
+
+#if HAVE_PTHREAD_H
+#  include <pthread.h>
+#endif
+
+#if HAVE_ERRNO_H
+#  include <errno.h>
+#endif
+
+#if HAVE_LIBGLIB_2_0
+#  include <glib.h>
+#endif
+
+#include "mount_thread.h"
+#include "crawler_thread.h"
+#include "list.h"
+#include "thread.h"
+#include "error.h"
+
+#define MOUNTINFO "/proc/self/mountinfo"
+#define MOUNT_POLL_SECS 5   /* Re-read interval if poll(2) isn't usable. */
+
+/*
+ * Decodes the octal escapes (e.g. "\040" for a space) the kernel uses
+ * for mount points in place.
+ */
+static void
+unescape(char *s)
+{
+	char *out = s;
+
+	while (*s != '\0') {
+		if (s[0] == '\\' && s[1] >= '0' && s[1] <= '7' &&
+		    s[2] >= '0' && s[2] <= '7' && s[3] >= '0' && s[3] <= '7') {
+			*out++ = (s[1] - '0') << 6 | (s[2] - '0') << 3 | (s[3] - '0');
+			s += 4;
+		} else {
+			*out++ = *s++;
+		}
+	}
+	*out = '\0';
+}
+
+/*
+ * Reads the mount table into a hash of mount point -> mount ID. When
+ * several mounts are stacked on one mount point the last (visible) one
+ * wins.
+ */
+static GHashTable *
+read_mounts(int fd)
+{
+	GHashTable *mounts;
+	char *buf, *line, *next, mountpoint[4097];
+	size_t size = 16384, len = 0;
+	ssize_t n;
+	int id;
+
+	buf = malloc(size);
+	if (buf == NULL) {
+		err_malloc(errno);
+		return NULL;
+	}
+	if (lseek(fd, 0, SEEK_SET) == -1) {
+		free(buf);
+		return NULL;
+	}
+	while ((n = read(fd, buf + len, size - len - 1)) > 0) {
+		len += n;
+		if (len + 1 == size) {
+			char *bigger = realloc(buf, size * 2);
+			if (bigger == NULL) {
+				err_malloc(errno);
+				free(buf);
+				return NULL;
+			}
+			buf = bigger;
+			size *= 2;
+		}
+	}
+	if (n < 0) {
+		free(buf);
+		return NULL;
+	}
+	buf[len] = '\0';
+
+	mounts = g_hash_table_new_full(g_str_hash, g_str_equal, free, NULL);
+	for (line = buf; line != NULL && *line != '\0'; line = next) {
+		next = strchr(line, '\n');
+		if (next != NULL)
+			*next++ = '\0';
+		/* ID PARENT MAJOR:MINOR ROOT MOUNTPOINT OPTIONS ... */
+		if (sscanf(line, "%d %*d %*s %*s %4096s", &id, mountpoint) != 2)
+			continue;
+		unescape(mountpoint);
+		g_hash_table_replace(mounts, strdup(mountpoint), GINT_TO_POINTER(id));
+	}
+	free(buf);
+
+	return mounts;
+}
+
+static void
+find_mounted(gpointer key, gpointer value, gpointer user_data)
+{
+	gpointer id;
+
+	/* Newly mounted, or something else is on top now. */
+	if (!g_hash_table_lookup_extended(user_data, key, NULL, &id) ||
+	    id != value)
+		crawl_mount_change(key);
+}
+
+static void
+find_unmounted(gpointer key, gpointer value, gpointer user_data)
+{
+	if (!g_hash_table_lookup_extended(user_data, key, NULL, NULL))
+		crawl_mount_change(key);
+}
+
+struct below_data_t {
+	const char *dir;
+	size_t len;
+	list_t *list;
+} below_data_t;
+
+static void
+find_below(gpointer key, gpointer value, gpointer user_data)
+{
+	struct below_data_t *below = user_data;
+	const char *mountpoint = key;
+	char *copy;
+
+	if (strncmp(mountpoint, below->dir, below->len) != 0 ||
+	    (mountpoint[below->len] != '/' &&
+	     (below->len == 0 || below->dir[below->len - 1] != '/')) ||
+	    mountpoint[below->len] == '\0')
+		return;
+	copy = strdup(mountpoint);
+	if (copy == NULL || list_push(below->list, copy) < 0) {
+		err_malloc(errno);
+		free(copy);
+	}
+}
+
+/*
+ * Lists the mount points below the directory `dir' (not `dir' itself).
+ *
+ * Return Value:
+ *   Returns a list of paths to be released with list_destroy(), or NULL
+ *   on error.
+ */
+list_t *
+mounts_below(const char *dir)
+{
+	struct below_data_t below;
+	GHashTable *mounts;
+	int fd;
+
+	fd = open(MOUNTINFO, O_RDONLY);
+	if (fd < 0) {
+		err_open(errno);
+		return NULL;
+	}
+	mounts = read_mounts(fd);
+	close(fd);
+	if (mounts == NULL)
+		return NULL;
+
+	below.dir = dir;
+	below.len = strlen(dir);
+	below.list = list_create(free);
+	if (below.list != NULL)
+		g_hash_table_foreach(mounts, find_below, &below);
+	g_hash_table_destroy(mounts);
+
+	return below.list;
+}
+
+static void *
+mount_watch(void *arg)
+{
+	GHashTable *mounts, *current;
+	struct pollfd pfd;
+	int fd, ret;
+
+	fd = open(MOUNTINFO, O_RDONLY);
+	if (fd < 0) {
+		err_open(errno);
+		err_msg("error[mount_watch]: Unable to open %s; mounts won't be tracked.\n",
+			MOUNTINFO);
+		return NULL;
+	}
+	mounts = read_mounts(fd);
+
+	while (1) {
+		/* The kernel flags the file with POLLPRI whenever the mount
+		 * table changes. */
+		pfd.fd = fd;
+		pfd.events = POLLPRI;
+		pfd.revents = 0;
+		ret = poll(&pfd, 1, -1);
+		if (ret < 0 && errno != EINTR) {
+			err_msg("warning[mount_watch]: poll(2) failed; re-reading the mount table every %d seconds.\n",
+				MOUNT_POLL_SECS);
+			sleep(MOUNT_POLL_SECS);
+		}
+
+		current = read_mounts(fd);
+		if (current == NULL)
+			continue;
+		if (mounts != NULL) {
+			g_hash_table_foreach(current, find_mounted, mounts);
+			g_hash_table_foreach(mounts, find_unmounted, current);
+			g_hash_table_destroy(mounts);
+		}
+		mounts = current;
+	}
+
+	return NULL;
+}
+
+/*
+ * Creates the thread that follows the mount table. New mounts under a
+ * root are crawled, and unmounted subtrees are dropped as a whole (see
+ * crawl_mount_change()).
+ */
+int
+create_mount_thread(pthread_t *id)
+{
+	int err;
+
+	err = create_joinable_thread(id, mount_watch, NULL);
+	if (err < 0)
+		err_create_joinable_thread(errno);
+
+	return err;
+}
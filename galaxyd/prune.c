@@ -0,0 +1,388 @@
+/*
+ * Galaxy - A filesystem monitoring tool.
+ * Copyright (C) 2005  Gabriel Munoz <gabriel@xusia.net>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ */
+
+#if HAVE_CONFIG_H
+#  include <config.h>
+#endif
+
+#if HAVE_STDLIB_H
+#  include <stdlib.h>
+#endif
+
+#include <stdio.h>
+#include <fnmatch.h>
+
+#if HAVE_STRING_H
+#  include <string.h>
+#endif
+
+#if HAVE_PTHREAD_H
+#  include <pthread.h>
+#endif
+
+#if HAVE_ERRNO_H
+#  include <errno.h>
+#endif
+
+#if HAVE_PCRE_H
+#  include <pcre.h>
+#endif
+
+#if HAVE_LIBGLIB_2_0
+#  include <glib.h>
+#endif
+
+#include "prune.h"
+#include "list.h"
+#include "self_events.h"
+#include "error.h"
+
+#define OVECCOUNT 30    /* Needs to be a multiple of 3 */
+
+/*
+ * A compiled set of prune rules. Plain rules are hash lookups; only
+ * globs and regular expressions are tried one by one.
+ *
+ * Rules are matched against a path (absolute for the global rules,
+ * relative to the directory of the ignore file otherwise) and against
+ * the path's last component.
+ */
+struct prune_rules_t {
+	GHashTable *paths;    /* Exact paths. */
+	GHashTable *names;    /* Exact names, anywhere in the tree. */
+	list_t *path_globs;   /* fnmatch(3) patterns on the path. */
+	list_t *name_globs;   /* fnmatch(3) patterns on the name. */
+	list_t *regexes;      /* "re:" rules, on the path. */
+} prune_rules_t;
+
+struct prune_regex_t {
+	pcre *re;
+	pcre_extra *extra;
+} prune_regex_t;
+
+static struct prune_rules_t *global_rules = NULL;
+
+/* Rules read from ignore files, keyed on the directory holding them. */
+static GHashTable *ignore_files = NULL;
+static pthread_mutex_t ignore_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static void
+destroy_regex(void *ptr)
+{
+	struct prune_regex_t *regex = ptr;
+
+	free(regex->re);
+	free(regex->extra);
+	free(regex);
+}
+
+static void
+destroy_rules(void *ptr)
+{
+	struct prune_rules_t *rules = ptr;
+
+	if (rules == NULL)
+		return;
+	g_hash_table_destroy(rules->paths);
+	g_hash_table_destroy(rules->names);
+	list_destroy(rules->path_globs);
+	list_destroy(rules->name_globs);
+	list_destroy(rules->regexes);
+	free(rules);
+}
+
+static struct prune_rules_t *
+create_rules(void)
+{
+	struct prune_rules_t *rules;
+
+	rules = malloc(sizeof(struct prune_rules_t));
+	if (rules == NULL) {
+		err_malloc(errno);
+		err_msg("error[create_rules]: Unable to malloc prune rules.\n");
+		return NULL;
+	}
+	rules->paths = g_hash_table_new_full(g_str_hash, g_str_equal, free, NULL);
+	rules->names = g_hash_table_new_full(g_str_hash, g_str_equal, free, NULL);
+	rules->path_globs = list_create(free);
+	rules->name_globs = list_create(free);
+	rules->regexes = list_create(destroy_regex);
+	if (rules->path_globs == NULL || rules->name_globs == NULL ||
+	    rules->regexes == NULL) {
+		err_msg("error[create_rules]: Unable to create prune rule lists.\n");
+		list_destroy(rules->path_globs);
+		list_destroy(rules->name_globs);
+		list_destroy(rules->regexes);
+		g_hash_table_destroy(rules->paths);
+		g_hash_table_destroy(rules->names);
+		free(rules);
+		return NULL;
+	}
+
+	return rules;
+}
+
+/*
+ * Compiles one rule into `rules'. A rule is one of:
+ *   re:REGEX    A PCRE matched against the path.
+ *   a/b, /a/b   A path. Global rules are absolute; ignore file rules are
+ *               relative to the ignore file's directory.
+ *   name        A directory name pruned wherever it shows up.
+ * Paths and names may use fnmatch(3) wildcards.
+ *
+ * Return Value:
+ *   Returns -1 if the rule is invalid, otherwise zero.
+ */
+static int
+add_rule(struct prune_rules_t *rules, const char *rule, int relative)
+{
+	struct prune_regex_t *regex;
+	const char *error;
+	char *copy;
+	size_t len;
+	int erroffset, is_path, is_glob;
+
+	if (strncmp(rule, "re:", 3) == 0) {
+		regex = malloc(sizeof(struct prune_regex_t));
+		if (regex == NULL) {
+			err_malloc(errno);
+			return -1;
+		}
+		regex->re = pcre_compile(rule + 3, 0, &error, &erroffset, NULL);
+		if (regex->re == NULL) {
+			err_msg("error[add_rule]: %s\n", error);
+			err_msg("      Unable to make PCRE '%s'.\n", rule + 3);
+			free(regex);
+			return -1;
+		}
+		regex->extra = pcre_study(regex->re, 0, &error);
+		return list_push(rules->regexes, regex);
+	}
+
+	is_path = strchr(rule, '/') != NULL;
+	if (relative)
+		while (*rule == '/')
+			rule++;
+	copy = strdup(rule);
+	if (copy == NULL) {
+		err_malloc(errno);
+		return -1;
+	}
+	/* Every rule names directories; a trailing slash adds nothing. */
+	len = strlen(copy);
+	while (len > 1 && copy[len - 1] == '/')
+		copy[--len] = '\0';
+	if (len == 0) {
+		free(copy);
+		return -1;
+	}
+
+	is_glob = strpbrk(copy, "*?[") != NULL;
+	if (is_path && is_glob)
+		return list_push(rules->path_globs, copy);
+	if (is_glob)
+		return list_push(rules->name_globs, copy);
+	if (is_path)
+		g_hash_table_replace(rules->paths, copy, copy);
+	else
+		g_hash_table_replace(rules->names, copy, copy);
+
+	return 0;
+}
+
+static int
+match_rules(const struct prune_rules_t *rules, const char *path,
+	const char *name)
+{
+	list_node_t *node;
+	int ovector[OVECCOUNT];
+
+	if (g_hash_table_lookup(rules->paths, path) != NULL ||
+	    g_hash_table_lookup(rules->names, name) != NULL)
+		return 1;
+
+	node = NULL;
+	list_foreach(rules->name_globs, node) {
+		if (fnmatch(list_key(node), name, 0) == 0)
+			return 1;
+	}
+	node = NULL;
+	list_foreach(rules->path_globs, node) {
+		if (fnmatch(list_key(node), path, FNM_PATHNAME) == 0)
+			return 1;
+	}
+	node = NULL;
+	list_foreach(rules->regexes, node) {
+		struct prune_regex_t *regex = list_key(node);
+		if (pcre_exec(regex->re, regex->extra, path, strlen(path), 0, 0,
+		              ovector, OVECCOUNT) >= 0)
+			return 1;
+	}
+
+	return 0;
+}
+
+/*
+ * Compiles the prune rules given with -p and GALAXY_PRUNE_PATH (see
+ * add_rule() for the syntax).
+ *
+ * Return Value:
+ *   Returns -1 on error, otherwise zero. Invalid rules are skipped.
+ */
+int
+init_prune_rules(const list_t *rules)
+{
+	list_node_t *node = NULL;
+
+	global_rules = create_rules();
+	ignore_files = g_hash_table_new_full(g_str_hash, g_str_equal, free,
+		destroy_rules);
+	if (global_rules == NULL || ignore_files == NULL) {
+		err_msg("error[init_prune_rules]: Unable to create prune rules.\n");
+		return -1;
+	}
+
+	list_foreach(rules, node) {
+		const char *rule = list_key(node);
+		char resolved[4097];
+
+		/* Absolute paths are compared with resolved directory names. */
+		if (rule[0] == '/' && strpbrk(rule, "*?[") == NULL &&
+		    realpath(rule, resolved) != NULL)
+			rule = resolved;
+		if (add_rule(global_rules, rule, 0) < 0)
+			err_msg("warning[init_prune_rules]: Ignoring prune rule '%s'.\n",
+				(char *)list_key(node));
+	}
+
+	return 0;
+}
+
+void
+destroy_prune_rules(void)
+{
+	destroy_rules(global_rules);
+	g_hash_table_destroy(ignore_files);
+}
+
+/*
+ * Tells whether the directory `path' must never be watched or scanned,
+ * either because of a global prune rule or because of an ignore file in
+ * one of its parents.
+ */
+int
+prune_match(const char *path)
+{
+	struct prune_rules_t *rules;
+	const char *name;
+	char dir[4097], *slash;
+	int pruned = 0;
+
+	name = strrchr(path, '/');
+	name = name != NULL ? name + 1 : path;
+
+	if (match_rules(global_rules, path, name))
+		return 1;
+
+	if (strlen(path) >= sizeof(dir))
+		return 0;
+	strcpy(dir, path);
+
+	pthread_mutex_lock(&ignore_mutex);
+	while (g_hash_table_size(ignore_files) > 0) {
+		slash = strrchr(dir, '/');
+		if (slash == NULL || (slash == dir && dir[1] == '\0'))
+			break;
+		slash[slash == dir ? 1 : 0] = '\0';
+		rules = g_hash_table_lookup(ignore_files, dir);
+		if (rules != NULL &&
+		    match_rules(rules, path + strlen(dir) + (slash != dir), name)) {
+			pruned = 1;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&ignore_mutex);
+
+	return pruned;
+}
+
+/*
+ * Reads the ignore file of `dirname', if it has one, and applies its
+ * rules to everything below the directory from now on. Each line holds
+ * one rule (see add_rule()); blank lines and lines starting with '#'
+ * are skipped. A directory without the file forgets any rules it had.
+ *
+ * The file is only read when the directory is crawled or scanned;
+ * later edits take effect the next time that happens.
+ *
+ * Return Value:
+ *   Returns 1 if rules were loaded, otherwise zero.
+ */
+int
+prune_load_ignore_file(const char *dirname)
+{
+	struct prune_rules_t *rules;
+	char path[4097], line[4097], *key;
+	FILE *fp;
+	size_t len;
+
+	snprintf(path, sizeof(path), "%s%s%s", dirname,
+		strcmp(dirname, "/") == 0 ? "" : "/", PRUNE_IGNORE_FILE);
+	self_scan_begin(path);
+	fp = fopen(path, "r");
+	if (fp == NULL) {
+		self_scan_end(path);
+		pthread_mutex_lock(&ignore_mutex);
+		if (g_hash_table_size(ignore_files) > 0)
+			g_hash_table_remove(ignore_files, dirname);
+		pthread_mutex_unlock(&ignore_mutex);
+		return 0;
+	}
+
+	rules = create_rules();
+	if (rules == NULL) {
+		fclose(fp);
+		self_scan_end(path);
+		return 0;
+	}
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		len = strcspn(line, "\r\n");
+		line[len] = '\0';
+		if (len == 0 || line[0] == '#')
+			continue;
+		if (add_rule(rules, line, 1) < 0)
+			err_msg("warning[prune_load_ignore_file]: Ignoring rule '%s' in %s.\n",
+				line, path);
+	}
+	fclose(fp);
+	self_scan_end(path);
+
+	key = strdup(dirname);
+	if (key == NULL) {
+		err_malloc(errno);
+		destroy_rules(rules);
+		return 0;
+	}
+	pthread_mutex_lock(&ignore_mutex);
+	g_hash_table_replace(ignore_files, key, rules);
+	pthread_mutex_unlock(&ignore_mutex);
+
+	return 1;
+}
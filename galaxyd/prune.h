@@ -0,0 +1,41 @@
+/*
+ * Galaxy - A filesystem monitoring tool.
+ * Copyright (C) 2005  Gabriel Munoz <gabriel@xusia.net>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ */
+
+#ifndef PRUNE_H
+#define PRUNE_H
+
+#if HAVE_CONFIG_H
+#  include <config.h>
+#endif
+
+#include "list.h"
+
+/* Name of the per-directory ignore file honored during crawls. */
+#define PRUNE_IGNORE_FILE ".galaxyignore"
+
+/* Initialization and destruction routines -- called once on
+ * startup/shutdown. */
+int init_prune_rules(const list_t *rules);
+void destroy_prune_rules(void);
+
+int prune_match(const char *path);
+int prune_load_ignore_file(const char *dirname);
+
+#endif
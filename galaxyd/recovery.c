@@ -0,0 +1,445 @@
+/*
+ * Galaxy - A filesystem monitoring tool.
+ * Copyright (C) 2005  Gabriel Munoz <gabriel@xusia.net>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ */
+
+/*
+ * Recovers from inotify queue overflows. When the kernel drops events
+ * (IN_Q_OVERFLOW) nothing tells which directories changed in the gap,
+ * so every watched directory is read again and compared against a
+ * listing kept up to date from the events seen so far. The differences
+ * are sent to clients as synthesized events.
+ *
+ * The rescans raise inotify events of their own, so they are done a
+ * batch at a time on the worker pool, and only while the kernel queue
+ * and the pool are not backed up.
+ *
+ * Keeping the listings costs memory and an lstat(2) per event, so all
+ * of this is only enabled with --overflow-recovery.
+ */
+
+#if HAVE_CONFIG_H
+#  include <config.h>
+#endif
+
+#if HAVE_STDLIB_H
+#  include <stdlib.h>
+#endif
+
+#include <stdio.h>
+
+#if HAVE_STRING_H
+#  include <string.h>
+#endif
+
+#if HAVE_SYS_STAT_H
+#  include <sys/stat.h>
+#endif
+
+#if HAVE_SYS_IOCTL_H
+#  include <sys/ioctl.h>
+#endif
+
+#if HAVE_PTHREAD_H
+#  include <pthread.h>
+#endif
+
+#if HAVE_ERRNO_H
+#  include <errno.h>
+#endif
+
+#include "recovery.h"
+#include "inotify.h"
+#include "inotify_utils.h"
+#include "crawler_thread.h"
+#include "thread_pool.h"
+#include "watch.h"
+#include "list.h"
+#include "error.h"
+
+#define MAX_QUEUED_EVENTS "/proc/sys/fs/inotify/max_queued_events"
+
+#define RECOVERY_BATCH        64    /* Directories rescanned by one job. */
+#define RECOVERY_JOBS          2    /* Rescan jobs running at once. */
+#define RECOVERY_MAX_PENDING 256    /* Pool backlog that holds rescans. */
+
+/* Events that may change a directory entry. */
+#define RECOVERY_EVENTS (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | \
+		IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE)
+
+extern thread_pool_t workers;
+
+static int enabled = 0;
+static unsigned long backlog_limit = 0;  /* In bytes of queued events. */
+
+/* Directories still to rescan, and the progress of the rescan, per
+ * inotify instance; an overflow only costs a rescan of its own
+ * instance's directories. */
+struct rescan_t {
+	list_t *dirty;
+	int inflight;
+	unsigned long rescanned;
+} rescan_t;
+
+struct rescan_batch_t {
+	int shard;
+	list_t *paths;
+} rescan_batch_t;
+
+static pthread_mutex_t recovery_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct rescan_t rescans[GALAXY_MAX_SHARDS];
+static int inflight = 0;
+
+int
+init_recovery(int enable)
+{
+	FILE *fp;
+	long max_events = 16384;
+
+	enabled = enable;
+	if (!enabled)
+		return 0;
+
+	fp = fopen(MAX_QUEUED_EVENTS, "r");
+	if (fp != NULL) {
+		if (fscanf(fp, "%ld", &max_events) != 1 || max_events <= 0)
+			max_events = 16384;
+		fclose(fp);
+	}
+
+	/* Rescans wait while the kernel queue is a quarter full. */
+	backlog_limit = max_events / 4 * (sizeof(struct inotify_event) + 16);
+
+	return 0;
+}
+
+void
+destroy_recovery(void)
+{
+	int i;
+
+	pthread_mutex_lock(&recovery_mutex);
+	for (i = 0; i < GALAXY_MAX_SHARDS; i++) {
+		list_destroy(rescans[i].dirty);
+		rescans[i].dirty = NULL;
+	}
+	pthread_mutex_unlock(&recovery_mutex);
+}
+
+int
+recovery_enabled(void)
+{
+	return enabled;
+}
+
+/*
+ * Keeps `listing' as the known contents of the watched directory
+ * `dirname'. Takes over the listing.
+ */
+void
+recovery_attach(const char *dirname, listing_t listing)
+{
+	struct dir_node_t *node;
+
+	dir_tree_lock();
+	node = dir_tree_lookup(dirname);
+	if (node != NULL && node->wd >= 0) {
+		listing_destroy(node->listing);
+		node->listing = listing;
+		listing = NULL;
+	}
+	dir_tree_unlock();
+
+	listing_destroy(listing);
+}
+
+/*
+ * Tells whether an event with `mask' on an entry of the directory
+ * `node' changes the directory's listing. The caller must hold the tree
+ * lock.
+ */
+int
+recovery_wants_event(const struct dir_node_t *node, uint32_t mask)
+{
+	return node->listing != NULL && (mask & RECOVERY_EVENTS) != 0;
+}
+
+/*
+ * Applies an event on the entry `path' of the directory `node' to the
+ * directory's listing. `statbuf' holds what lstat(2) returned for the
+ * entry, taken before the tree lock, or is NULL if it is gone. The
+ * caller must hold the tree lock.
+ */
+void
+recovery_note_event(struct dir_node_t *node, const char *path,
+	const struct stat *statbuf)
+{
+	const char *name;
+
+	if (node->listing == NULL)
+		return;
+	name = strrchr(path, '/');
+	if (name == NULL || name[1] == '\0')
+		return;
+
+	listing_update(node->listing, name + 1, statbuf);
+}
+
+static void
+collect_watched(struct dir_node_t *node, int shard, list_t *paths)
+{
+	struct dir_node_t *child;
+	char *path;
+
+	if (node->wd >= 0 && galaxy_wd_shard(node->wd) == shard) {
+		path = strdup(dir_node_path(node, NULL));
+		if (path == NULL || list_push(paths, path) < 0) {
+			err_malloc(errno);
+			free(path);
+		}
+	}
+	for (child = node->children; child != NULL; child = child->next)
+		collect_watched(child, shard, paths);
+}
+
+static void
+report_change(const char *name, uint32_t mask, void *data)
+{
+	const char *dirname = (const char *)data;
+	char path[4097];
+
+	snprintf(path, sizeof(path), "%s%s%s", dirname,
+		strcmp(dirname, "/") == 0 ? "" : "/", name);
+	find_matching_events(path, mask);
+
+	/* Directories created in the gap need watches of their own. */
+	if ((mask & (IN_CREATE | IN_ISDIR)) == (IN_CREATE | IN_ISDIR))
+		watch_new_directory(path, NULL);
+}
+
+/*
+ * Reads `dirname' again and reports how it differs from its listing.
+ */
+static void
+rescan_dir(const char *dirname)
+{
+	struct dir_node_t *node;
+	struct stat statbuf;
+	listing_t old, new;
+	int gone;
+
+	new = listing_read(dirname);
+	gone = new == NULL &&
+		(lstat(dirname, &statbuf) == -1 || !S_ISDIR(statbuf.st_mode));
+
+	dir_tree_lock();
+	node = dir_tree_lookup(dirname);
+	if (node == NULL || node->wd < 0 || new == NULL) {
+		/* Its IN_IGNORED may have been lost with the other events. */
+		if (node != NULL && gone)
+			galaxy_remove_subtree(node, 1);
+		dir_tree_unlock();
+		listing_destroy(new);
+		return;
+	}
+	old = node->listing;
+	node->listing = new;
+	dir_tree_unlock();
+
+	/* Without an earlier listing there is nothing to compare with. */
+	if (old != NULL) {
+		listing_diff(old, new, report_change, (void *)dirname);
+		listing_destroy(old);
+	}
+}
+
+static void schedule_rescans(void);
+
+static void
+rescan_job(void *arg)
+{
+	struct rescan_batch_t *batch = (struct rescan_batch_t *)arg;
+	struct rescan_t *rescan;
+	list_node_t *node = NULL;
+	unsigned long count;
+	int done;
+
+	list_foreach(batch->paths, node)
+		rescan_dir(list_key(node));
+
+	pthread_mutex_lock(&recovery_mutex);
+	rescan = &rescans[batch->shard];
+	inflight--;
+	rescan->inflight--;
+	rescan->rescanned += list_size(batch->paths);
+	count = rescan->rescanned;
+	done = rescan->inflight == 0 && rescan->dirty != NULL &&
+		list_size(rescan->dirty) == 0;
+	pthread_mutex_unlock(&recovery_mutex);
+	list_destroy(batch->paths);
+	free(batch);
+
+	if (done)
+		err_msg("warning[recovery]: Rescanned %lu directories after the queue overflow.\n",
+			count);
+	schedule_rescans();
+}
+
+/*
+ * Tells whether rescanning the directories of the inotify instance
+ * `shard' now would risk another overflow, or starve the handling of
+ * live events. Must hold the recovery mutex.
+ */
+static int
+backlogged(int shard)
+{
+	int queued;
+
+	if (ioctl(galaxy_shard_fd(shard), FIONREAD, &queued) == 0 &&
+	    (unsigned long)queued > backlog_limit)
+		return 1;
+
+	return thread_pool_pending(workers) > RECOVERY_MAX_PENDING;
+}
+
+/*
+ * Takes the next batch of dirty directories of `shard'. Must hold the
+ * recovery mutex.
+ *
+ * Return Value:
+ *   Returns NULL if there is nothing to rescan or on error.
+ */
+static struct rescan_batch_t *
+next_batch(int shard)
+{
+	struct rescan_batch_t *batch;
+	list_t *dirty = rescans[shard].dirty;
+	char *path;
+
+	if (dirty == NULL || list_size(dirty) == 0 || backlogged(shard))
+		return NULL;
+
+	batch = malloc(sizeof(struct rescan_batch_t));
+	if (batch == NULL) {
+		err_malloc(errno);
+		return NULL;
+	}
+	batch->shard = shard;
+	batch->paths = list_create(free);
+	if (batch->paths == NULL) {
+		free(batch);
+		return NULL;
+	}
+	while (list_size(batch->paths) < RECOVERY_BATCH &&
+	       (path = list_shift(dirty)) != NULL) {
+		if (list_push(batch->paths, path) < 0) {
+			free(path);
+			break;
+		}
+	}
+
+	return batch;
+}
+
+/*
+ * Hands the next batches of dirty directories to the worker pool, as
+ * far as the limits allow. Instances take turns.
+ */
+static void
+schedule_rescans(void)
+{
+	static int next = 0;
+	struct rescan_batch_t *batch;
+	int shard, idle;
+
+	pthread_mutex_lock(&recovery_mutex);
+	for (idle = 0; inflight < RECOVERY_JOBS && idle < galaxy_shards(); ) {
+		shard = next;
+		next = (next + 1) % galaxy_shards();
+		batch = next_batch(shard);
+		if (batch == NULL) {
+			idle++;
+			continue;
+		}
+		idle = 0;
+		inflight++;
+		rescans[shard].inflight++;
+		if (thread_pool_submit(workers, rescan_job, batch) < 0) {
+			inflight--;
+			rescans[shard].inflight--;
+			list_destroy(batch->paths);
+			free(batch);
+			break;
+		}
+	}
+	pthread_mutex_unlock(&recovery_mutex);
+}
+
+/*
+ * Called when the kernel reported IN_Q_OVERFLOW on the inotify instance
+ * `shard'. Marks every directory it watches as dirty; a rescan of those
+ * already under way starts over, since directories it already did may
+ * have lost events again.
+ */
+void
+recovery_start(int shard)
+{
+	struct dir_node_t *root;
+	list_t *paths;
+
+	if (!enabled) {
+		err_msg("warning[recovery]: Kernel inotify queue #%d overflowed; events were lost.\n",
+			shard);
+		return;
+	}
+
+	paths = list_create(free);
+	if (paths == NULL) {
+		err_msg("error[recovery_start]: Unable to create the rescan list.\n");
+		return;
+	}
+	dir_tree_lock();
+	root = dir_tree_lookup("/");
+	if (root != NULL)
+		collect_watched(root, shard, paths);
+	dir_tree_unlock();
+
+	err_msg("warning[recovery]: Kernel inotify queue #%d overflowed; rescanning %lu directories.\n",
+		shard, list_size(paths));
+
+	pthread_mutex_lock(&recovery_mutex);
+	list_destroy(rescans[shard].dirty);
+	rescans[shard].dirty = paths;
+	rescans[shard].rescanned = 0;
+	pthread_mutex_unlock(&recovery_mutex);
+
+	schedule_rescans();
+}
+
+/*
+ * Called by the inotify watcher threads every time they wake up.
+ * Resumes rescans that were held back.
+ */
+void
+recovery_tick(void)
+{
+	if (!enabled)
+		return;
+
+	schedule_rescans();
+}
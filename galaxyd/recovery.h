@@ -0,0 +1,50 @@
+/*
+ * Galaxy - A filesystem monitoring tool.
+ * Copyright (C) 2005  Gabriel Munoz <gabriel@xusia.net>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ */
+
+#ifndef RECOVERY_H
+#define RECOVERY_H
+
+#if HAVE_CONFIG_H
+#  include <config.h>
+#endif
+
+#if HAVE_INTTYPES_H
+#  include <inttypes.h>
+#endif
+
+#include "dir_tree.h"
+#include "listing.h"
+
+/* Initialization and destruction routines -- called once on
+ * startup/shutdown. */
+int init_recovery(int enabled);
+void destroy_recovery(void);
+
+int recovery_enabled(void);
+void recovery_attach(const char *dirname, listing_t listing);
+int recovery_wants_event(const struct dir_node_t *node, uint32_t mask);
+void recovery_note_event(struct dir_node_t *node, const char *path,
+	const struct stat *statbuf);
+
+/* Called by the inotify watcher threads. */
+void recovery_start(int shard);
+void recovery_tick(void);
+
+#endif
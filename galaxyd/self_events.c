@@ -0,0 +1,240 @@
+/*
+ * Galaxy - A filesystem monitoring tool.
+ * Copyright (C) 2005  Gabriel Munoz <gabriel@xusia.net>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ */
+
+/*
+ * Recognizes the inotify events the daemon raises itself. Crawling,
+ * scanning, and polling a watched directory open and read it, and the
+ * kernel reports that as IN_OPEN, IN_ACCESS, and IN_CLOSE_NOWRITE like
+ * any other reader's. Each of those reads is bracketed with
+ * self_scan_begin() and self_scan_end(). The events are read from the
+ * inotify device some time after the scan ends, so a path stays marked
+ * for SELF_EVENT_GRACE seconds afterwards.
+ *
+ * A client reading the same directory inside that window loses its
+ * read events as well; modifications are never dropped.
+ */
+
+#if HAVE_CONFIG_H
+#  include <config.h>
+#endif
+
+#if HAVE_STDLIB_H
+#  include <stdlib.h>
+#endif
+
+#include <time.h>
+
+#if HAVE_STRING_H
+#  include <string.h>
+#endif
+
+#if HAVE_PTHREAD_H
+#  include <pthread.h>
+#endif
+
+#if HAVE_ERRNO_H
+#  include <errno.h>
+#endif
+
+#if HAVE_LIBGLIB_2_0
+#  include <glib.h>
+#endif
+
+#include "self_events.h"
+#include "inotify.h"
+#include "error.h"
+
+#define SELF_EVENT_GRACE  2   /* Seconds a finished scan stays marked. */
+
+/* The only events a read-only scan can raise. */
+#define SELF_EVENTS (IN_OPEN | IN_ACCESS | IN_CLOSE_NOWRITE)
+
+struct self_scan_t {
+	int inflight;   /* Scans of this path still running. */
+	time_t until;   /* When the last finished scan stops counting. */
+} self_scan_t;
+
+static pthread_mutex_t self_mutex = PTHREAD_MUTEX_INITIALIZER;
+static GHashTable *scans = NULL;
+static time_t last_expire = 0;
+
+/*
+ * Paths are compared without a trailing slash, the way dir_node_path()
+ * builds them.
+ */
+static size_t
+path_length(const char *path)
+{
+	size_t len;
+
+	len = strlen(path);
+	while (len > 1 && path[len - 1] == '/')
+		--len;
+
+	return len;
+}
+
+int
+init_self_events(void)
+{
+	scans = g_hash_table_new_full(g_str_hash, g_str_equal, free, free);
+	if (scans == NULL) {
+		err_msg("error[init_self_events]: Unable to create the scan table.\n");
+		return -1;
+	}
+
+	return 0;
+}
+
+void
+destroy_self_events(void)
+{
+	pthread_mutex_lock(&self_mutex);
+	if (scans != NULL)
+		g_hash_table_destroy(scans);
+	scans = NULL;
+	pthread_mutex_unlock(&self_mutex);
+}
+
+/*
+ * Marks `path' as being read by the daemon. Scans of the same path may
+ * nest or overlap.
+ */
+void
+self_scan_begin(const char *path)
+{
+	struct self_scan_t *scan;
+	char *key;
+
+	key = strndup(path, path_length(path));
+	if (key == NULL) {
+		err_malloc(errno);
+		return;
+	}
+
+	pthread_mutex_lock(&self_mutex);
+	if (scans == NULL) {
+		pthread_mutex_unlock(&self_mutex);
+		free(key);
+		return;
+	}
+	scan = g_hash_table_lookup(scans, key);
+	if (scan != NULL) {
+		free(key);
+	} else {
+		scan = malloc(sizeof(struct self_scan_t));
+		if (scan == NULL) {
+			pthread_mutex_unlock(&self_mutex);
+			err_malloc(errno);
+			free(key);
+			return;
+		}
+		scan->inflight = 0;
+		scan->until = 0;
+		g_hash_table_insert(scans, key, scan);
+	}
+	scan->inflight++;
+	pthread_mutex_unlock(&self_mutex);
+}
+
+/*
+ * Ends a scan started with self_scan_begin(). Events for `path' are
+ * still recognized for the next SELF_EVENT_GRACE seconds.
+ */
+void
+self_scan_end(const char *path)
+{
+	struct self_scan_t *scan;
+	char key[4097];
+	size_t len;
+
+	len = path_length(path);
+	if (len >= sizeof(key))
+		return;
+	memcpy(key, path, len);
+	key[len] = '\0';
+
+	pthread_mutex_lock(&self_mutex);
+	if (scans != NULL) {
+		scan = g_hash_table_lookup(scans, key);
+		if (scan != NULL && scan->inflight > 0) {
+			scan->inflight--;
+			scan->until = time(NULL) + SELF_EVENT_GRACE;
+		}
+	}
+	pthread_mutex_unlock(&self_mutex);
+}
+
+/*
+ * Tells whether an event on `path' was raised by one of the daemon's
+ * own scans. Only events a reader can cause are considered; anything
+ * carrying another event bit is real.
+ *
+ * Return Value:
+ *   Returns 1 if the event should be dropped, otherwise zero.
+ */
+int
+self_event_match(const char *path, uint32_t mask)
+{
+	struct self_scan_t *scan;
+	int match = 0;
+
+	mask &= ~IN_ISDIR;
+	if (mask == 0 || (mask & ~SELF_EVENTS) != 0)
+		return 0;
+
+	pthread_mutex_lock(&self_mutex);
+	if (scans != NULL && g_hash_table_size(scans) > 0) {
+		scan = g_hash_table_lookup(scans, path);
+		if (scan != NULL &&
+		    (scan->inflight > 0 || time(NULL) <= scan->until))
+			match = 1;
+	}
+	pthread_mutex_unlock(&self_mutex);
+
+	return match;
+}
+
+static gboolean
+scan_expired(gpointer key, gpointer value, gpointer now)
+{
+	struct self_scan_t *scan = (struct self_scan_t *)value;
+
+	return scan->inflight == 0 && scan->until < *(time_t *)now;
+}
+
+/*
+ * Forgets scans whose grace period is over. Called by the inotify
+ * watcher thread every time it wakes up; does the work at most once a
+ * second.
+ */
+void
+self_events_expire(void)
+{
+	time_t now;
+
+	now = time(NULL);
+	pthread_mutex_lock(&self_mutex);
+	if (scans != NULL && now != last_expire) {
+		last_expire = now;
+		g_hash_table_foreach_remove(scans, scan_expired, &now);
+	}
+	pthread_mutex_unlock(&self_mutex);
+}
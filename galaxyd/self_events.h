@@ -0,0 +1,44 @@
+/*
+ * Galaxy - A filesystem monitoring tool.
+ * Copyright (C) 2005  Gabriel Munoz <gabriel@xusia.net>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ */
+
+#ifndef SELF_EVENTS_H
+#define SELF_EVENTS_H
+
+#if HAVE_CONFIG_H
+#  include <config.h>
+#endif
+
+#if HAVE_INTTYPES_H
+#  include <inttypes.h>
+#endif
+
+/* Initialization and destruction routines -- called once on
+ * startup/shutdown. */
+int init_self_events(void);
+void destroy_self_events(void);
+
+/* Brackets for the daemon's own reads of a directory or file. */
+void self_scan_begin(const char *path);
+void self_scan_end(const char *path);
+
+int self_event_match(const char *path, uint32_t mask);
+void self_events_expire(void);
+
+#endif
@@ -61,6 +61,7 @@
 #include "galnet.h"
 #include "thread.h"
 #include "watch.h"
+#include "crawler_thread.h"
 #include "error.h"
 
 struct client_data_t {
@@ -68,6 +69,61 @@ struct client_data_t {
 	char *cliservname;
 } client_data_t;
 
+/*
+ * Replies ACK_SUCCESS once every directory under `prefix' was crawled,
+ * or ACK_FAIL when `timeout' seconds ran out first or `prefix' is not
+ * under any root.
+ */
+static void
+send_wait_ready(int connfd, const char *prefix, uint32_t timeout)
+{
+	char path[4097];
+	int ready;
+
+	/* The roots are kept resolved. */
+	if (realpath(prefix, path) == NULL)
+		snprintf(path, sizeof(path), "%s", prefix);
+	ready = crawl_wait_ready(path, timeout);
+	net_send_uint32(connfd, ready > 0 ? ACK_SUCCESS : ACK_FAIL);
+}
+
+/*
+ * Replies with the number of roots, followed by the name, counters,
+ * ETA, and GALAXY_CRAWL_* flags of each one.
+ */
+static void
+send_crawl_status(int connfd)
+{
+	struct crawl_progress_t *progress, *p;
+	int i, n;
+
+	n = crawl_progress(&progress);
+	if (n < 0) {
+		net_send_uint32(connfd, 0);
+		return;
+	}
+
+	if (net_send_uint32(connfd, n) < 0)
+		goto end;
+	for (i = 0; i < n; i++) {
+		p = &progress[i];
+		if (net_send_string(connfd, p->root) < 0 ||
+		    net_send_uint32(connfd, p->queued) < 0 ||
+		    net_send_uint32(connfd, p->pending) < 0 ||
+		    net_send_uint32(connfd, p->scanned) < 0 ||
+		    net_send_uint32(connfd, p->watched) < 0 ||
+		    net_send_uint32(connfd, p->failed) < 0 ||
+		    net_send_uint32(connfd, (uint32_t)p->eta) < 0 ||
+		    net_send_uint32(connfd,
+			(p->running ? GALAXY_CRAWL_RUNNING : 0) |
+			(p->covered ? GALAXY_CRAWL_COVERED : 0)) < 0)
+			break;
+	}
+
+end:
+	free(progress);
+}
+
 static void *
 client_request(void *arg)
 {
@@ -122,6 +178,18 @@ client_request(void *arg)
 			case GALAXY_IGNORE_WATCH:
 				err_msg("     + command type = GALAXY_IGNORE_WATCH\n");
 				break;
+			case GALAXY_WAIT_READY:
+				err_msg("     + command type = GALAXY_WAIT_READY\n");
+				break;
+			case GALAXY_CRAWL_STATUS:
+				err_msg("     + command type = GALAXY_CRAWL_STATUS\n");
+				break;
+			case GALAXY_SETTLE_PERIOD:
+				err_msg("     + command type = GALAXY_SETTLE_PERIOD\n");
+				break;
+			case GALAXY_STAT_FIELDS:
+				err_msg("     + command type = GALAXY_STAT_FIELDS\n");
+				break;
 			default:
 				err_msg("     + unrecognized command = %d (see galaxy.h)\n", cmd);
 				break;
@@ -131,6 +199,7 @@ client_request(void *arg)
 		/* Check for an exit command before waiting for data payload. */
 		if (cmd == GALAXY_EXIT) {
 			remove_galaxy_watches(cdata->cliservname);
+			update_watch_set(0);
 #ifdef DEBUG_CLIENT_REQUEST
 			err_msg("  => DEBUG[client_request]: Exiting client server.\n");
 #endif
@@ -163,7 +232,8 @@ client_request(void *arg)
 #ifdef DEBUG_CLIENT_REQUEST
 				err_msg("     + Received payload data: '%s'\n", regexp);
 #endif
-				add_galaxy_watch(cdata->cliservname, mask, regexp);
+				if (add_galaxy_watch(cdata->cliservname, mask, regexp) == 0)
+					update_watch_set(1);
 				break;
 			case GALAXY_IGNORE_WATCH:
 #ifdef DEBUG_CLIENT_REQUEST
@@ -173,10 +243,33 @@ client_request(void *arg)
 #ifdef DEBUG_CLIENT_REQUEST
 				err_msg("     + Received payload data: '%s'\n", regexp);
 #endif
-				add_galaxy_ignore_watch(cdata->cliservname, mask, regexp);
+				if (add_galaxy_ignore_watch(cdata->cliservname, mask, regexp) == 0)
+					update_watch_set(0);
 				break;
 			case GALAXY_IGNORE_MASK:
-				set_galaxy_ignore_mask(cdata->cliservname, mask);
+				/* The new mask may ignore less than the old one. */
+				if (set_galaxy_ignore_mask(cdata->cliservname, mask) == 0)
+					update_watch_set(1);
+				break;
+			case GALAXY_WAIT_READY:
+				/* The mask carries the timeout. This client's other
+				 * commands wait until the reply is sent. */
+				regexp = net_recv_string(connfd);
+				if (regexp == NULL)
+					break;
+				send_wait_ready(connfd, regexp, mask);
+				free(regexp);
+				break;
+			case GALAXY_CRAWL_STATUS:
+				send_crawl_status(connfd);
+				break;
+			case GALAXY_SETTLE_PERIOD:
+				/* The mask carries the period. */
+				set_galaxy_settle_period(cdata->cliservname, mask);
+				break;
+			case GALAXY_STAT_FIELDS:
+				/* The mask carries the fields. */
+				set_galaxy_stat_fields(cdata->cliservname, mask);
 				break;
 			default:
 				err_msg("warning[client_request]: Unrecognized galaxy command. Ignoring this command.\n");
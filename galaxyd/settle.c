@@ -0,0 +1,419 @@
+/*
+ * Galaxy - A filesystem monitoring tool.
+ * Copyright (C) 2005  Gabriel Munoz <gabriel@xusia.net>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ */
+
+/*
+ * Settle subscriptions (GAL_SETTLE): instead of every event, the client
+ * gets one event per path once the path has been quiet for its settle
+ * period. Each event pushes the path's deadline back, so a file written
+ * for a minute is reported once, a period after the last write.
+ *
+ * Deadlines differ per client and move all the time, so they are kept in
+ * a hierarchical timer wheel: level 0 has one slot per tick for the next
+ * WHEEL_SIZE ticks, and each level above covers WHEEL_SIZE times the span
+ * of the one below with the same number of slots. Adding, moving and
+ * removing a deadline is O(1); every WHEEL_SIZE ticks one slot of the
+ * level above is spread over the level below.
+ */
+
+#if HAVE_CONFIG_H
+#  include <config.h>
+#endif
+
+#if HAVE_STDLIB_H
+#  include <stdlib.h>
+#endif
+
+#include <time.h>
+
+#if HAVE_STRING_H
+#  include <string.h>
+#endif
+
+#if HAVE_PTHREAD_H
+#  include <pthread.h>
+#endif
+
+#if HAVE_ERRNO_H
+#  include <errno.h>
+#endif
+
+#if HAVE_LIBGLIB_2_0
+#  include <glib.h>
+#endif
+
+#include "settle.h"
+#include "thread.h"
+#include "watch.h"
+#include "galaxy.h"
+#include "list.h"
+#include "error.h"
+
+#define WHEEL_BITS    6
+#define WHEEL_SIZE    (1 << WHEEL_BITS)
+#define WHEEL_MASK    (WHEEL_SIZE - 1)
+#define WHEEL_LEVELS  4
+
+/* Longest delay the wheel can hold, in ticks (about 46 hours). */
+#define WHEEL_SPAN    ((1UL << (WHEEL_BITS * WHEEL_LEVELS)) - 1)
+
+/* Past this many settling paths new events are sent right away. */
+#define SETTLE_MAX_PENDING 65536
+
+/* A path settling for one client. */
+struct pending_t {
+	struct pending_t *next;    /* In the same slot. */
+	struct pending_t *prev;
+	struct pending_t **slot;   /* Head of the slot it is in. */
+	unsigned long expires;     /* Tick it settles on. */
+	struct galaxy_event_t event;  /* Merged; its name is `path'. */
+	char *path;                /* Points into `client'. */
+	char client[1];
+} pending_t;
+
+static pthread_mutex_t settle_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t settle_cond;
+static GHashTable *pending = NULL;  /* Of struct pending_t, by itself. */
+
+static struct pending_t *wheel[WHEEL_LEVELS][WHEEL_SIZE];
+static unsigned long next_tick;     /* Next tick to run. */
+static struct timespec epoch;       /* CLOCK_MONOTONIC time of tick 0. */
+
+static guint
+pending_hash(gconstpointer key)
+{
+	const struct pending_t *p = key;
+
+	return g_str_hash(p->client) * 31 + g_str_hash(p->path);
+}
+
+static gboolean
+pending_equal(gconstpointer a, gconstpointer b)
+{
+	const struct pending_t *p = a, *q = b;
+
+	return strcmp(p->path, q->path) == 0 && strcmp(p->client, q->client) == 0;
+}
+
+static struct pending_t *
+create_pending(const char *client_name, const struct galaxy_event_t *gevent)
+{
+	struct pending_t *p;
+	size_t len;
+
+	len = strlen(client_name);
+	p = malloc(sizeof(struct pending_t) + len + 1 + strlen(gevent->name));
+	if (p == NULL) {
+		err_malloc(errno);
+		return NULL;
+	}
+	memcpy(p->client, client_name, len + 1);
+	p->path = p->client + len + 1;
+	strcpy(p->path, gevent->name);
+	p->slot = NULL;
+	/* Keeps the stamp of the first event, so that the time it was held
+	 * shows, and the stat of the latest. */
+	p->event = *gevent;
+	p->event.name = p->path;
+	p->event.old_name = NULL;
+
+	return p;
+}
+
+/*
+ * Puts `p' in the slot its deadline falls in, as seen from next_tick.
+ */
+static void
+wheel_insert(struct pending_t *p)
+{
+	unsigned long delta;
+	int level;
+
+	if ((long)(p->expires - next_tick) < 0)
+		p->expires = next_tick;  /* Already due. */
+	delta = p->expires - next_tick;
+	if (delta > WHEEL_SPAN) {
+		delta = WHEEL_SPAN;
+		p->expires = next_tick + delta;
+	}
+	for (level = 0; level < WHEEL_LEVELS - 1; level++)
+		if (delta < 1UL << (WHEEL_BITS * (level + 1)))
+			break;
+
+	p->slot = &wheel[level][(p->expires >> (WHEEL_BITS * level)) & WHEEL_MASK];
+	p->prev = NULL;
+	p->next = *p->slot;
+	if (p->next != NULL)
+		p->next->prev = p;
+	*p->slot = p;
+}
+
+static void
+wheel_remove(struct pending_t *p)
+{
+	if (p->prev != NULL)
+		p->prev->next = p->next;
+	else
+		*p->slot = p->next;
+	if (p->next != NULL)
+		p->next->prev = p->prev;
+	p->slot = NULL;
+}
+
+/*
+ * Spreads the slot of `level' that next_tick has just reached over the
+ * levels below.
+ *
+ * Return Value:
+ *   Returns the index of that slot; zero means the level above is due
+ *   too.
+ */
+static int
+cascade(int level)
+{
+	struct pending_t *p, *next;
+	int index;
+
+	index = (next_tick >> (WHEEL_BITS * level)) & WHEEL_MASK;
+	p = wheel[level][index];
+	wheel[level][index] = NULL;
+	for (; p != NULL; p = next) {
+		next = p->next;
+		wheel_insert(p);
+	}
+
+	return index;
+}
+
+/*
+ * Runs next_tick: the paths that settle on it are taken out of the wheel
+ * and moved to `due'.
+ */
+static void
+run_tick(list_t *due)
+{
+	struct pending_t *p, *next;
+	int index, level;
+
+	index = next_tick & WHEEL_MASK;
+	for (level = 1; index == 0 && level < WHEEL_LEVELS; level++)
+		index = cascade(level);
+	index = next_tick & WHEEL_MASK;
+
+	p = wheel[0][index];
+	wheel[0][index] = NULL;
+	next_tick++;
+	for (; p != NULL; p = next) {
+		next = p->next;
+		p->slot = NULL;
+		g_hash_table_remove(pending, p);
+		if (list_push(due, p) < 0)
+			free(p);
+	}
+}
+
+/*
+ * Return Value:
+ *   Returns the tick the clock is in now.
+ */
+static unsigned long
+current_tick(void)
+{
+	struct timespec now;
+	long long ns;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	ns = (long long)(now.tv_sec - epoch.tv_sec) * 1000000000LL +
+		now.tv_nsec - epoch.tv_nsec;
+
+	return ns / (SETTLE_TICK * 1000000LL);
+}
+
+/*
+ * Return Value:
+ *   Returns the CLOCK_MONOTONIC time at which `tick' starts.
+ */
+static struct timespec
+tick_time(unsigned long tick)
+{
+	struct timespec ts;
+	unsigned long long ns;
+
+	ns = (unsigned long long)tick * SETTLE_TICK * 1000000ULL + epoch.tv_nsec;
+	ts.tv_sec = epoch.tv_sec + ns / 1000000000ULL;
+	ts.tv_nsec = ns % 1000000000ULL;
+
+	return ts;
+}
+
+int
+init_settle(void)
+{
+	pthread_condattr_t attr;
+
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&settle_cond, &attr);
+	pthread_condattr_destroy(&attr);
+
+	pending = g_hash_table_new(pending_hash, pending_equal);
+	memset(wheel, 0, sizeof(wheel));
+	clock_gettime(CLOCK_MONOTONIC, &epoch);
+	next_tick = 0;
+
+	return 0;
+}
+
+static void
+free_pending(gpointer key, gpointer value, gpointer user_data)
+{
+	free(value);
+}
+
+void
+destroy_settle(void)
+{
+	pthread_mutex_lock(&settle_mutex);
+	g_hash_table_foreach(pending, free_pending, NULL);
+	g_hash_table_destroy(pending);
+	pending = NULL;
+	memset(wheel, 0, sizeof(wheel));
+	pthread_mutex_unlock(&settle_mutex);
+	pthread_cond_destroy(&settle_cond);
+}
+
+/*
+ * Holds an event for the client `client_name' until its path has seen
+ * no events for `period' milliseconds. Events on a path that is already
+ * settling are or-ed into it and restart the period.
+ *
+ * Return Value:
+ *   Returns zero if the event was taken, or -1 if the caller has to send
+ *   it right away (too many paths are settling).
+ */
+int
+settle_event(const char *client_name, const struct galaxy_event_t *gevent,
+	unsigned int period)
+{
+	struct pending_t *p, *found;
+	unsigned long ticks;
+	int wake;
+
+	p = create_pending(client_name, gevent);
+	if (p == NULL)
+		return -1;
+
+	ticks = (period + SETTLE_TICK - 1) / SETTLE_TICK;
+	if (ticks == 0)
+		ticks = 1;
+
+	pthread_mutex_lock(&settle_mutex);
+	found = g_hash_table_lookup(pending, p);
+	if (found != NULL) {
+		free(p);
+		p = found;
+		wheel_remove(p);
+		p->event.mask |= gevent->mask;
+		p->event.pid = gevent->pid;
+		p->event.stat = gevent->stat;
+		p->event.digest_len = gevent->digest_len;
+		memcpy(p->event.digest, gevent->digest, sizeof(gevent->digest));
+	} else if (g_hash_table_size(pending) >= SETTLE_MAX_PENDING) {
+		pthread_mutex_unlock(&settle_mutex);
+		free(p);
+		return -1;
+	} else {
+		g_hash_table_insert(pending, p, p);
+	}
+
+	/* The wheel doesn't turn while it is empty. */
+	wake = g_hash_table_size(pending) == 1 && found == NULL;
+	if (wake)
+		next_tick = current_tick();
+	p->expires = current_tick() + ticks;
+	wheel_insert(p);
+	if (wake)
+		pthread_cond_signal(&settle_cond);
+	pthread_mutex_unlock(&settle_mutex);
+
+	return 0;
+}
+
+static void
+unlock_settle(void *arg)
+{
+	pthread_mutex_unlock(&settle_mutex);
+}
+
+/*
+ * Turns the wheel once per tick while any path is settling, and sends
+ * the settled events. Sending may block on a slow client, so it is done
+ * without the mutex.
+ */
+static void *
+settle_thread(void *arg)
+{
+	struct pending_t *p;
+	struct timespec deadline;
+	unsigned long now;
+	list_t *due;
+
+	due = list_create(free);
+	if (due == NULL) {
+		err_msg("error[settle_thread]: Unable to create the settled list.\n");
+		return NULL;
+	}
+
+	while (1) {
+		pthread_mutex_lock(&settle_mutex);
+		/* The thread is cancelled on shutdown while it waits. */
+		pthread_cleanup_push(unlock_settle, NULL);
+		while (g_hash_table_size(pending) == 0)
+			pthread_cond_wait(&settle_cond, &settle_mutex);
+		now = current_tick();
+		if ((long)(now - next_tick) < 0) {
+			deadline = tick_time(next_tick);
+			pthread_cond_timedwait(&settle_cond, &settle_mutex, &deadline);
+			now = current_tick();
+		}
+		while ((long)(now - next_tick) >= 0 &&
+		       g_hash_table_size(pending) > 0)
+			run_tick(due);
+		pthread_cleanup_pop(1);
+
+		while ((p = list_shift(due)) != NULL) {
+			galaxy_notify_client(p->client, &p->event);
+			free(p);
+		}
+	}
+
+	return NULL;
+}
+
+int
+create_settle_thread(pthread_t *id)
+{
+	int err;
+
+	err = create_joinable_thread(id, settle_thread, NULL);
+	if (err < 0)
+		err_create_joinable_thread(errno);
+
+	return err;
+}
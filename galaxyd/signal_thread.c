@@ -40,16 +40,22 @@
 
 #include "signal_thread.h"
 #include "thread.h"
+#include "fanotify_thread.h"
+#include "coalesce.h"
+#include "summary.h"
 #include "error.h"
 
-extern pthread_t crawler, watcher, signaler, server;
+extern pthread_t crawler, signaler, server, mounter, fanotifier, coalescer, settler;
+extern pthread_t summarizer;
+extern pthread_t watchers[];
+extern int nwatchers;
 
 static sigset_t mask;
 
 static void *
 signal_handler(void *arg)
 {
-	int err, signo;
+	int err, signo, i;
 
 	while (1) {
 		err = sigwait(&mask, &signo);
@@ -60,8 +66,17 @@ signal_handler(void *arg)
 				err_msg("DEBUG[signal_handler]: SIGINT caught.\n");
 #endif
 				pthread_cancel(crawler);
-				pthread_cancel(watcher);
+				for (i = 0; i < nwatchers; i++)
+					pthread_cancel(watchers[i]);
 				pthread_cancel(server);
+				pthread_cancel(mounter);
+				if (fanotify_enabled())
+					pthread_cancel(fanotifier);
+				if (coalesce_enabled())
+					pthread_cancel(coalescer);
+				if (summary_enabled())
+					pthread_cancel(summarizer);
+				pthread_cancel(settler);
 				return NULL;
 				break;
 			case SIGQUIT:
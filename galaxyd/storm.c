@@ -0,0 +1,322 @@
+/*
+ * Galaxy - A filesystem monitoring tool.
+ * Copyright (C) 2005  Gabriel Munoz <gabriel@xusia.net>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ */
+
+/*
+ * Storm mode. A flood of events in one part of the tree (an rm -rf of
+ * a large tree, an rsync deploy) is more than the per-event pipeline
+ * can handle, and ends with the kernel queue overflowing. Instead, every
+ * watched directory counts the events seen in its subtree, per second.
+ * When the count of one goes over the storm rate, the deepest such
+ * directory is put in storm mode:
+ *
+ *   - the watches of its subtree are narrowed to the events the daemon
+ *     needs itself (GALAXY_INTERNAL_EVENTS), so the kernel queues few
+ *     events for it;
+ *   - the events still seen there are not sent to the clients.
+ *
+ * Once the rate stays below a quarter of the storm rate for
+ * STORM_QUIET seconds the watches get their masks back, and clients
+ * that may have missed events get a single GAL_RESCAN event for the
+ * directory, telling them to read it again.
+ */
+
+#if HAVE_CONFIG_H
+#  include <config.h>
+#endif
+
+#if HAVE_STDLIB_H
+#  include <stdlib.h>
+#endif
+
+#include <time.h>
+
+#if HAVE_STRING_H
+#  include <string.h>
+#endif
+
+#if HAVE_PTHREAD_H
+#  include <pthread.h>
+#endif
+
+#if HAVE_ERRNO_H
+#  include <errno.h>
+#endif
+
+#include "storm.h"
+#include "dir_tree.h"
+#include "inotify.h"
+#include "inotify_utils.h"
+#include "watch.h"
+#include "crawler_thread.h"
+#include "galaxy.h"
+#include "error.h"
+
+/* A subtree in storm mode. */
+struct storm_t {
+	char *path;
+	size_t length;
+	time_t quiet_since;     /* 0 while the storm goes on. */
+	unsigned long dropped;  /* Events not sent to the clients. */
+} storm_t;
+
+static unsigned int storm_rate = 0;
+
+/* Leaf lock: nothing else is locked while it is held. */
+static pthread_mutex_t storm_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct storm_t storms[STORM_MAX];
+static int nstorms = 0;
+static time_t last_tick = 0;
+
+/*
+ * Sets the storm rate to `rate' events per second in a subtree; zero
+ * never enters storm mode.
+ */
+int
+init_storm(unsigned int rate)
+{
+	storm_rate = rate;
+
+	return 0;
+}
+
+void
+destroy_storm(void)
+{
+	int i;
+
+	pthread_mutex_lock(&storm_mutex);
+	for (i = 0; i < nstorms; i++)
+		free(storms[i].path);
+	nstorms = 0;
+	pthread_mutex_unlock(&storm_mutex);
+}
+
+/*
+ * Return Value:
+ *   Returns non-zero if `path' is the directory `dir', `length' bytes
+ *   long, or is below it.
+ */
+static int
+path_below(const char *path, const char *dir, size_t length)
+{
+	return strncmp(path, dir, length) == 0 &&
+		(path[length] == '/' || path[length] == '\0' || length == 1);
+}
+
+/*
+ * Must hold the storm mutex.
+ *
+ * Return Value:
+ *   Returns the storm covering `path', or NULL.
+ */
+static struct storm_t *
+find_storm(const char *path)
+{
+	int i;
+
+	for (i = 0; i < nstorms; i++) {
+		if (path_below(path, storms[i].path, storms[i].length))
+			return &storms[i];
+	}
+
+	return NULL;
+}
+
+/*
+ * Tells whether `path' is in a subtree in storm mode. Takes the storm
+ * lock itself.
+ */
+int
+storm_covers(const char *path)
+{
+	int covered;
+
+	if (nstorms == 0)
+		return 0;
+
+	pthread_mutex_lock(&storm_mutex);
+	covered = find_storm(path) != NULL;
+	pthread_mutex_unlock(&storm_mutex);
+
+	return covered;
+}
+
+/*
+ * Puts the subtree of `node' in storm mode, taking in the storms below
+ * it. The watches below get their narrowed masks from the crawl queue,
+ * since walking the subtree here would hold up every watcher thread
+ * right when the events pour in. The caller must hold the tree lock.
+ */
+static void
+start_storm(struct dir_node_t *node)
+{
+	struct storm_t *s;
+	unsigned long dropped = 0;
+	size_t length;
+	char *path;
+	int i;
+
+	path = dir_node_path(node, NULL);
+	if (path == NULL)
+		return;
+	path = strdup(path);
+	if (path == NULL) {
+		err_malloc(errno);
+		return;
+	}
+	length = strlen(path);
+
+	pthread_mutex_lock(&storm_mutex);
+	for (i = 0; i < nstorms; ) {
+		if (path_below(storms[i].path, path, length)) {
+			dropped += storms[i].dropped;
+			free(storms[i].path);
+			storms[i] = storms[--nstorms];
+		} else {
+			i++;
+		}
+	}
+	if (nstorms == STORM_MAX) {
+		pthread_mutex_unlock(&storm_mutex);
+		free(path);
+		return;
+	}
+	s = &storms[nstorms++];
+	s->path = path;
+	s->length = length;
+	s->quiet_since = 0;
+	s->dropped = dropped + 1;  /* The event that started it. */
+	pthread_mutex_unlock(&storm_mutex);
+
+	err_msg("warning[storm]: Over %u events per second below '%s'; sending a rescan once it calms down.\n",
+		storm_rate, path);
+	refresh_watch_masks(path);
+}
+
+/*
+ * Counts an event seen on the watched directory `node' in it and its
+ * watched ancestors, entering storm mode as needed. `path' is the path
+ * of the event. The caller must hold the tree lock.
+ *
+ * Entering storm mode builds paths in the thread's path buffer (see
+ * dir_node_path()), so `path' is overwritten if it lives there.
+ *
+ * Return Value:
+ *   Returns 1 if the event is in a storm and must not be sent to the
+ *   clients, otherwise zero.
+ */
+int
+storm_note_event(struct dir_node_t *node, const char *path)
+{
+	struct dir_node_t *n, *hot = NULL;
+	struct storm_t *s;
+	time_t now;
+	int stormy = 0;
+
+	if (storm_rate == 0)
+		return 0;
+
+	now = time(NULL);
+	for (n = node; n != NULL; n = n->parent) {
+		if (n->wd < 0)
+			continue;
+		if (n->burst_second != now) {
+			n->burst_second = now;
+			n->burst = 0;
+		}
+		if (++n->burst > storm_rate && hot == NULL)
+			hot = n;
+	}
+
+	if (nstorms > 0) {
+		pthread_mutex_lock(&storm_mutex);
+		s = find_storm(path);
+		if (s != NULL) {
+			s->dropped++;
+			stormy = 1;
+		}
+		pthread_mutex_unlock(&storm_mutex);
+	}
+	if (hot != NULL && !stormy) {
+		start_storm(hot);
+		stormy = 1;
+	}
+
+	return stormy;
+}
+
+/*
+ * Ends the storms that calmed down. Called by the inotify watcher
+ * threads; does its work at most once a second.
+ */
+void
+storm_tick(void)
+{
+	struct dir_node_t *node;
+	struct storm_t ended[STORM_MAX];
+	unsigned int burst;
+	time_t now;
+	int i, nended = 0;
+
+	if (storm_rate == 0 || nstorms == 0)
+		return;
+
+	now = time(NULL);
+	pthread_mutex_lock(&storm_mutex);
+	if (now == last_tick) {
+		pthread_mutex_unlock(&storm_mutex);
+		return;
+	}
+	last_tick = now;
+	pthread_mutex_unlock(&storm_mutex);
+
+	dir_tree_lock();
+	pthread_mutex_lock(&storm_mutex);
+	for (i = 0; i < nstorms; ) {
+		node = dir_tree_lookup(storms[i].path);
+		burst = 0;
+		if (node != NULL && node->wd >= 0 && now - node->burst_second <= 1)
+			burst = node->burst;
+		if (burst > storm_rate / 4 && node != NULL) {
+			storms[i].quiet_since = 0;
+			i++;
+			continue;
+		}
+		if (storms[i].quiet_since == 0)
+			storms[i].quiet_since = now;
+		if (node != NULL && now - storms[i].quiet_since < STORM_QUIET) {
+			i++;
+			continue;
+		}
+		ended[nended++] = storms[i];
+		storms[i] = storms[--nstorms];
+	}
+	pthread_mutex_unlock(&storm_mutex);
+	dir_tree_unlock();
+
+	for (i = 0; i < nended; i++) {
+		/* The watches get their masks back without the storm. */
+		refresh_watch_masks(ended[i].path);
+		err_msg("warning[storm]: '%s' calmed down; %lu events were summarized.\n",
+			ended[i].path, ended[i].dropped);
+		find_matching_events(ended[i].path, GAL_RESCAN | IN_ISDIR);
+		free(ended[i].path);
+	}
+}
@@ -0,0 +1,50 @@
+/*
+ * Galaxy - A filesystem monitoring tool.
+ * Copyright (C) 2005  Gabriel Munoz <gabriel@xusia.net>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ */
+
+#ifndef STORM_H
+#define STORM_H
+
+#if HAVE_CONFIG_H
+#  include <config.h>
+#endif
+
+#include "dir_tree.h"
+
+/* Default storm rate, in events per second in a subtree. */
+#define STORM_RATE   10000
+
+/* Seconds a storm has to stay calm before it ends. */
+#define STORM_QUIET  3
+
+/* Most subtrees in storm mode at once. */
+#define STORM_MAX    16
+
+/* Initialization and destruction routines -- called once on
+ * startup/shutdown. */
+int init_storm(unsigned int rate);
+void destroy_storm(void);
+
+int storm_covers(const char *path);
+int storm_note_event(struct dir_node_t *node, const char *path);
+
+/* Called by the inotify watcher threads. */
+void storm_tick(void);
+
+#endif
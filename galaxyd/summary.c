@@ -0,0 +1,392 @@
+/*
+ * Galaxy - A filesystem monitoring tool.
+ * Copyright (C) 2005  Gabriel Munoz <gabriel@xusia.net>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ */
+
+/*
+ * Summarizes events per directory for subscriptions that ask for it
+ * (GAL_SUMMARY). Cache invalidators and indexers only need to know that
+ * a directory changed, and how; instead of each event, the first event
+ * on an entry of a directory opens a window during which the events on
+ * its entries, for the same client, are counted per event bit along with
+ * a sample of the names. The summary is sent when the window closes.
+ *
+ * As in coalesce.c, every summary is held for the same interval, so a
+ * FIFO is all the flusher needs.
+ */
+
+#if HAVE_CONFIG_H
+#  include <config.h>
+#endif
+
+#if HAVE_STDLIB_H
+#  include <stdlib.h>
+#endif
+
+#include <time.h>
+
+#if HAVE_STRING_H
+#  include <string.h>
+#endif
+
+#if HAVE_PTHREAD_H
+#  include <pthread.h>
+#endif
+
+#if HAVE_ERRNO_H
+#  include <errno.h>
+#endif
+
+#if HAVE_LIBGLIB_2_0
+#  include <glib.h>
+#endif
+
+#include "summary.h"
+#include "thread.h"
+#include "watch.h"
+#include "inotify.h"
+#include "galaxy.h"
+#include "list.h"
+#include "error.h"
+
+/* Past this many directories held, events are sent one by one. */
+#define SUMMARY_MAX_PENDING 65536
+
+/* The events on the entries of a directory, for one client. */
+struct summary_t {
+	struct timespec deadline;     /* CLOCK_MONOTONIC. */
+	struct galaxy_event_t event;  /* Its name is `dir'. */
+	size_t names_size;            /* Allocated for event.summary_names. */
+	char *dir;                    /* Points into `client'. */
+	char client[1];
+} summary_t;
+
+static unsigned int interval_ms = 0;
+
+static pthread_mutex_t summary_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t summary_cond;
+static GHashTable *pending = NULL;  /* Of struct summary_t, by itself. */
+static list_t *fifo = NULL;         /* The same entries, oldest first. */
+
+static guint
+summary_hash(gconstpointer key)
+{
+	const struct summary_t *s = key;
+
+	return g_str_hash(s->client) * 31 + g_str_hash(s->dir);
+}
+
+static gboolean
+summary_equal(gconstpointer a, gconstpointer b)
+{
+	const struct summary_t *s = a, *t = b;
+
+	return strcmp(s->dir, t->dir) == 0 && strcmp(s->client, t->client) == 0;
+}
+
+static void
+free_summary(void *ptr)
+{
+	struct summary_t *s = ptr;
+
+	free(s->event.summary_names);
+	free(s);
+}
+
+/*
+ * Creates an empty summary of the directory `dir', `length' bytes long,
+ * for the client `client_name'.
+ */
+static struct summary_t *
+create_summary(const char *client_name, const char *dir, size_t length)
+{
+	struct summary_t *s;
+	size_t len;
+
+	len = strlen(client_name);
+	s = malloc(sizeof(struct summary_t) + len + 1 + length);
+	if (s == NULL) {
+		err_malloc(errno);
+		return NULL;
+	}
+	memcpy(s->client, client_name, len + 1);
+	s->dir = s->client + len + 1;
+	memcpy(s->dir, dir, length);
+	s->dir[length] = '\0';
+	memset(&s->event, 0, sizeof(s->event));
+	s->event.name = s->dir;
+	s->event.mask = IN_ISDIR;
+	s->names_size = 0;
+
+	return s;
+}
+
+/*
+ * Adds `name' to the sample of names of `s', unless the sample is full
+ * or has it already.
+ */
+static void
+sample_name(struct summary_t *s, const char *name)
+{
+	struct galaxy_event_t *e = &s->event;
+	size_t len, need;
+	uint32_t i;
+	char *p;
+
+	if (e->summary_nnames >= GALAXY_SUMMARY_SAMPLE || name[0] == '\0')
+		return;
+	p = e->summary_names;
+	for (i = 0; i < e->summary_nnames; i++) {
+		if (strcmp(p, name) == 0)
+			return;
+		p += strlen(p) + 1;
+	}
+
+	len = strlen(name) + 1;
+	need = e->summary_names_len + len;
+	if (need > s->names_size) {
+		p = realloc(e->summary_names, need * 2);
+		if (p == NULL) {
+			err_malloc(errno);
+			return;
+		}
+		e->summary_names = p;
+		s->names_size = need * 2;
+	}
+	memcpy(e->summary_names + e->summary_names_len, name, len);
+	e->summary_names_len += len;
+	e->summary_nnames++;
+}
+
+/*
+ * Counts `gevent', on the entry `name' of the directory of `s'.
+ */
+static void
+count_event(struct summary_t *s, const struct galaxy_event_t *gevent,
+	const char *name)
+{
+	struct galaxy_event_t *e = &s->event;
+	struct timespec now;
+	uint64_t ns;
+	int i;
+
+	ns = gevent->realtime_ns;
+	if (ns == 0) {
+		clock_gettime(CLOCK_REALTIME, &now);
+		ns = (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+	}
+	if (e->summary_events == 0 || ns < e->summary_first_ns)
+		e->summary_first_ns = ns;
+	if (ns > e->summary_last_ns)
+		e->summary_last_ns = ns;
+
+	for (i = 0; i < GALAXY_SUMMARY_BITS; i++) {
+		if (gevent->mask & (1u << i))
+			e->summary_counts[i]++;
+	}
+	e->summary_events++;
+	e->mask |= gevent->mask & ((1u << GALAXY_SUMMARY_BITS) - 1);
+	/* The stamp is that of the last event counted. */
+	e->sequence = gevent->sequence;
+	e->monotonic_ns = gevent->monotonic_ns;
+	e->realtime_ns = gevent->realtime_ns;
+
+	sample_name(s, name);
+}
+
+/*
+ * Sets the summary interval to `interval' milliseconds; zero sends
+ * every event as it comes, even for subscriptions that asked for
+ * summaries.
+ */
+int
+init_summary(unsigned int interval)
+{
+	pthread_condattr_t attr;
+
+	interval_ms = interval;
+	if (interval_ms == 0)
+		return 0;
+
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&summary_cond, &attr);
+	pthread_condattr_destroy(&attr);
+
+	pending = g_hash_table_new(summary_hash, summary_equal);
+	fifo = list_create(free_summary);
+	if (fifo == NULL) {
+		err_msg("error[init_summary]: Unable to create the summary queue.\n");
+		return -1;
+	}
+
+	return 0;
+}
+
+void
+destroy_summary(void)
+{
+	if (interval_ms == 0)
+		return;
+	pthread_mutex_lock(&summary_mutex);
+	g_hash_table_destroy(pending);
+	pending = NULL;
+	list_destroy(fifo);
+	fifo = NULL;
+	pthread_mutex_unlock(&summary_mutex);
+	pthread_cond_destroy(&summary_cond);
+}
+
+int
+summary_enabled(void)
+{
+	return interval_ms > 0;
+}
+
+/*
+ * Counts an event in the summary of its directory for the client
+ * `client_name'. A rename is counted in the directory of its new path.
+ *
+ * Return Value:
+ *   Returns zero if the event was taken, or -1 if the caller has to send
+ *   it right away (summaries are off, or too many are held).
+ */
+int
+summary_event(const char *client_name, const struct galaxy_event_t *gevent)
+{
+	struct summary_t *s, *found;
+	const char *slash;
+	size_t length;
+
+	if (interval_ms == 0)
+		return -1;
+
+	slash = strrchr(gevent->name, '/');
+	if (slash == NULL)
+		return -1;
+	length = slash == gevent->name ? 1 : slash - gevent->name;
+
+	s = create_summary(client_name, gevent->name, length);
+	if (s == NULL)
+		return -1;
+
+	pthread_mutex_lock(&summary_mutex);
+	found = g_hash_table_lookup(pending, s);
+	if (found != NULL) {
+		count_event(found, gevent, slash + 1);
+		pthread_mutex_unlock(&summary_mutex);
+		free(s);
+		return 0;
+	}
+	if (g_hash_table_size(pending) >= SUMMARY_MAX_PENDING ||
+	    list_push(fifo, s) < 0) {
+		pthread_mutex_unlock(&summary_mutex);
+		free(s);
+		return -1;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &s->deadline);
+	s->deadline.tv_sec += interval_ms / 1000;
+	s->deadline.tv_nsec += (interval_ms % 1000) * 1000000L;
+	if (s->deadline.tv_nsec >= 1000000000L) {
+		s->deadline.tv_sec++;
+		s->deadline.tv_nsec -= 1000000000L;
+	}
+	count_event(s, gevent, slash + 1);
+	g_hash_table_insert(pending, s, s);
+	if (list_size(fifo) == 1)
+		pthread_cond_signal(&summary_cond);
+	pthread_mutex_unlock(&summary_mutex);
+
+	return 0;
+}
+
+static int
+expired(const struct timespec *deadline, const struct timespec *now)
+{
+	return deadline->tv_sec < now->tv_sec ||
+		(deadline->tv_sec == now->tv_sec && deadline->tv_nsec <= now->tv_nsec);
+}
+
+static void
+unlock_summary(void *arg)
+{
+	pthread_mutex_unlock(&summary_mutex);
+}
+
+/*
+ * Sends the summaries whose interval is over. Sending may block on a
+ * slow client, so it is done without the mutex.
+ */
+static void *
+summary_flush(void *arg)
+{
+	struct summary_t *s;
+	struct timespec now;
+	list_t *due;
+
+	due = list_create(free_summary);
+	if (due == NULL) {
+		err_msg("error[summary_flush]: Unable to create the flush list.\n");
+		return NULL;
+	}
+
+	while (1) {
+		pthread_mutex_lock(&summary_mutex);
+		/* The thread is cancelled on shutdown while it waits. */
+		pthread_cleanup_push(unlock_summary, NULL);
+		while (list_size(fifo) == 0)
+			pthread_cond_wait(&summary_cond, &summary_mutex);
+		s = list_key(list_head(fifo));
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		if (!expired(&s->deadline, &now)) {
+			pthread_cond_timedwait(&summary_cond, &summary_mutex,
+				&s->deadline);
+			clock_gettime(CLOCK_MONOTONIC, &now);
+		}
+		while (list_size(fifo) > 0 &&
+		       expired(&((struct summary_t *)list_key(list_head(fifo)))->deadline, &now)) {
+			s = list_shift(fifo);
+			g_hash_table_remove(pending, s);
+			list_push(due, s);
+		}
+		pthread_cleanup_pop(1);
+
+		while ((s = list_shift(due)) != NULL) {
+			galaxy_notify_client(s->client, &s->event);
+			free_summary(s);
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * Creates the thread that sends the summaries. Only needed when
+ * summary_enabled().
+ */
+int
+create_summary_thread(pthread_t *id)
+{
+	int err;
+
+	err = create_joinable_thread(id, summary_flush, NULL);
+	if (err < 0)
+		err_create_joinable_thread(errno);
+
+	return err;
+}
@@ -0,0 +1,47 @@
+/*
+ * Galaxy - A filesystem monitoring tool.
+ * Copyright (C) 2005  Gabriel Munoz <gabriel@xusia.net>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ */
+
+#ifndef SUMMARY_H
+#define SUMMARY_H
+
+#if HAVE_CONFIG_H
+#  include <config.h>
+#endif
+
+#if HAVE_PTHREAD_H
+#  include <pthread.h>
+#endif
+
+/* Default interval, in milliseconds. */
+#define SUMMARY_INTERVAL 1000
+
+/* Initialization and destruction routines -- called once on
+ * startup/shutdown. */
+int init_summary(unsigned int interval);
+void destroy_summary(void);
+
+int summary_enabled(void);
+struct galaxy_event_t;
+int summary_event(const char *client_name,
+	const struct galaxy_event_t *gevent);
+
+int create_summary_thread(pthread_t *id);
+
+#endif
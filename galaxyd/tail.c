@@ -0,0 +1,268 @@
+/*
+ * Galaxy - A filesystem monitoring tool.
+ * Copyright (C) 2005  Gabriel Munoz <gabriel@xusia.net>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ */
+
+/*
+ * Offsets of the files tailed by GAL_TAIL watches. Each modification of
+ * a tailed file takes the range appended since the last one, once for
+ * all the clients that want it; the bytes are then sent to every one of
+ * them straight from the file with sendfile(2).
+ *
+ * A file is tracked by path, along with the inode found there. A file
+ * created at the path is tailed from its start, as is one found to be
+ * shorter than its offset (truncated) or to be another inode (replaced).
+ * A file first seen at a modification is tailed from its end at that
+ * time. Moving a file away or deleting it forgets it.
+ */
+
+#if HAVE_CONFIG_H
+#  include <config.h>
+#endif
+
+#if HAVE_STDLIB_H
+#  include <stdlib.h>
+#endif
+
+#include <time.h>
+
+#if HAVE_STRING_H
+#  include <string.h>
+#endif
+
+#if HAVE_SYS_TYPES_H
+#  include <sys/types.h>
+#endif
+
+#if HAVE_SYS_STAT_H
+#  include <sys/stat.h>
+#endif
+
+#if HAVE_FCNTL_H
+#  include <fcntl.h>
+#endif
+
+#if HAVE_UNISTD_H
+#  include <unistd.h>
+#endif
+
+#if HAVE_PTHREAD_H
+#  include <pthread.h>
+#endif
+
+#if HAVE_ERRNO_H
+#  include <errno.h>
+#endif
+
+#if HAVE_LIBGLIB_2_0
+#  include <glib.h>
+#endif
+
+#include "tail.h"
+#include "self_events.h"
+#include "inotify.h"
+#include "galaxy.h"
+#include "error.h"
+
+/* A file being tailed. */
+struct tailed_file_t {
+	dev_t dev;
+	ino_t ino;          /* 0 until the file created at the path is seen. */
+	uint64_t offset;    /* Sent up to here. */
+	time_t used;
+	char path[1];       /* Hash table key. */
+} tailed_file_t;
+
+static pthread_mutex_t tail_mutex = PTHREAD_MUTEX_INITIALIZER;
+static GHashTable *tailed = NULL;  /* Of struct tailed_file_t, by path. */
+
+int
+init_tail(void)
+{
+	tailed = g_hash_table_new_full(g_str_hash, g_str_equal, NULL, free);
+	if (tailed == NULL) {
+		err_msg("error[init_tail]: Unable to create the tailed files table.\n");
+		return -1;
+	}
+
+	return 0;
+}
+
+void
+destroy_tail(void)
+{
+	pthread_mutex_lock(&tail_mutex);
+	if (tailed != NULL)
+		g_hash_table_destroy(tailed);
+	tailed = NULL;
+	pthread_mutex_unlock(&tail_mutex);
+}
+
+static gboolean
+idle_file(gpointer key, gpointer value, gpointer user_data)
+{
+	const struct tailed_file_t *t = value;
+
+	return t->used < *(time_t *)user_data;
+}
+
+/*
+ * Return Value:
+ *   Returns the entry for `path', added if needed, or NULL if there are
+ *   too many files tailed already.
+ */
+static struct tailed_file_t *
+track_file(const char *path)
+{
+	struct tailed_file_t *t;
+	time_t idle;
+
+	t = g_hash_table_lookup(tailed, path);
+	if (t != NULL)
+		return t;
+
+	if (g_hash_table_size(tailed) >= TAIL_MAX_FILES) {
+		idle = time(NULL) - TAIL_IDLE;
+		g_hash_table_foreach_remove(tailed, idle_file, &idle);
+		if (g_hash_table_size(tailed) >= TAIL_MAX_FILES)
+			return NULL;
+	}
+
+	t = malloc(sizeof(struct tailed_file_t) + strlen(path));
+	if (t == NULL) {
+		err_malloc(errno);
+		return NULL;
+	}
+	strcpy(t->path, path);
+	t->dev = 0;
+	t->ino = 0;
+	t->offset = 0;
+	g_hash_table_insert(tailed, t->path, t);
+
+	return t;
+}
+
+/*
+ * Takes the range appended to `path' since its offset, up to
+ * TAIL_MAX_BYTES, and moves the offset past it.
+ */
+static void
+take_range(const char *path, struct tail_range_t *range)
+{
+	struct tailed_file_t *t;
+	struct stat statbuf;
+	int fd;
+
+	/* Our own reads are not reported. */
+	self_scan_begin(path);
+	fd = open(path, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+	self_scan_end(path);
+	if (fd < 0)
+		return;
+	if (fstat(fd, &statbuf) < 0 || !S_ISREG(statbuf.st_mode)) {
+		close(fd);
+		return;
+	}
+
+	pthread_mutex_lock(&tail_mutex);
+	t = g_hash_table_lookup(tailed, path);
+	if (t == NULL) {
+		t = track_file(path);
+		if (t != NULL) {
+			t->dev = statbuf.st_dev;
+			t->ino = statbuf.st_ino;
+			t->offset = statbuf.st_size;
+		}
+	} else if (t->ino == 0) {
+		t->dev = statbuf.st_dev;
+		t->ino = statbuf.st_ino;
+	} else if (t->ino != statbuf.st_ino || t->dev != statbuf.st_dev) {
+		t->dev = statbuf.st_dev;
+		t->ino = statbuf.st_ino;
+		t->offset = 0;
+		range->flags |= GALAXY_TAIL_REPLACED;
+	} else if ((uint64_t)statbuf.st_size < t->offset) {
+		t->offset = 0;
+		range->flags |= GALAXY_TAIL_TRUNCATED;
+	}
+	if (t != NULL) {
+		range->offset = t->offset;
+		if ((uint64_t)statbuf.st_size - t->offset > TAIL_MAX_BYTES)
+			range->len = TAIL_MAX_BYTES;
+		else
+			range->len = statbuf.st_size - t->offset;
+		t->offset += range->len;
+		t->used = time(NULL);
+	}
+	pthread_mutex_unlock(&tail_mutex);
+
+	if (range->len == 0 && range->flags == 0)
+		close(fd);
+	else
+		range->fd = fd;
+}
+
+/*
+ * Updates the offset of the file an event is about, for a GAL_TAIL
+ * watch that matched it. For a modification, `range' is set to the
+ * bytes appended since the last one, with a descriptor to send them
+ * from; tail_release() has to be called once they were sent.
+ */
+void
+tail_event(const struct galaxy_event_t *gevent, struct tail_range_t *range)
+{
+	struct tailed_file_t *t;
+
+	range->fd = -1;
+	range->offset = 0;
+	range->len = 0;
+	range->flags = 0;
+
+	if (gevent->mask & IN_ISDIR)
+		return;
+
+	pthread_mutex_lock(&tail_mutex);
+	if (tailed == NULL) {
+		pthread_mutex_unlock(&tail_mutex);
+		return;
+	}
+	/* On a rename `old_name' is the file moved away. */
+	if (gevent->old_name != NULL)
+		g_hash_table_remove(tailed, gevent->old_name);
+	if (gevent->mask & (IN_DELETE | IN_MOVED_FROM) && gevent->old_name == NULL)
+		g_hash_table_remove(tailed, gevent->name);
+	/* A rotation puts a new file in place: send all of it. */
+	if (gevent->mask & (IN_CREATE | IN_MOVED_TO)) {
+		g_hash_table_remove(tailed, gevent->name);
+		t = track_file(gevent->name);
+		if (t != NULL)
+			t->used = time(NULL);
+	}
+	pthread_mutex_unlock(&tail_mutex);
+
+	if (gevent->mask & IN_MODIFY)
+		take_range(gevent->name, range);
+}
+
+void
+tail_release(struct tail_range_t *range)
+{
+	if (range->fd >= 0)
+		close(range->fd);
+	range->fd = -1;
+}
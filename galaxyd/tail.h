@@ -0,0 +1,64 @@
+/*
+ * Galaxy - A filesystem monitoring tool.
+ * Copyright (C) 2005  Gabriel Munoz <gabriel@xusia.net>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ */
+
+#ifndef TAIL_H
+#define TAIL_H
+
+#if HAVE_CONFIG_H
+#  include <config.h>
+#endif
+
+#if HAVE_INTTYPES_H
+#  include <inttypes.h>
+#endif
+
+#include "galaxy.h"
+
+/* Most files tailed at once; past it, files unused for TAIL_IDLE
+ * seconds are forgotten. */
+#define TAIL_MAX_FILES  4096
+#define TAIL_IDLE       3600
+
+/* Most bytes sent with one event, the most clients take in a field.
+ * The rest goes with the next one. */
+#define TAIL_MAX_BYTES  GALAXY_FIELD_MAX
+
+/* Events that move the offset of a tailed file. */
+#define TAIL_EVENTS  (IN_MODIFY | IN_CREATE | IN_DELETE | IN_MOVED_FROM | \
+                      IN_MOVED_TO)
+
+/* Bytes appended to a file, to be sent to the GAL_TAIL watches. */
+struct tail_range_t {
+	int fd;             /* The file, open; -1 if there's nothing to send. */
+	uint64_t offset;
+	uint32_t len;
+	uint32_t flags;     /* GALAXY_TAIL_* */
+};
+
+/* Initialization and destruction routines -- called once on
+ * startup/shutdown. */
+int init_tail(void);
+void destroy_tail(void);
+
+struct galaxy_event_t;
+void tail_event(const struct galaxy_event_t *gevent, struct tail_range_t *range);
+void tail_release(struct tail_range_t *range);
+
+#endif
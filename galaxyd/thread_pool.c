@@ -0,0 +1,204 @@
+/*
+ * Galaxy - A filesystem monitoring tool.
+ * Copyright (C) 2005  Gabriel Munoz <gabriel@xusia.net>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ */
+
+#if HAVE_CONFIG_H
+#  include <config.h>
+#endif
+
+#if HAVE_STDLIB_H
+#  include <stdlib.h>
+#endif
+
+#if HAVE_PTHREAD_H
+#  include <pthread.h>
+#endif
+
+#if HAVE_ERRNO_H
+#  include <errno.h>
+#endif
+
+#include "thread_pool.h"
+#include "thread.h"
+#include "list.h"
+#include "error.h"
+
+struct job_t {
+	void (*func)(void *arg);
+	void *arg;
+} job_t;
+
+struct thread_pool_struct {
+	int nthreads;
+	int shutdown;
+	list_t *jobs;
+	pthread_t *threads;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+};
+
+static void *
+worker(void *arg)
+{
+	thread_pool_t pool;
+	struct job_t *job;
+
+	pool = (thread_pool_t)arg;
+
+	while (1) {
+		pthread_mutex_lock(&pool->mutex);
+		while (list_size(pool->jobs) == 0 && !pool->shutdown)
+			pthread_cond_wait(&pool->cond, &pool->mutex);
+		if (pool->shutdown) {
+			pthread_mutex_unlock(&pool->mutex);
+			break;
+		}
+		job = list_shift(pool->jobs);
+		pthread_mutex_unlock(&pool->mutex);
+
+		job->func(job->arg);
+		free(job);
+	}
+
+	return NULL;
+}
+
+/*
+ * Creates a pool of `nthreads' worker threads that run submitted jobs
+ * in FIFO order. The pool replaces spawning one detached thread per
+ * unit of work.
+ *
+ * Return Value:
+ *   Returns the new pool, or NULL on error.
+ */
+thread_pool_t
+thread_pool_create(int nthreads)
+{
+	thread_pool_t pool;
+	int i, err;
+
+	pool = malloc(sizeof(struct thread_pool_struct));
+	if (pool == NULL) {
+		err_malloc(errno);
+		err_msg("error[thread_pool_create]: Unable to malloc thread pool.\n");
+		return NULL;
+	}
+
+	pool->jobs = list_create(free);
+	pool->threads = malloc(sizeof(pthread_t) * nthreads);
+	if (pool->jobs == NULL || pool->threads == NULL) {
+		err_msg("error[thread_pool_create]: Unable to allocate thread pool.\n");
+		list_destroy(pool->jobs);
+		free(pool->threads);
+		free(pool);
+		return NULL;
+	}
+	pool->shutdown = 0;
+	pthread_mutex_init(&pool->mutex, NULL);
+	pthread_cond_init(&pool->cond, NULL);
+
+	for (i = 0; i < nthreads; i++) {
+		err = create_joinable_thread(&pool->threads[i], worker, pool);
+		if (err != 0) {
+			err_create_joinable_thread(err);
+			break;
+		}
+	}
+	pool->nthreads = i;
+	if (i == 0) {
+		thread_pool_destroy(pool);
+		return NULL;
+	}
+
+	return pool;
+}
+
+/*
+ * Stops and joins the workers. Jobs that were not started yet are
+ * discarded (their arguments are not freed).
+ */
+void
+thread_pool_destroy(thread_pool_t pool)
+{
+	int i;
+
+	if (pool == NULL)
+		return;
+
+	pthread_mutex_lock(&pool->mutex);
+	pool->shutdown = 1;
+	pthread_cond_broadcast(&pool->cond);
+	pthread_mutex_unlock(&pool->mutex);
+
+	for (i = 0; i < pool->nthreads; i++)
+		pthread_join(pool->threads[i], NULL);
+
+	list_destroy(pool->jobs);
+	free(pool->threads);
+	pthread_mutex_destroy(&pool->mutex);
+	pthread_cond_destroy(&pool->cond);
+	free(pool);
+}
+
+/*
+ * Queues `func(arg)' to run on one of the pool's workers.
+ *
+ * Return Value:
+ *   Returns -1 on error, otherwise zero.
+ */
+int
+thread_pool_submit(thread_pool_t pool, void (*func)(void *arg), void *arg)
+{
+	struct job_t *job;
+
+	job = malloc(sizeof(struct job_t));
+	if (job == NULL) {
+		err_malloc(errno);
+		err_msg("error[thread_pool_submit]: Unable to malloc job.\n");
+		return -1;
+	}
+	job->func = func;
+	job->arg = arg;
+
+	pthread_mutex_lock(&pool->mutex);
+	if (list_push(pool->jobs, job) < 0) {
+		pthread_mutex_unlock(&pool->mutex);
+		free(job);
+		return -1;
+	}
+	pthread_cond_signal(&pool->cond);
+	pthread_mutex_unlock(&pool->mutex);
+
+	return 0;
+}
+
+/*
+ * Returns the number of jobs waiting for a worker.
+ */
+unsigned long
+thread_pool_pending(thread_pool_t pool)
+{
+	unsigned long n;
+
+	pthread_mutex_lock(&pool->mutex);
+	n = list_size(pool->jobs);
+	pthread_mutex_unlock(&pool->mutex);
+
+	return n;
+}
@@ -0,0 +1,37 @@
+/*
+ * Galaxy - A filesystem monitoring tool.
+ * Copyright (C) 2005  Gabriel Munoz <gabriel@xusia.net>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ */
+
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#if HAVE_CONFIG_H
+#  include <config.h>
+#endif
+
+struct thread_pool_struct;
+typedef struct thread_pool_struct *thread_pool_t;
+
+thread_pool_t thread_pool_create(int nthreads);
+void thread_pool_destroy(thread_pool_t pool);
+int thread_pool_submit(thread_pool_t pool, void (*func)(void *arg),
+	void *arg);
+unsigned long thread_pool_pending(thread_pool_t pool);
+
+#endif
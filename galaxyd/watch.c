@@ -26,6 +26,8 @@
 #  include <stdlib.h>
 #endif
 
+#include <stdio.h>
+
 #if HAVE_STRING_H
 #  include <string.h>
 #endif
@@ -34,6 +36,10 @@
 #  include <errno.h>
 #endif
 
+#if HAVE_UNISTD_H
+#  include <unistd.h>
+#endif
+
 #if HAVE_PCRE_H
 #  include <pcre.h>
 #endif
@@ -49,8 +55,17 @@
 #define OVECCOUNT 30    /* Needs to be a multiple of 3 */
 
 #include "watch.h"
+#include "coalesce.h"
+#include "summary.h"
+#include "settle.h"
+#include "event_stamp.h"
+#include "dirfd_cache.h"
+#include "digest.h"
+#include "tail.h"
 #include "list.h"
 #include "inotify.h"
+#include "galaxy.h"
+#include "galnet.h"
 #include "error.h"
 
 static GHashTable *client_watches;
@@ -60,18 +75,48 @@ struct watch_t {
 	uint32_t mask;
 	pcre *re;
 	pcre_extra *extra;
+	int anchored;  /* Can only match at the start of the filename. */
+	int closed;    /* A match on a prefix also matches any extension. */
 } watch_t;
 
 struct client_watch_t {
 	uint32_t ignore_mask;
+	uint32_t settle_period;  /* Milliseconds, for GAL_SETTLE watches. */
+	uint32_t stat_fields;    /* GALAXY_STAT_*, for GAL_STAT watches. */
 	list_t *ignore_watches;
 	list_t *watches;
 } client_watch_t;
 
-struct internal_event_t {
-	uint32_t mask;
-	const char *filename;
-} internal_event_t;
+/* An event being matched against the client watches. */
+struct match_data_t {
+	struct galaxy_event_t event;
+	int stat_taken;  /* event.stat was filled in for a GAL_STAT watch. */
+	int unchanged;   /* A close-write that left the contents as they were. */
+	int tail_taken;  /* `tail' was taken for a GAL_TAIL watch. */
+	struct tail_range_t tail;
+	list_t *tail_sends;  /* Of struct tail_send_t; NULL if none. */
+} match_data_t;
+
+/* An event carrying appended bytes, to be sent once the client watches
+ * are unlocked. */
+struct tail_send_t {
+	struct galaxy_event_t event;
+	char client[1];
+} tail_send_t;
+
+struct subtree_query_t {
+	const char *prefix;  /* Directory name with a trailing slash. */
+	int length;
+	uint32_t mask;  /* Union of the masks that may match. */
+	int explicit;   /* An anchored watch leads to, or into, the prefix. */
+} subtree_query_t;
+
+/* Two directory prefixes being compared by galaxy_subtree_differs(). */
+struct subtree_pair_t {
+	const char *a, *b;  /* Directory names with a trailing slash. */
+	int a_length, b_length;
+	int differs;
+} subtree_pair_t;
 
 /*
  * Used to de-allocate a struct watch_t structure. May be used as the
@@ -100,6 +145,7 @@ create_watch(uint32_t mask, const char *pattern)
 	struct watch_t *watch;
 	const char *error;
 	int erroffset;
+	unsigned long options;
 
 	watch = malloc(sizeof(struct watch_t));
 	if (watch == NULL) {
@@ -121,6 +167,16 @@ create_watch(uint32_t mask, const char *pattern)
 
 	watch->extra = pcre_study(watch->re, 0, &error);  /* Ignore retval. */
 
+	/* Remember enough about the pattern to tell which directories it
+	 * can ever match under (see galaxy_subtree_mask()). Patterns with
+	 * an end anchor or assertions may stop matching when a path grows,
+	 * so they are never treated as closed. */
+	options = 0;
+	pcre_fullinfo(watch->re, watch->extra, PCRE_INFO_OPTIONS, &options);
+	watch->anchored = (options & PCRE_ANCHORED) != 0;
+	watch->closed = watch->anchored && strchr(pattern, '$') == NULL &&
+		strstr(pattern, "(?") == NULL;
+
 	return watch;
 }
 
@@ -146,6 +202,8 @@ create_client_watch(void)
 		return NULL;
 	}
 	client_watch->ignore_mask = 0;
+	client_watch->settle_period = SETTLE_PERIOD;
+	client_watch->stat_fields = GALAXY_STAT_ALL;
 	client_watch->ignore_watches = list_create(destroy_watch);
 	if (client_watch->ignore_watches == NULL) {
 		err_msg("error[create_client_watch]: Unable to create ignore_watches list.\n");
@@ -263,6 +321,50 @@ set_galaxy_ignore_mask(const char *client_name, uint32_t ignore_mask)
 	return 0;
 }
 
+/*
+ * Sets how long the paths matched by the GAL_SETTLE watches of the client
+ * `client_name' have to be quiet before their event is sent.
+ */
+int
+set_galaxy_settle_period(const char *client_name, uint32_t period)
+{
+	struct client_watch_t *client_watch;
+
+	client_watch = get_client_watch(client_watches, (char *)client_name);
+	if (client_watch == NULL) {
+		err_msg("error[set_galaxy_settle_period]: Unable to lookup client watch.\n");
+		return -1;
+	}
+
+	pthread_mutex_lock(&client_watches_mutex);
+	client_watch->settle_period = period;
+	pthread_mutex_unlock(&client_watches_mutex);
+
+	return 0;
+}
+
+/*
+ * Sets the GALAXY_STAT_* fields attached to the events of the GAL_STAT
+ * watches of the client `client_name'.
+ */
+int
+set_galaxy_stat_fields(const char *client_name, uint32_t fields)
+{
+	struct client_watch_t *client_watch;
+
+	client_watch = get_client_watch(client_watches, (char *)client_name);
+	if (client_watch == NULL) {
+		err_msg("error[set_galaxy_stat_fields]: Unable to lookup client watch.\n");
+		return -1;
+	}
+
+	pthread_mutex_lock(&client_watches_mutex);
+	client_watch->stat_fields = fields & GALAXY_STAT_ALL;
+	pthread_mutex_unlock(&client_watches_mutex);
+
+	return 0;
+}
+
 /*
  * Converts the given pattern into a PCRE and stores it in a global list
  * of galaxy watches.
@@ -285,6 +387,10 @@ add_galaxy_watch(const char *client_name, uint32_t mask, const char *pattern)
 		return -1;
 	}
 
+	/* Appended bytes come with modifications. */
+	if (mask & GAL_TAIL)
+		mask |= IN_MODIFY;
+
 	/* Add a new watch_t into the watches list of the client watch. */
 	watch = create_watch(mask, pattern);
 	if (watch == NULL) {
@@ -325,17 +431,230 @@ add_galaxy_ignore_watch(const char *client_name, uint32_t mask,
 	return 0;
 }
 
+/*
+ * Return Value:
+ *   Returns non-zero if the regexp of `w' matches `path'.
+ */
+static int
+match_path(const struct watch_t *w, const char *path)
+{
+	int ovector[OVECCOUNT];
+
+	return pcre_exec(w->re, w->extra, path, strlen(path), 0, 0, ovector,
+		OVECCOUNT) >= 0;
+}
+
+/*
+ * Return Value:
+ *   Returns non-zero if the regexp of `w' may match a path below the
+ *   directory `prefix', given with a trailing slash. An unanchored
+ *   pattern may match anywhere in a longer path. An anchored one must
+ *   either match the prefix already or run out of subject while matching
+ *   it. Patterns that PCRE can't match partially are assumed to match.
+ */
+static int
+match_below(const struct watch_t *w, const char *prefix, int length)
+{
+	int err, ovector[OVECCOUNT];
+
+	if (!w->anchored)
+		return 1;
+
+	err = pcre_exec(w->re, w->extra, prefix, length, 0, PCRE_PARTIAL,
+		ovector, OVECCOUNT);
+
+	return err >= 0 || err == PCRE_ERROR_PARTIAL ||
+		err == PCRE_ERROR_BADPARTIAL;
+}
+
+/*
+ * Fills in the stat fields of `gevent', relative to a cached descriptor
+ * of its directory. They stay empty if the file is gone.
+ */
+static void
+stat_event(struct galaxy_event_t *gevent)
+{
+	struct stat statbuf;
+
+	if (dirfd_cache_stat(gevent->name, &statbuf) < 0)
+		return;
+
+	gevent->stat.fields = GALAXY_STAT_ALL;
+	gevent->stat.mode = statbuf.st_mode;
+	gevent->stat.size = statbuf.st_size;
+	gevent->stat.ino = statbuf.st_ino;
+	gevent->stat.dev = statbuf.st_dev;
+	gevent->stat.mtime_ns = (int64_t)statbuf.st_mtim.tv_sec * 1000000000LL +
+		statbuf.st_mtim.tv_nsec;
+}
+
+/*
+ * Sends one event to the client listening on `client_name'.
+ *
+ * Return Value:
+ *   Returns -1 if the client couldn't be reached, otherwise zero.
+ */
+int
+galaxy_notify_client(const char *client_name,
+	const struct galaxy_event_t *gevent)
+{
+	return galaxy_notify_client_tail(client_name, gevent, -1);
+}
+
+/*
+ * Like galaxy_notify_client(), sending the bytes the event carries for a
+ * GAL_TAIL watch from the file `file_fd'.
+ */
+int
+galaxy_notify_client_tail(const char *client_name,
+	const struct galaxy_event_t *gevent, int file_fd)
+{
+	int fd;
+
+	fd = cli_conn(client_name);
+	if (fd < 0) {
+#ifdef DEBUG_SEND_NOTIFICATIONS
+		err_msg("warning[galaxy_notify_client]: Unable to obtain client connection to:\n");
+		err_msg("       '%s'. No notification(s) will be sent to this client.\n", client_name);
+#endif
+		return -1;
+	}
+#ifdef DEBUG_SEND_NOTIFICATIONS
+	err_msg("              => Sending galaxy event to client...\n");
+#endif
+	net_send_galaxy_event_tail(fd, gevent, file_fd);
+	close(fd);
+#ifdef DEBUG_SEND_NOTIFICATIONS
+	err_msg("                 + Finished sending galaxy event to client.\n");
+#endif
+
+	return 0;
+}
+
+/*
+ * Sends the GAL_RESCAN event `gevent', about the whole subtree of a
+ * directory, to the client if any of its watches may match below the
+ * directory, whatever events the watch is after.
+ */
+static void
+notify_rescan(const char *client_name, struct client_watch_t *client_watch,
+	const struct galaxy_event_t *gevent)
+{
+	char prefix[4097];
+	int length, ovector[OVECCOUNT];
+	list_node_t *node;
+
+	length = snprintf(prefix, sizeof(prefix), "%s/",
+		strcmp(gevent->name, "/") == 0 ? "" : gevent->name);
+	if (length >= sizeof(prefix))
+		return;
+
+	node = NULL;
+	list_foreach(client_watch->ignore_watches, node) {
+		struct watch_t *w = (struct watch_t *)list_key(node);
+		if (w->closed && pcre_exec(w->re, w->extra, prefix, length, 0, 0,
+		                           ovector, OVECCOUNT) >= 0)
+			return;
+	}
+
+	node = NULL;
+	list_foreach(client_watch->watches, node) {
+		struct watch_t *w = (struct watch_t *)list_key(node);
+		if (match_below(w, prefix, length)) {
+			galaxy_notify_client(client_name, gevent);
+			return;
+		}
+	}
+}
+
+/*
+ * Holds `gevent', with the bytes appended to its file, for the client
+ * `client_name' until send_tails(). Sending them may take long, so it
+ * is not done with the client watches locked.
+ *
+ * Return Value:
+ *   Returns zero on success, or -1 if the event couldn't be held.
+ */
+static int
+queue_tail_send(struct match_data_t *match, const char *client_name,
+	const struct galaxy_event_t *gevent)
+{
+	struct tail_send_t *t;
+
+	if (match->tail_sends == NULL) {
+		match->tail_sends = list_create(free);
+		if (match->tail_sends == NULL) {
+			err_msg("error[queue_tail_send]: Unable to create the send list.\n");
+			return -1;
+		}
+	}
+	t = malloc(sizeof(struct tail_send_t) + strlen(client_name));
+	if (t == NULL) {
+		err_malloc(errno);
+		return -1;
+	}
+	/* The paths belong to the event being matched, which outlives the
+	 * sends. */
+	t->event = *gevent;
+	strcpy(t->client, client_name);
+	if (list_push(match->tail_sends, t) < 0) {
+		free(t);
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Sends the events held by queue_tail_send(). The client watches must
+ * not be locked.
+ */
+static void
+send_tails(struct match_data_t *match)
+{
+	struct tail_send_t *t;
+
+	if (match->tail_sends == NULL)
+		return;
+	while ((t = list_shift(match->tail_sends)) != NULL) {
+		galaxy_notify_client_tail(t->client, &t->event, match->tail.fd);
+		free(t);
+	}
+	list_destroy(match->tail_sends);
+	match->tail_sends = NULL;
+}
+
+/*
+ * Return Value:
+ *   Returns the events a GAL_CHANGED watch sees in `mask': modifications
+ *   are reported on the close-write, and only if the contents changed.
+ */
+static uint32_t
+changed_mask(uint32_t mask, int unchanged)
+{
+	if (!(mask & IN_CLOSE_WRITE))
+		return mask & ~IN_MODIFY;
+	if (unchanged)
+		return mask & ~(IN_CLOSE_WRITE | IN_MODIFY);
+
+	return mask | IN_MODIFY;
+}
+
 static void
 send_notifications(gpointer key, gpointer value, gpointer user_data)
 {
-	int mask;
+	uint32_t mask;
 	char *client_name;
 	struct client_watch_t *client_watch;
-	struct internal_event_t *ievent;
+	struct match_data_t *match;
+	const struct galaxy_event_t *gevent;
+	struct galaxy_event_t event;
+	int summarized = 0;
 
 	client_name = (char *)key;
 	client_watch = (struct client_watch_t *)value;
-	ievent = (struct internal_event_t *)user_data;
+	match = (struct match_data_t *)user_data;
+	gevent = &match->event;
 	list_node_t *node;
 
 #ifdef DEBUG_SEND_NOTIFICATIONS
@@ -347,20 +666,21 @@ send_notifications(gpointer key, gpointer value, gpointer user_data)
 #ifdef DEBUG_SEND_NOTIFICATIONS
 	err_msg("        => Check client ignore mask...\n");
 #endif
-	if ((ievent->mask & IN_ACCESS && client_watch->ignore_mask & IN_ACCESS) ||
-			(ievent->mask & IN_MODIFY && client_watch->ignore_mask & IN_MODIFY) ||
-			(ievent->mask & IN_ATTRIB && client_watch->ignore_mask & IN_ATTRIB) ||
-			(ievent->mask & IN_CLOSE_WRITE && client_watch->ignore_mask & IN_CLOSE_WRITE) ||
-			(ievent->mask & IN_CLOSE_NOWRITE && client_watch->ignore_mask & IN_CLOSE_NOWRITE) ||
-			(ievent->mask & IN_OPEN && client_watch->ignore_mask & IN_OPEN) ||
-			(ievent->mask & IN_MOVED_FROM && client_watch->ignore_mask & IN_MOVED_FROM) ||
-			(ievent->mask & IN_MOVED_TO && client_watch->ignore_mask & IN_MOVED_TO) ||
-			(ievent->mask & IN_CREATE && client_watch->ignore_mask & IN_CREATE) ||
-			(ievent->mask & IN_DELETE && client_watch->ignore_mask & IN_DELETE) ||
-			(ievent->mask & IN_DELETE_SELF && client_watch->ignore_mask & IN_DELETE_SELF) ||
-			(ievent->mask & IN_UNMOUNT && client_watch->ignore_mask & IN_UNMOUNT) ||
-			(ievent->mask & IN_Q_OVERFLOW && client_watch->ignore_mask & IN_Q_OVERFLOW) ||
-			(ievent->mask & IN_IGNORED && client_watch->ignore_mask & IN_IGNORED)) {
+	if ((gevent->mask & IN_ACCESS && client_watch->ignore_mask & IN_ACCESS) ||
+			(gevent->mask & IN_MODIFY && client_watch->ignore_mask & IN_MODIFY) ||
+			(gevent->mask & IN_ATTRIB && client_watch->ignore_mask & IN_ATTRIB) ||
+			(gevent->mask & IN_CLOSE_WRITE && client_watch->ignore_mask & IN_CLOSE_WRITE) ||
+			(gevent->mask & IN_CLOSE_NOWRITE && client_watch->ignore_mask & IN_CLOSE_NOWRITE) ||
+			(gevent->mask & IN_OPEN && client_watch->ignore_mask & IN_OPEN) ||
+			(gevent->mask & IN_MOVED_FROM && client_watch->ignore_mask & IN_MOVED_FROM) ||
+			(gevent->mask & IN_MOVED_TO && client_watch->ignore_mask & IN_MOVED_TO) ||
+			(gevent->mask & IN_CREATE && client_watch->ignore_mask & IN_CREATE) ||
+			(gevent->mask & IN_DELETE && client_watch->ignore_mask & IN_DELETE) ||
+			(gevent->mask & IN_DELETE_SELF && client_watch->ignore_mask & IN_DELETE_SELF) ||
+			(gevent->mask & IN_UNMOUNT && client_watch->ignore_mask & IN_UNMOUNT) ||
+			(gevent->mask & IN_Q_OVERFLOW && client_watch->ignore_mask & IN_Q_OVERFLOW) ||
+			(gevent->mask & IN_IGNORED && client_watch->ignore_mask & IN_IGNORED) ||
+			(gevent->mask & GAL_RESCAN && client_watch->ignore_mask & GAL_RESCAN)) {
 #ifdef DEBUG_SEND_NOTIFICATIONS
 		err_msg("        + Ignoring event based on ignore mask: 0x%x\n",
 			client_watch->ignore_mask);
@@ -368,7 +688,10 @@ send_notifications(gpointer key, gpointer value, gpointer user_data)
 		return;
 	}
 
-	int ovector[OVECCOUNT];
+	if (gevent->mask & GAL_RESCAN) {
+		notify_rescan(client_name, client_watch, gevent);
+		return;
+	}
 
 	/* Check the clients ignore watches for any matches. If any matches
 	 * are found, then no notification will be sent to the client for
@@ -378,11 +701,10 @@ send_notifications(gpointer key, gpointer value, gpointer user_data)
 #endif
 	node = NULL;
 	list_foreach(client_watch->ignore_watches, node) {
-		int err;
 		struct watch_t * w = (struct watch_t *)list_key(node);
-		err = pcre_exec(w->re, w->extra, ievent->filename, 28, 0, 0,
-			ovector, OVECCOUNT);
-		if (err >= 0) {
+		/* A rename is only ignored if both of its paths are. */
+		if (match_path(w, gevent->name) &&
+		    (gevent->old_name == NULL || match_path(w, gevent->old_name))) {
 #ifdef DEBUG_SEND_NOTIFICATIONS
 			err_msg("           + Ignoring event based on an ignore watches regexp.\n");
 #endif
@@ -398,53 +720,95 @@ send_notifications(gpointer key, gpointer value, gpointer user_data)
 #endif
 	node = NULL;
 	list_foreach(client_watch->watches, node) {
-		int err;
 		struct watch_t * w = (struct watch_t *)list_key(node);
+		mask = gevent->mask;
+		if (w->mask & GAL_CHANGED)
+			mask = changed_mask(mask, match->unchanged);
+		/* The offsets of tailed files follow every event on them, once
+		 * per event, whichever events the watch is after. */
+		if (w->mask & GAL_TAIL && !match->tail_taken &&
+		    gevent->mask & TAIL_EVENTS &&
+		    (match_path(w, gevent->name) ||
+		     (gevent->old_name != NULL && match_path(w, gevent->old_name)))) {
+			tail_event(gevent, &match->tail);
+			match->tail_taken = 1;
+		}
 		/* Check if any of the mask bits are set for this watch. Only if at
 		 * least one of them is set do we attempt to use the regular
 		 * expression to match the given filename for this event. */
-		if ((ievent->mask & IN_ACCESS && w->mask & IN_ACCESS) ||
-				(ievent->mask & IN_MODIFY && w->mask & IN_MODIFY) ||
-				(ievent->mask & IN_ATTRIB && w->mask & IN_ATTRIB) ||
-				(ievent->mask & IN_CLOSE_WRITE && w->mask & IN_CLOSE_WRITE) ||
-				(ievent->mask & IN_CLOSE_NOWRITE && w->mask & IN_CLOSE_NOWRITE) ||
-				(ievent->mask & IN_OPEN && w->mask & IN_OPEN) ||
-				(ievent->mask & IN_MOVED_FROM && w->mask & IN_MOVED_FROM) ||
-				(ievent->mask & IN_MOVED_TO && w->mask & IN_MOVED_TO) ||
-				(ievent->mask & IN_CREATE && w->mask & IN_CREATE) ||
-				(ievent->mask & IN_DELETE && w->mask & IN_DELETE) ||
-				(ievent->mask & IN_DELETE_SELF && w->mask & IN_DELETE_SELF) ||
-				(ievent->mask & IN_UNMOUNT && w->mask & IN_UNMOUNT) ||
-				(ievent->mask & IN_Q_OVERFLOW && w->mask & IN_Q_OVERFLOW) ||
-				(ievent->mask & IN_IGNORED && w->mask & IN_IGNORED)) {
+		if ((mask & IN_ACCESS && w->mask & IN_ACCESS) ||
+				(mask & IN_MODIFY && w->mask & IN_MODIFY) ||
+				(mask & IN_ATTRIB && w->mask & IN_ATTRIB) ||
+				(mask & IN_CLOSE_WRITE && w->mask & IN_CLOSE_WRITE) ||
+				(mask & IN_CLOSE_NOWRITE && w->mask & IN_CLOSE_NOWRITE) ||
+				(mask & IN_OPEN && w->mask & IN_OPEN) ||
+				(mask & IN_MOVED_FROM && w->mask & IN_MOVED_FROM) ||
+				(mask & IN_MOVED_TO && w->mask & IN_MOVED_TO) ||
+				(mask & IN_CREATE && w->mask & IN_CREATE) ||
+				(mask & IN_DELETE && w->mask & IN_DELETE) ||
+				(mask & IN_DELETE_SELF && w->mask & IN_DELETE_SELF) ||
+				(mask & IN_UNMOUNT && w->mask & IN_UNMOUNT) ||
+				(mask & IN_Q_OVERFLOW && w->mask & IN_Q_OVERFLOW) ||
+				(mask & IN_IGNORED && w->mask & IN_IGNORED)) {
 			/* At least one mask has matched. Try to match the regexp. */
 #ifdef DEBUG_SEND_NOTIFICATIONS
 			err_msg("           + At least one mask has matched.\n");
 			err_msg("           => Checking if regexp matches this event filename...\n");
 #endif
-			int fd;
-			err = pcre_exec(w->re, w->extra, ievent->filename, 28, 0, 0,
-				ovector, OVECCOUNT);
-			if (err >= 0) { /* Is a match! Ignore error or mismatch. */
+			/* A rename matches on either of its paths. */
+			if (match_path(w, gevent->name) ||
+			    (gevent->old_name != NULL && match_path(w, gevent->old_name))) {
 #ifdef DEBUG_SEND_NOTIFICATIONS
 				err_msg("              + Matched a regexp watch to this event!\n");
 #endif
-				fd = cli_conn(client_name);
-				if (fd < 0) {
-#ifdef DEBUG_SEND_NOTIFICATIONS
-					err_msg("warning[send_notifications]: Unable to obtain client connection to:\n");
-					err_msg("       '%s'. No notification(s) will be sent to this client.\n", client_name);
-#endif
-					return;
+				/* Counted once per client, however many of its
+				 * GAL_SUMMARY watches match. */
+				if (w->mask & GAL_SUMMARY) {
+					if (summarized)
+						continue;
+					event = *gevent;
+					event.mask = mask;
+					if (summary_event(client_name, &event) == 0) {
+						summarized = 1;
+						continue;
+					}
 				}
-#ifdef DEBUG_SEND_NOTIFICATIONS
-				err_msg("              => Sending galaxy event to client...\n");
-#endif
-				net_send_galaxy_event(fd, ievent->filename, ievent->mask);
-				close(fd);
-#ifdef DEBUG_SEND_NOTIFICATIONS
-				err_msg("                 + Finished sending galaxy event to client.\n");
-#endif
+				/* The file is stat'ed once for all the clients that
+				 * want it, and each one gets the fields it asked for. */
+				if (w->mask & GAL_STAT && !match->stat_taken) {
+					stat_event(&match->event);
+					match->stat_taken = 1;
+				}
+				event = *gevent;
+				event.mask = mask;
+				if (w->mask & GAL_STAT)
+					event.stat.fields &= client_watch->stat_fields;
+				else
+					event.stat.fields = 0;
+				if (!(w->mask & GAL_DIGEST))
+					event.digest_len = 0;
+				/* Appended bytes are only taken once, so they are sent
+				 * right away rather than held. */
+				if (w->mask & GAL_TAIL && event.mask & IN_MODIFY &&
+				    match->tail.fd >= 0) {
+					event.tail_offset = match->tail.offset;
+					event.tail_flags = match->tail.flags;
+					event.tail_len = match->tail.len;
+					if (queue_tail_send(match, client_name, &event) < 0)
+						return;
+					continue;
+				}
+				/* Held back and merged with the next ones. Renames
+				 * carry two paths and are always sent as they are. */
+				if (w->mask & GAL_SETTLE && event.old_name == NULL &&
+				    settle_event(client_name, &event,
+				                 client_watch->settle_period) == 0)
+					continue;
+				if (w->mask & GAL_COALESCE && event.old_name == NULL &&
+				    coalesce_event(client_name, &event) == 0)
+					continue;
+				if (galaxy_notify_client(client_name, &event) < 0)
+					return;
 			}
 		}
 	}
@@ -453,19 +817,319 @@ send_notifications(gpointer key, gpointer value, gpointer user_data)
 void
 find_matching_events(const char *filename, uint32_t mask)
 {
-	struct internal_event_t ievent;
+	find_matching_events_pid(filename, mask, 0);
+}
+
+/*
+ * Like find_matching_events(), for backends that know which process
+ * caused the event. The pid is passed on to the clients. Events that
+ * don't come from the kernel (crawls, rescans, polling) are stamped
+ * here.
+ */
+void
+find_matching_events_pid(const char *filename, uint32_t mask, pid_t pid)
+{
+	struct galaxy_event_t gevent;
+	struct event_stamp_t stamp;
+
+	stamp_events(&stamp, 1);
+	memset(&gevent, 0, sizeof(gevent));
+	gevent.mask = mask;
+	gevent.name = (char *)filename;
+	gevent.pid = pid;
+	gevent.sequence = stamp.sequence;
+	gevent.monotonic_ns = stamp.monotonic_ns;
+	gevent.realtime_ns = stamp.realtime_ns;
+	find_matching_event(&gevent);
+}
+
+/* The path asked about by digest_wanted(), and the DIGEST_* its
+ * close-write is wanted with. */
+struct digest_query_t {
+	const char *path;
+	int wanted;
+} digest_query_t;
+
+static void
+check_digest(gpointer key, gpointer value, gpointer user_data)
+{
+	struct client_watch_t *client_watch = value;
+	struct digest_query_t *query = user_data;
+	list_node_t *node;
+
+	if (client_watch->ignore_mask & IN_CLOSE_WRITE)
+		return;
+	node = NULL;
+	list_foreach(client_watch->watches, node) {
+		struct watch_t *w = (struct watch_t *)list_key(node);
+		int wanted = 0;
+
+		if (w->mask & GAL_DIGEST && w->mask & IN_CLOSE_WRITE)
+			wanted |= DIGEST_CONTENT;
+		if (w->mask & GAL_CHANGED && w->mask & (IN_CLOSE_WRITE | IN_MODIFY))
+			wanted |= DIGEST_FINGERPRINT;
+		if ((wanted & ~query->wanted) != 0 && match_path(w, query->path))
+			query->wanted |= wanted;
+	}
+}
+
+/*
+ * Return Value:
+ *   Returns the DIGEST_* the GAL_DIGEST and GAL_CHANGED watches want the
+ *   close-write event on `path' with, or zero.
+ */
+static int
+digest_wanted(const char *path)
+{
+	struct digest_query_t query;
+
+	query.path = path;
+	query.wanted = 0;
+	pthread_mutex_lock(&client_watches_mutex);
+	g_hash_table_foreach(client_watches, check_digest, &query);
+	pthread_mutex_unlock(&client_watches_mutex);
+
+	return query.wanted;
+}
+
+/*
+ * Sends `gevent' to every client with a watch that matches it. This is
+ * the general form of find_matching_events(), for events that carry
+ * more than a path and a mask.
+ *
+ * A close-write a GAL_DIGEST or GAL_CHANGED watch wants is handed to
+ * the hashing pool first, which passes it on to
+ * find_matching_event_digested(); it may reach the clients after events
+ * read later.
+ */
+void
+find_matching_event(const struct galaxy_event_t *gevent)
+{
+	struct galaxy_event_t event;
+	int wanted;
+
+	/* Contents that went away or moved start over. */
+	if (gevent->mask & (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO)) {
+		digest_forget(gevent->name);
+		if (gevent->old_name != NULL)
+			digest_forget(gevent->old_name);
+	}
+
+	event = *gevent;
+	event.digest_len = 0;
+	if (event.mask & IN_CLOSE_WRITE && event.old_name == NULL) {
+		wanted = digest_wanted(event.name);
+		if (wanted != 0 && digest_event(&event, wanted) == 0)
+			return;
+	}
+
+	find_matching_event_digested(&event, 0);
+}
+
+/*
+ * Sends `gevent', with whatever digest it carries, to every client
+ * with a watch that matches it. `unchanged' tells GAL_CHANGED watches
+ * that a close-write left the contents as they were.
+ */
+void
+find_matching_event_digested(const struct galaxy_event_t *gevent,
+	int unchanged)
+{
+	struct match_data_t match;
 
-	ievent.mask = mask;
-	ievent.filename = filename;
+	match.event = *gevent;
+	memset(&match.event.stat, 0, sizeof(match.event.stat));
+	match.stat_taken = 0;
+	match.unchanged = unchanged;
+	match.tail_taken = 0;
+	match.tail.fd = -1;
+	match.tail_sends = NULL;
 
 #ifdef DEBUG_FIND_MATCHING_EVENTS
 	err_msg("  => DEBUG[find_matching_events]: Searching for matching events...\n");
 #endif
 	pthread_mutex_lock(&client_watches_mutex);
-	g_hash_table_foreach(client_watches, send_notifications, &ievent);
+	g_hash_table_foreach(client_watches, send_notifications, &match);
+	pthread_mutex_unlock(&client_watches_mutex);
+	send_tails(&match);
+	tail_release(&match.tail);
+}
+
+static void
+check_subtree(gpointer key, gpointer value, gpointer user_data)
+{
+	struct client_watch_t *client_watch;
+	struct subtree_query_t *query;
+	list_node_t *node;
+	int ovector[OVECCOUNT];
+
+	client_watch = (struct client_watch_t *)value;
+	query = (struct subtree_query_t *)user_data;
+
+	/* An ignore watch that already matches the directory prefix, and
+	 * keeps matching however the path is extended, hides the whole
+	 * subtree from this client. */
+	node = NULL;
+	list_foreach(client_watch->ignore_watches, node) {
+		struct watch_t *w = (struct watch_t *)list_key(node);
+		if (w->closed && pcre_exec(w->re, w->extra, query->prefix,
+		                           query->length, 0, 0, ovector, OVECCOUNT) >= 0)
+			return;
+	}
+
+	node = NULL;
+	list_foreach(client_watch->watches, node) {
+		uint32_t mask;
+		struct watch_t *w = (struct watch_t *)list_key(node);
+
+		/* Skip watches that can't add anything new, including those
+		 * whose events are all in the client's ignore mask. */
+		mask = w->mask & ~GAL_OPTIONS & ~client_watch->ignore_mask;
+		/* GAL_CHANGED watches learn of modifications on close. */
+		if (w->mask & GAL_CHANGED && mask & IN_MODIFY)
+			mask |= IN_CLOSE_WRITE & ~client_watch->ignore_mask;
+		/* GAL_TAIL watches follow files being replaced. */
+		if (w->mask & GAL_TAIL)
+			mask |= TAIL_EVENTS & ~client_watch->ignore_mask;
+		if (mask == 0 ||
+		    ((mask & ~query->mask) == 0 && (!w->anchored || query->explicit)))
+			continue;
+
+		if (!match_below(w, query->prefix, query->length))
+			continue;
+		if (w->anchored)
+			query->explicit = 1;
+		query->mask |= mask;
+	}
+}
+
+/*
+ * Computes which events any client subscription could match on an
+ * entry below the directory `dirname', i.e. the union of the masks of
+ * the watches that may match there. The answer is conservative: it may
+ * include events nobody ends up matching, but never leaves out one that
+ * somebody would.
+ *
+ * Since events under a directory are always reported as "dirname/..."
+ * the prefix also covers every subdirectory, so a directory that nobody
+ * wants can be skipped together with everything below it.
+ *
+ * If `explicit' isn't NULL it tells whether an anchored watch, i.e. one
+ * naming a particular part of the tree, may match below the directory.
+ *
+ * Return Value:
+ *   Returns the event mask, or zero if no subscription can match below
+ *   the directory.
+ */
+uint32_t
+galaxy_subtree_mask(const char *dirname, int *explicit)
+{
+	struct subtree_query_t query;
+	char prefix[4098];
+	size_t len;
+
+	len = strlen(dirname);
+	if (len + 2 > sizeof(prefix))
+		return ~0U;
+	memcpy(prefix, dirname, len);
+	if (len == 0 || prefix[len - 1] != '/')
+		prefix[len++] = '/';
+	prefix[len] = '\0';
+
+	query.prefix = prefix;
+	query.length = len;
+	query.mask = 0;
+	query.explicit = explicit == NULL;  /* Nothing to find out. */
+
+	pthread_mutex_lock(&client_watches_mutex);
+	g_hash_table_foreach(client_watches, check_subtree, &query);
+	pthread_mutex_unlock(&client_watches_mutex);
+
+	if (explicit != NULL)
+		*explicit = query.explicit;
+	return query.mask;
+}
+
+static void
+compare_subtrees(gpointer key, gpointer value, gpointer user_data)
+{
+	struct client_watch_t *client_watch;
+	struct subtree_pair_t *pair;
+	list_node_t *node;
+	int ovector[OVECCOUNT];
+
+	client_watch = (struct client_watch_t *)value;
+	pair = (struct subtree_pair_t *)user_data;
+	if (pair->differs)
+		return;
+
+	/* See check_subtree() for how each kind of watch is matched. */
+	node = NULL;
+	list_foreach(client_watch->ignore_watches, node) {
+		struct watch_t *w = (struct watch_t *)list_key(node);
+		if (w->closed &&
+		    (pcre_exec(w->re, w->extra, pair->a, pair->a_length, 0, 0,
+		               ovector, OVECCOUNT) >= 0) !=
+		    (pcre_exec(w->re, w->extra, pair->b, pair->b_length, 0, 0,
+		               ovector, OVECCOUNT) >= 0)) {
+			pair->differs = 1;
+			return;
+		}
+	}
+
+	node = NULL;
+	list_foreach(client_watch->watches, node) {
+		struct watch_t *w = (struct watch_t *)list_key(node);
+		if (match_below(w, pair->a, pair->a_length) !=
+		    match_below(w, pair->b, pair->b_length)) {
+			pair->differs = 1;
+			return;
+		}
+	}
+}
+
+/*
+ * Tells whether any client subscription matches differently below the
+ * directory `a' than below `b', as far as galaxy_subtree_mask() can
+ * tell from the prefixes alone. Used when a directory is moved from `a'
+ * to `b', since only then may it need more or other watches below it.
+ *
+ * Return Value:
+ *   Returns non-zero if some subscription tells the two apart.
+ */
+int
+galaxy_subtree_differs(const char *a, const char *b)
+{
+	struct subtree_pair_t pair;
+	char a_prefix[4098], b_prefix[4098];
+	size_t len;
+
+	len = strlen(a);
+	if (len + 2 > sizeof(a_prefix))
+		return 1;
+	memcpy(a_prefix, a, len);
+	if (len == 0 || a_prefix[len - 1] != '/')
+		a_prefix[len++] = '/';
+	a_prefix[len] = '\0';
+	pair.a = a_prefix;
+	pair.a_length = len;
+
+	len = strlen(b);
+	if (len + 2 > sizeof(b_prefix))
+		return 1;
+	memcpy(b_prefix, b, len);
+	if (len == 0 || b_prefix[len - 1] != '/')
+		b_prefix[len++] = '/';
+	b_prefix[len] = '\0';
+	pair.b = b_prefix;
+	pair.b_length = len;
+
+	pair.differs = 0;
+	pthread_mutex_lock(&client_watches_mutex);
+	g_hash_table_foreach(client_watches, compare_subtrees, &pair);
 	pthread_mutex_unlock(&client_watches_mutex);
 
-	return;
+	return pair.differs;
 }
 
 /*
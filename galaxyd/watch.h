@@ -29,6 +29,12 @@
 #  include <inttypes.h>
 #endif
 
+#if HAVE_SYS_TYPES_H
+#  include <sys/types.h>
+#endif
+
+struct galaxy_event_t;
+
 /* Initialization and destruction routines -- called once on
  * startup/shutdown. */
 int init_client_watches_container(void);
@@ -36,6 +42,8 @@ void destroy_client_watches_container(void);
 
 /* Functions to manipulate the various watch lists. */
 int set_galaxy_ignore_mask(const char *client_name, uint32_t ignore_mask);
+int set_galaxy_settle_period(const char *client_name, uint32_t period);
+int set_galaxy_stat_fields(const char *client_name, uint32_t fields);
 int add_galaxy_watch(const char *client_name, uint32_t mask,
 	const char *pattern);
 int add_galaxy_ignore_watch(const char *client_name, uint32_t mask,
@@ -43,6 +51,18 @@ int add_galaxy_ignore_watch(const char *client_name, uint32_t mask,
 
 /* Functions to manipulate all entries for a client. */
 void find_matching_events(const char *filename, uint32_t mask);
+void find_matching_events_pid(const char *filename, uint32_t mask, pid_t pid);
+void find_matching_event(const struct galaxy_event_t *gevent);
+void find_matching_event_digested(const struct galaxy_event_t *gevent,
+	int unchanged);
+int galaxy_notify_client(const char *client_name,
+	const struct galaxy_event_t *gevent);
+int galaxy_notify_client_tail(const char *client_name,
+	const struct galaxy_event_t *gevent, int file_fd);
 int remove_galaxy_watches(const char *client_name);
 
+/* Events any subscription can match below a directory. */
+uint32_t galaxy_subtree_mask(const char *dirname, int *explicit);
+int galaxy_subtree_differs(const char *a, const char *b);
+
 #endif
@@ -0,0 +1,628 @@
+/*
+ * Galaxy - A filesystem monitoring tool.
+ * Copyright (C) 2005  Gabriel Munoz <gabriel@xusia.net>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ */
+
+#if HAVE_CONFIG_H
+#  include <config.h>
+#endif
+
+#if HAVE_STDLIB_H
+#  include <stdlib.h>
+#endif
+
+#include <stdio.h>
+#include <time.h>
+
+#if HAVE_STRING_H
+#  include <string.h>
+#endif
+
+#if HAVE_PTHREAD_H
+#  include <pthread.h>
+#endif
+
+#if HAVE_ERRNO_H
+#  include <errno.h>
+#endif
+
+#if HAVE_LIBGLIB_2_0
+#  include <glib.h>
+#endif
+
+#include "watch_budget.h"
+#include "dir_tree.h"
+#include "listing.h"
+#include "inotify.h"
+#include "inotify_utils.h"
+#include "crawler_thread.h"
+#include "thread_pool.h"
+#include "watch.h"
+#include "prune.h"
+#include "fs_policy.h"
+#include "error.h"
+
+#define PROC_INOTIFY_DIR "/proc/sys/fs/inotify/"
+
+#define POLL_INTERVAL   30   /* Seconds between polling scans. */
+#define EVICT_MIN       16   /* Fewest watches evicted in one go. */
+#define RELEVANCE_SECS  60   /* Worth of each subscribed event type. */
+
+extern thread_pool_t workers;
+
+/* Protects the budget and the poll roots. Taken after the tree lock. */
+static pthread_mutex_t budget_mutex = PTHREAD_MUTEX_INITIALIZER;
+static unsigned long max_user_watches = 0;
+static unsigned long budget = 0;
+static int budget_warned = 0;
+
+/* Evicted subtrees, keyed on their path, and when they were last
+ * polled. */
+static GHashTable *poll_roots = NULL;
+static int poll_queued = 0;
+static time_t last_poll = 0;
+
+/* Cached listings of polled directories. Only used by the poll job,
+ * which is serialized by the poll mutex. */
+static pthread_mutex_t poll_mutex = PTHREAD_MUTEX_INITIALIZER;
+static GHashTable *listings = NULL;
+
+struct poll_root_t {
+	int baseline;   /* First scan only records what is there. */
+	char path[1];
+} poll_root_t;
+
+struct poll_dir_t {
+	const char *dirname;
+	int baseline;
+} poll_dir_t;
+
+static long
+read_proc_value(const char *name)
+{
+	char path[256];
+	FILE *fp;
+	long value;
+
+	snprintf(path, sizeof(path), "%s%s", PROC_INOTIFY_DIR, name);
+	fp = fopen(path, "r");
+	if (fp == NULL)
+		return -1;
+	if (fscanf(fp, "%ld", &value) != 1)
+		value = -1;
+	fclose(fp);
+
+	return value;
+}
+
+/*
+ * Reads the inotify limits and sets the watch budget. Some headroom is
+ * left for other inotify users running as the same user.
+ *
+ * Return Value:
+ *   Returns -1 on error, otherwise zero.
+ */
+int
+init_watch_budget(void)
+{
+	long value;
+
+	value = read_proc_value("max_user_watches");
+	if (value > 0) {
+		max_user_watches = value;
+		budget = max_user_watches - max_user_watches / 16;
+	} else {
+		/* Unknown limit: find out from ENOSPC. */
+		budget = (unsigned long)-1;
+	}
+
+	/* The key is the path inside the value. */
+	poll_roots = g_hash_table_new_full(g_str_hash, g_str_equal, NULL, free);
+	listings = g_hash_table_new_full(g_str_hash, g_str_equal, free,
+		(GDestroyNotify)listing_destroy);
+	if (poll_roots == NULL || listings == NULL) {
+		err_msg("error[init_watch_budget]: Unable to create poll tables.\n");
+		return -1;
+	}
+
+#ifdef DEBUG_WATCH_BUDGET
+	err_msg("DEBUG[init_watch_budget]: max_user_watches = %lu, budget = %lu\n",
+		max_user_watches, budget);
+	err_msg("  + max_user_instances = %ld\n", read_proc_value("max_user_instances"));
+	err_msg("  + max_queued_events = %ld\n", read_proc_value("max_queued_events"));
+#endif
+
+	return 0;
+}
+
+void
+destroy_watch_budget(void)
+{
+	g_hash_table_destroy(poll_roots);
+	g_hash_table_destroy(listings);
+}
+
+/*
+ * Returns the number of watches the daemon allows itself.
+ */
+unsigned long
+watch_budget_limit(void)
+{
+	unsigned long n;
+
+	pthread_mutex_lock(&budget_mutex);
+	n = budget;
+	pthread_mutex_unlock(&budget_mutex);
+
+	return n;
+}
+
+/*
+ * Directories are ranked by when they last saw an event, with each
+ * subscribed event type counting as a minute of extra activity.
+ */
+static time_t
+warmth(const struct dir_node_t *node)
+{
+	return node->active + RELEVANCE_SECS *
+		__builtin_popcount(node->mask & ~GALAXY_INTERNAL_EVENTS);
+}
+
+static int
+compare_cold(const void *a, const void *b)
+{
+	time_t wa, wb;
+
+	wa = warmth(*(struct dir_node_t * const *)a);
+	wb = warmth(*(struct dir_node_t * const *)b);
+
+	return wa < wb ? -1 : wa > wb;
+}
+
+/*
+ * Collects the watched nodes below `node' that have no watched
+ * descendants. Only those are evicted, so every evicted subtree is
+ * contiguous and can be polled as a whole.
+ *
+ * Return Value:
+ *   Returns 1 if `node' or anything below it is watched.
+ */
+static int
+collect_leaves(struct dir_node_t *node, struct dir_node_t **leaves,
+	unsigned long *n, unsigned long max)
+{
+	struct dir_node_t *child;
+	int watched = 0;
+
+	for (child = node->children; child != NULL; child = child->next)
+		watched |= collect_leaves(child, leaves, n, max);
+
+	if (node->wd < 0)
+		return watched;
+	if (!watched && *n < max)
+		leaves[(*n)++] = node;
+
+	return 1;
+}
+
+/*
+ * Drops the watches of the `count' coldest leaf directories and hands
+ * them over to the poller.
+ *
+ * Return Value:
+ *   Returns the number of watches evicted.
+ */
+static unsigned long
+evict_cold(unsigned long count)
+{
+	struct dir_node_t **leaves, *root;
+	unsigned long i, n, max;
+	list_t *paths;
+	list_node_t *node;
+
+	paths = list_create(free);
+	if (paths == NULL)
+		return 0;
+
+	dir_tree_lock();
+	max = dir_tree_watches();
+	leaves = malloc(sizeof(struct dir_node_t *) * (max + 1));
+	if (leaves == NULL) {
+		err_malloc(errno);
+		dir_tree_unlock();
+		list_destroy(paths);
+		return 0;
+	}
+	n = 0;
+	root = dir_tree_lookup("/");
+	if (root != NULL)
+		collect_leaves(root, leaves, &n, max);
+	qsort(leaves, n, sizeof(struct dir_node_t *), compare_cold);
+
+	if (count > n)
+		count = n;
+	for (i = 0; i < count; i++) {
+		char *path = strdup(dir_node_path(leaves[i], NULL));
+		if (path == NULL || list_push(paths, path) < 0) {
+			free(path);
+			break;
+		}
+		galaxy_remove_subtree(leaves[i], 1);
+	}
+	dir_tree_unlock();
+	free(leaves);
+
+	node = NULL;
+	list_foreach(paths, node)
+		watch_budget_poll(list_key(node), 1);
+	count = list_size(paths);
+	list_destroy(paths);
+
+	err_msg("warning[evict_cold]: Watch budget of %lu reached. Polling %lu cold directories instead.\n",
+		watch_budget_limit(), count);
+
+	return count;
+}
+
+static unsigned long
+evict_batch(void)
+{
+	unsigned long n;
+
+	n = watch_budget_limit() / 64;
+	if (n < EVICT_MIN)
+		n = EVICT_MIN;
+
+	return evict_cold(n);
+}
+
+/*
+ * Makes room for one more watch, evicting cold directories if the budget
+ * is used up. Must be called without the tree lock.
+ *
+ * Return Value:
+ *   Returns -1 if there is no room and nothing could be evicted,
+ *   otherwise zero.
+ */
+int
+watch_budget_reserve(void)
+{
+	unsigned long n;
+
+	dir_tree_lock();
+	n = dir_tree_watches();
+	dir_tree_unlock();
+
+	if (n < watch_budget_limit())
+		return 0;
+
+	return evict_batch() > 0 ? 0 : -1;
+}
+
+/*
+ * Called when inotify_add_watch() failed with ENOSPC. Other processes
+ * use the same per-user limit, so the budget is lowered to what the
+ * daemon has now and a batch of cold directories is evicted. Must be
+ * called without the tree lock.
+ *
+ * Return Value:
+ *   Returns the number of watches freed.
+ */
+int
+watch_budget_exhausted(void)
+{
+	unsigned long n;
+
+	dir_tree_lock();
+	n = dir_tree_watches();
+	dir_tree_unlock();
+
+	pthread_mutex_lock(&budget_mutex);
+	if (n < budget)
+		budget = n;
+	if (!budget_warned) {
+		err_msg("warning[watch_budget_exhausted]: Out of inotify watches at %lu (max_user_watches = %lu).\n",
+			n, max_user_watches);
+		budget_warned = 1;
+	}
+	pthread_mutex_unlock(&budget_mutex);
+
+	return evict_batch();
+}
+
+static int
+is_below(const char *path, const char *dirname)
+{
+	size_t len = strlen(dirname);
+
+	if (strncmp(path, dirname, len) != 0)
+		return 0;
+	return path[len] == '\0' || path[len] == '/' ||
+		(len > 0 && dirname[len - 1] == '/');
+}
+
+static gboolean
+below_listing(gpointer key, gpointer value, gpointer user_data)
+{
+	return is_below(key, user_data);
+}
+
+/* Forgets the cached listings of `dirname' and everything below it. */
+static void
+drop_listings(const char *dirname)
+{
+	g_hash_table_foreach_remove(listings, below_listing, (gpointer)dirname);
+}
+
+static gboolean
+below_root(gpointer key, gpointer value, gpointer user_data)
+{
+	return is_below(key, user_data);
+}
+
+static void poll_dir(const char *dirname, int baseline);
+
+static void
+report_change(const char *name, uint32_t mask, void *data)
+{
+	char path[4097];
+
+	snprintf(path, sizeof(path), "%s%s%s", (char *)data,
+		strcmp(data, "/") == 0 ? "" : "/", name);
+	find_matching_events(path, mask);
+	if (mask & IN_DELETE && mask & IN_ISDIR)
+		drop_listings(path);
+}
+
+static void
+poll_subdir(const char *name, void *data)
+{
+	struct poll_dir_t *parent = data;
+	struct dir_node_t *node;
+	char path[4097];
+	int watched;
+
+	snprintf(path, sizeof(path), "%s%s%s", parent->dirname,
+		strcmp(parent->dirname, "/") == 0 ? "" : "/", name);
+
+	/* Watched parts of the subtree report for themselves. */
+	dir_tree_lock();
+	node = dir_tree_lookup(path);
+	watched = node != NULL && node->wd >= 0;
+	dir_tree_unlock();
+	if (watched || prune_match(path) || !fs_policy_allows(path, NULL) ||
+	    galaxy_watch_mask(path) == 0)
+		return;
+
+	poll_dir(path, parent->baseline);
+}
+
+/*
+ * Lists `dirname', reports what changed since the previous scan, and
+ * descends into its subdirectories. Directories seen for the first time
+ * are either recorded silently (`baseline') or reported as created.
+ */
+static void
+poll_dir(const char *dirname, int baseline)
+{
+	struct poll_dir_t pdir;
+	listing_t old, new;
+	char *key;
+
+	new = listing_read(dirname);
+	if (new == NULL) {
+		drop_listings(dirname);
+		return;
+	}
+
+	old = g_hash_table_lookup(listings, dirname);
+	if (old != NULL || !baseline)
+		listing_diff(old, new, report_change, (void *)dirname);
+
+	key = strdup(dirname);
+	if (key == NULL) {
+		err_malloc(errno);
+		listing_destroy(new);
+		return;
+	}
+	g_hash_table_replace(listings, key, new);
+
+	pdir.dirname = key;
+	pdir.baseline = baseline;
+	listing_foreach_dir(new, poll_subdir, &pdir);
+}
+
+static struct poll_root_t *
+create_poll_root(const char *path, int baseline)
+{
+	struct poll_root_t *root;
+
+	root = malloc(sizeof(struct poll_root_t) + strlen(path));
+	if (root == NULL) {
+		err_malloc(errno);
+		err_msg("error[create_poll_root]: Unable to malloc a poll root.\n");
+		return NULL;
+	}
+	root->baseline = baseline;
+	strcpy(root->path, path);
+
+	return root;
+}
+
+static void
+copy_root(gpointer key, gpointer value, gpointer user_data)
+{
+	struct poll_root_t *root = value, *copy;
+
+	/* The baseline is only taken once. */
+	copy = create_poll_root(root->path, root->baseline);
+	root->baseline = 0;
+	if (copy != NULL && list_push(user_data, copy) < 0)
+		free(copy);
+}
+
+static void
+drop_root(const char *dirname)
+{
+	pthread_mutex_lock(&budget_mutex);
+	g_hash_table_remove(poll_roots, dirname);
+	pthread_mutex_unlock(&budget_mutex);
+	drop_listings(dirname);
+}
+
+/*
+ * Worker pool job that scans every polled subtree for changes. Once the
+ * daemon is comfortably below its budget again, one subtree per run is
+ * handed back to inotify.
+ */
+static void
+poll_job(void *arg)
+{
+	list_t *roots;
+	list_node_t *node;
+	unsigned long watches;
+	char *readmit = NULL;
+
+	roots = list_create(free);
+	pthread_mutex_lock(&budget_mutex);
+	poll_queued = 0;
+	if (roots != NULL)
+		g_hash_table_foreach(poll_roots, copy_root, roots);
+	pthread_mutex_unlock(&budget_mutex);
+	if (roots == NULL)
+		return;
+
+	pthread_mutex_lock(&poll_mutex);
+	node = NULL;
+	list_foreach(roots, node) {
+		struct poll_root_t *root = list_key(node);
+
+		/* Nobody wants it anymore. */
+		if (galaxy_watch_mask(root->path) == 0) {
+			drop_root(root->path);
+			continue;
+		}
+		poll_dir(root->path, root->baseline);
+		if (readmit == NULL)
+			readmit = root->path;
+	}
+
+	dir_tree_lock();
+	watches = dir_tree_watches();
+	dir_tree_unlock();
+	if (readmit != NULL && watches < watch_budget_limit() / 8 * 7) {
+		drop_root(readmit);
+		rewatch_subtree(readmit);
+	}
+	pthread_mutex_unlock(&poll_mutex);
+
+	list_destroy(roots);
+}
+
+static void
+schedule_poll(int now)
+{
+	time_t t;
+	int submit = 0;
+
+	t = time(NULL);
+	pthread_mutex_lock(&budget_mutex);
+	if (!poll_queued && g_hash_table_size(poll_roots) > 0 &&
+	    (now || t - last_poll >= POLL_INTERVAL)) {
+		poll_queued = 1;
+		last_poll = t;
+		submit = 1;
+	}
+	pthread_mutex_unlock(&budget_mutex);
+
+	if (submit && thread_pool_submit(workers, poll_job, NULL) < 0) {
+		pthread_mutex_lock(&budget_mutex);
+		poll_queued = 0;
+		pthread_mutex_unlock(&budget_mutex);
+	}
+}
+
+/*
+ * Puts the subtree at `dirname' under polling instead of inotify. With
+ * `baseline' set the first scan only records what is there (the subtree
+ * was watched until now); otherwise everything found is reported as
+ * created, as scan_new_directory() would.
+ *
+ * Return Value:
+ *   Returns -1 on error, otherwise zero.
+ */
+int
+watch_budget_poll(const char *dirname, int baseline)
+{
+	struct poll_root_t *root;
+
+	if (watch_budget_is_polled(dirname))
+		return 0;
+
+	root = create_poll_root(dirname, baseline);
+	if (root == NULL)
+		return -1;
+	pthread_mutex_lock(&budget_mutex);
+	/* A parent that gets evicted after its children covers them. */
+	g_hash_table_foreach_remove(poll_roots, below_root, root->path);
+	g_hash_table_replace(poll_roots, root->path, root);
+	pthread_mutex_unlock(&budget_mutex);
+
+	schedule_poll(1);
+
+	return 0;
+}
+
+/*
+ * Tells whether `path' is in a polled subtree.
+ */
+int
+watch_budget_is_polled(const char *path)
+{
+	char buf[4097], *slash;
+	int polled = 0;
+
+	if (strlen(path) >= sizeof(buf))
+		return 0;
+	strcpy(buf, path);
+
+	pthread_mutex_lock(&budget_mutex);
+	while (g_hash_table_size(poll_roots) > 0) {
+		if (g_hash_table_lookup(poll_roots, buf) != NULL) {
+			polled = 1;
+			break;
+		}
+		slash = strrchr(buf, '/');
+		if (slash == NULL || (slash == buf && buf[1] == '\0'))
+			break;
+		slash[slash == buf ? 1 : 0] = '\0';
+	}
+	pthread_mutex_unlock(&budget_mutex);
+
+	return polled;
+}
+
+/*
+ * Called by the inotify watcher thread every time it wakes up. Queues a
+ * polling scan when one is due.
+ */
+void
+watch_budget_tick(void)
+{
+	schedule_poll(0);
+}
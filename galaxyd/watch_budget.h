@@ -0,0 +1,42 @@
+/*
+ * Galaxy - A filesystem monitoring tool.
+ * Copyright (C) 2005  Gabriel Munoz <gabriel@xusia.net>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ */
+
+#ifndef WATCH_BUDGET_H
+#define WATCH_BUDGET_H
+
+#if HAVE_CONFIG_H
+#  include <config.h>
+#endif
+
+/* Initialization and destruction routines -- called once on
+ * startup/shutdown. */
+int init_watch_budget(void);
+void destroy_watch_budget(void);
+
+unsigned long watch_budget_limit(void);
+int watch_budget_reserve(void);
+int watch_budget_exhausted(void);
+
+/* Directories that couldn't keep (or get) a watch are polled. */
+int watch_budget_poll(const char *dirname, int baseline);
+int watch_budget_is_polled(const char *path);
+void watch_budget_tick(void);
+
+#endif
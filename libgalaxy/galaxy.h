@@ -23,6 +23,7 @@
 
 #include <inttypes.h>
 #include <time.h>
+#include <sys/types.h>
 #include <sys/inotify.h>
 
 #define GALAXY_MAJOR     0
@@ -39,6 +40,10 @@
 #define GALAXY_IGNORE_MASK   2
 #define GALAXY_IGNORE_WATCH  3
 #define GALAXY_EXIT          4
+#define GALAXY_WAIT_READY    5
+#define GALAXY_CRAWL_STATUS  6
+#define GALAXY_SETTLE_PERIOD 7
+#define GALAXY_STAT_FIELDS   8
 
 #define ACK_LENGTH       4
 #define ACK_SUCCESS      1
@@ -58,6 +63,7 @@
 #define GAL_DELETE_SELF    0x00000400  /* Self was deleted */
 
 /* the following are legal events.  they are sent as needed to any watch */
+#define GAL_RESCAN     0x00001000  /* Events in the dir's subtree were summarized */
 #define GAL_UNMOUNT    0x00002000  /* Backing fs was unmounted */
 #define GAL_Q_OVERFLOW   0x00004000  /* Event queued overflowed */
 #define GAL_IGNORED    0x00008000  /* File was ignored */
@@ -66,10 +72,73 @@
 #define GAL_CLOSE    (GAL_CLOSE_WRITE | GAL_CLOSE_NOWRITE) /* close */
 #define GAL_MOVE     (GAL_MOVED_FROM | GAL_MOVED_TO) /* moves */
 
+/* A rename within the watched tree is sent as a single event with both
+ * GAL_MOVE bits set: `name' is the new path and `old_name' the old one.
+ * A file moved out of the watched tree is sent as a GAL_DELETE and one
+ * moved in as a GAL_CREATE. */
+
 /* special flags */
 #define GAL_ISDIR    0x40000000  /* event occurred against dir */
 #define GAL_ONESHOT    0x80000000  /* only send event once */
 
+/* A GAL_RESCAN event names a directory whose subtree had more events
+ * than the daemon could send one by one (see galaxyd -t). Events below
+ * it were dropped until the flood was over; clients that care read the
+ * directory again. It goes to every client with a watch that may match
+ * below the directory. */
+
+/* Subscription options, or-ed into the mask passed to galaxy_watch().
+ * They change how the matching events are delivered, and are never
+ * set on an event. */
+#define GAL_COALESCE   0x00010000  /* Merge repeats on a path (see galaxyd -c) */
+#define GAL_SETTLE     0x00020000  /* One event once a path goes quiet */
+#define GAL_STAT       0x00040000  /* Attach the file's stat(2) fields */
+#define GAL_DIGEST     0x00080000  /* Attach a content digest on close-write */
+#define GAL_CHANGED    0x00100000  /* Only modifications that change contents */
+#define GAL_TAIL       0x00200000  /* Send the bytes appended to the file */
+#define GAL_SUMMARY    0x00400000  /* Periodic counts per directory instead */
+
+#define GAL_OPTIONS    (GAL_COALESCE | GAL_SETTLE | GAL_STAT | GAL_DIGEST | \
+                        GAL_CHANGED | GAL_TAIL | GAL_SUMMARY)
+
+/* The stat(2) fields attached to the events of GAL_STAT watches; see
+ * galaxy_stat_fields(). */
+#define GALAXY_STAT_SIZE    0x00000001
+#define GALAXY_STAT_MODE    0x00000002
+#define GALAXY_STAT_INO     0x00000004
+#define GALAXY_STAT_DEV     0x00000008
+#define GALAXY_STAT_MTIME   0x00000010
+#define GALAXY_STAT_ALL     0x0000001f
+
+/* Length of the SHA-256 digest attached to the GAL_CLOSE_WRITE events of
+ * GAL_DIGEST watches. */
+#define GALAXY_DIGEST_LENGTH  32
+
+/* GAL_CHANGED watches learn of modifications when the file is closed:
+ * GAL_MODIFY is only set on the GAL_CLOSE_WRITE events of files whose
+ * size or contents differ from the last time they were closed, and
+ * close-writes of files rewritten with the same contents are dropped.
+ * Files written through a descriptor that is never closed aren't
+ * reported. */
+
+/* GAL_TAIL watches get the bytes appended to a file with its GAL_MODIFY
+ * events, read once by the daemon for all of them. The daemon keeps an
+ * offset per file: a file created, or moved into place by a rotation, is
+ * sent from its start, and one first seen at a modification from its end
+ * at that time. A file shorter than its offset was truncated and is sent
+ * from its start again. */
+#define GALAXY_TAIL_TRUNCATED  0x00000001  /* The file was truncated */
+#define GALAXY_TAIL_REPLACED   0x00000002  /* Another file is at the path */
+
+/* GAL_SUMMARY watches get one event per directory and interval (see
+ * galaxyd -a) in place of the events on its entries: the event names
+ * the directory, its mask is the union of theirs with GAL_ISDIR set,
+ * and it counts them per event bit. A sample of the names of the
+ * entries comes with it. An event on a directory itself is counted in
+ * its parent. */
+#define GALAXY_SUMMARY_BITS    16  /* Event bits counted: GAL_ACCESS to GAL_IGNORED */
+#define GALAXY_SUMMARY_SAMPLE  8   /* Most names sampled */
+
 /*
  * All of the events - we build the list by hand so that we can add flags in
  * the future and not break backward compatibility.  Apps will get only the
@@ -77,17 +146,102 @@
  */
 #define GAL_ALL_EVENTS (GAL_ACCESS | GAL_MODIFY | GAL_ATTRIB | \
 		GAL_CLOSE_WRITE | GAL_CLOSE_NOWRITE | GAL_OPEN | GAL_MOVED_FROM | \
-		GAL_MOVED_TO | GAL_DELETE | GAL_CREATE | GAL_DELETE_SELF)
+		GAL_MOVED_TO | GAL_DELETE | GAL_CREATE | GAL_DELETE_SELF | GAL_RESCAN)
 
 struct galaxy_t {
 	int fd;            /* Client side server end-point. */
 	char sname[4096];  /* Socket name. */
 };
 
+/* Crawl progress of one of the daemon's root directories. */
+#define GALAXY_CRAWL_RUNNING  0x00000001  /* A crawl is in progress */
+#define GALAXY_CRAWL_COVERED  0x00000002  /* Crawled completely */
+
+struct galaxy_crawl_status_t {
+	char *root;
+	uint32_t queued;    /* Directories found to crawl. */
+	uint32_t pending;   /* Found but not read yet. */
+	uint32_t scanned;   /* Read. */
+	uint32_t watched;   /* Given a watch. */
+	uint32_t failed;    /* Couldn't be read or watched. */
+	int32_t eta;        /* Seconds left; -1 if unknown. */
+	uint32_t flags;
+};
+
+/* Optional fields that may follow an event on the wire. Each one is
+ * sent as its tag and a length-prefixed value; receivers skip the tags
+ * they don't know. The list ends with GALAXY_FIELD_END. */
+#define GALAXY_FIELD_END       0
+#define GALAXY_FIELD_OLD_NAME  1  /* old_name, as a string */
+#define GALAXY_FIELD_STAMP     2  /* sequence, monotonic_ns and realtime_ns,
+                                     as three uint64_t */
+#define GALAXY_FIELD_STAT      3  /* stat, as six uint64_t in the order of
+                                     struct galaxy_stat_t */
+#define GALAXY_FIELD_DIGEST    4  /* digest, GALAXY_DIGEST_LENGTH bytes */
+#define GALAXY_FIELD_TAIL      5  /* tail_offset and tail_flags, as two
+                                     uint64_t */
+#define GALAXY_FIELD_TAIL_DATA 6  /* tail_data, tail_len bytes */
+#define GALAXY_FIELD_SUMMARY   7  /* summary_events, summary_first_ns,
+                                     summary_last_ns and summary_counts,
+                                     as uint64_t */
+#define GALAXY_FIELD_SUMMARY_NAMES 8  /* summary_names, summary_names_len
+                                         bytes */
+
+/* Longest value of an optional field; receivers give up on the event
+ * past it. The bytes a GAL_TAIL event carries are the longest. */
+#define GALAXY_FIELD_MAX  (16 * 1024 * 1024)
+
+/* Taken by the daemon once per event, right after it read the event. A
+ * file that is gone by then has no fields. */
+struct galaxy_stat_t {
+	uint32_t fields;    /* GALAXY_STAT_* bits of the fields that are set. */
+	uint32_t mode;
+	uint64_t size;
+	uint64_t ino;
+	uint64_t dev;
+	int64_t mtime_ns;
+};
+
 struct galaxy_event_t {
 	uint32_t mask;
 	time_t timestamp;
 	char *name;
+	pid_t pid;         /* Process that caused the event; 0 if unknown. */
+	char *old_name;    /* Set on a rename (GAL_MOVE): the old path. */
+
+	/* Stamped by the daemon when it read the event from the kernel;
+	 * zero from daemons that don't. Sequence numbers grow with every
+	 * event the daemon reads, so a client only sees some of them. */
+	uint64_t sequence;
+	uint64_t monotonic_ns;  /* CLOCK_MONOTONIC */
+	uint64_t realtime_ns;   /* CLOCK_REALTIME */
+
+	struct galaxy_stat_t stat;  /* For GAL_STAT watches. */
+
+	/* For GAL_DIGEST watches: the SHA-256 of the file's contents as of
+	 * the close-write, if it could be read. */
+	uint32_t digest_len;    /* 0 or GALAXY_DIGEST_LENGTH */
+	unsigned char digest[GALAXY_DIGEST_LENGTH];
+
+	/* For GAL_TAIL watches: the `tail_len' bytes found at `tail_offset'
+	 * of the file, appended since the last event that carried some. */
+	uint64_t tail_offset;
+	uint32_t tail_flags;    /* GALAXY_TAIL_* */
+	uint32_t tail_len;
+	char *tail_data;
+
+	/* For GAL_SUMMARY watches: the `summary_events' events on the
+	 * entries of the directory over an interval, summary_counts[i] of
+	 * them with bit i of the mask set. */
+	uint32_t summary_events;
+	uint32_t summary_counts[GALAXY_SUMMARY_BITS];
+	uint64_t summary_first_ns;  /* CLOCK_REALTIME */
+	uint64_t summary_last_ns;
+	/* Names of some of the entries, one after the other, each ending
+	 * with a NUL. */
+	uint32_t summary_nnames;
+	uint32_t summary_names_len;
+	char *summary_names;
 };
 
 /* Galaxy event creation/destroy functions. */
@@ -104,11 +258,26 @@ int galaxy_send_server_command(const struct galaxy_t *galaxy,
 	galaxy_cmd_t command, uint32_t mask, const char *regexp);
 struct galaxy_event_t *galaxy_receive(struct galaxy_t *galaxy);
 
+/* Crawl coverage. */
+int galaxy_wait_ready(const struct galaxy_t *galaxy, const char *prefix,
+	uint32_t timeout);
+int galaxy_crawl_status(const struct galaxy_t *galaxy,
+	struct galaxy_crawl_status_t **status);
+void galaxy_free_crawl_status(struct galaxy_crawl_status_t *status, int n);
+
 #define galaxy_watch(galaxy, mask, regexp) \
 	galaxy_send_server_command(galaxy, GALAXY_WATCH, mask, regexp)
 #define galaxy_ignore_mask(galaxy, mask) \
 	galaxy_send_server_command(galaxy, GALAXY_IGNORE_MASK, mask, NULL)
 #define galaxy_ignore_watch(galaxy, mask, regexp) \
 	galaxy_send_server_command(galaxy, GALAXY_IGNORE_WATCH, mask, regexp)
+/* Quiet period, in milliseconds, of the GAL_SETTLE watches (200 by
+ * default). */
+#define galaxy_settle_period(galaxy, msecs) \
+	galaxy_send_server_command(galaxy, GALAXY_SETTLE_PERIOD, msecs, NULL)
+/* GALAXY_STAT_* fields wanted by the GAL_STAT watches (all of them by
+ * default). */
+#define galaxy_stat_fields(galaxy, fields) \
+	galaxy_send_server_command(galaxy, GALAXY_STAT_FIELDS, fields, NULL)
 
 #endif
@@ -52,6 +52,8 @@
 #  include <sys/socket.h>
 #endif
 
+#include <sys/sendfile.h>
+
 #if HAVE_SYS_UN_H
 #  include <sys/un.h>
 #endif
@@ -416,7 +418,92 @@ errout:
 }
 
 /*
- * Sends the internals of a galaxy event across a network connection.
+ * Sends one of the optional fields of a galaxy event (see GALAXY_FIELD_*
+ * in galaxy.h): its tag, the length of its value and the value.
+ *
+ * Return Value:
+ *   On success, zero is returned. On error, a negative int is returned.
+ *
+ * Errors:
+ *   NETWORK_ERROR_NET_SEND_UINT32
+ *     The network function net_send_uint32() failed.
+ *   NETWORK_ERROR_WRITE
+ *     The system call write(2) has failed. errno will retain the error
+ *     code of write(2).
+ *   NETWORK_ERROR_PARTIAL_WRITE
+ *     The system call write(2) only wrote part of the value.
+ */
+int
+net_send_field(int fd, uint32_t tag, const void *value, uint32_t len)
+{
+	ssize_t bytes;
+
+	if (net_send_uint32(fd, tag) < 0 || net_send_uint32(fd, len) < 0)
+		return NETWORK_ERROR_NET_SEND_UINT32;
+
+	bytes = write(fd, value, len);
+	if (bytes == -1) {
+		err_write(errno);
+		err_msg("error[net_send_field]: Unable to write to socket.\n");
+		return NETWORK_ERROR_WRITE;
+	} else if (bytes != len) {
+		err_msg("error[net_send_field]: Wrote %d bytes of %d total bytes.\n",
+			bytes, len);
+		return NETWORK_ERROR_PARTIAL_WRITE;
+	}
+
+	return 0;
+}
+
+/*
+ * Sends an optional field whose value is the `len' bytes at `offset' of
+ * the file `file_fd', copied by the kernel without going through a
+ * buffer. The length is sent first, so a file that shrinks while it is
+ * being sent has the rest of its value padded with zeros.
+ *
+ * Return Value:
+ *   On success, zero is returned. On error, a negative int is returned.
+ *
+ * Errors:
+ *   NETWORK_ERROR_NET_SEND_UINT32
+ *     The network function net_send_uint32() failed.
+ *   NETWORK_ERROR_WRITE
+ *     The system call sendfile(2) or write(2) has failed. errno will
+ *     retain its error code.
+ */
+int
+net_send_file_field(int fd, uint32_t tag, int file_fd, uint64_t offset,
+	uint32_t len)
+{
+	static const char zeros[4096];
+	off_t off = offset;
+	ssize_t bytes;
+
+	if (net_send_uint32(fd, tag) < 0 || net_send_uint32(fd, len) < 0)
+		return NETWORK_ERROR_NET_SEND_UINT32;
+
+	while (len > 0) {
+		bytes = sendfile(fd, file_fd, &off, len);
+		if (bytes == 0)
+			bytes = write(fd, zeros, len < sizeof(zeros) ? len : sizeof(zeros));
+		if (bytes == -1 && errno == EINTR)
+			continue;
+		if (bytes == -1) {
+			err_write(errno);
+			err_msg("error[net_send_file_field]: Unable to write to socket.\n");
+			return NETWORK_ERROR_WRITE;
+		}
+		len -= bytes;
+	}
+
+	return 0;
+}
+
+/*
+ * Sends the internals of a galaxy event across a network connection:
+ * the mask, the filename and the pid, followed by the optional fields
+ * the event has (see GALAXY_FIELD_* in galaxy.h). The timestamp is not
+ * sent; the receiver stamps the event itself.
  *
  * Return Value:
  *   On success, zero is returned. On error, a negative int is returned.
@@ -428,7 +515,19 @@ errout:
  *     The network function net_send_string() failed.
  */
 int
-net_send_galaxy_event(int fd, const char *filename, uint32_t mask)
+net_send_galaxy_event(int fd, const struct galaxy_event_t *gevent)
+{
+	return net_send_galaxy_event_tail(fd, gevent, -1);
+}
+
+/*
+ * Like net_send_galaxy_event(), for events carrying bytes appended to a
+ * file (GAL_TAIL): unless `file_fd' is -1, the tail_len bytes are sent
+ * straight from that file, at tail_offset, instead of from tail_data.
+ */
+int
+net_send_galaxy_event_tail(int fd, const struct galaxy_event_t *gevent,
+	int file_fd)
 {
 	int err;
 
@@ -439,20 +538,119 @@ net_send_galaxy_event(int fd, const char *filename, uint32_t mask)
 		return NETWORK_ERROR_NET_SEND_UINT32;
 	}
 
-	err = net_send_uint32(fd, mask);
+	err = net_send_uint32(fd, gevent->mask);
 	if (err < 0) {
 		err_net_send_uint32(err);
 		err_msg("error[net_send_galaxy_event]: Unable to send string length.\n");
 		return NETWORK_ERROR_NET_SEND_UINT32;
 	}
 
-	err = net_send_string(fd, filename);
+	err = net_send_string(fd, gevent->name);
 	if (err < 0) {
 		err_net_send_string(err);
 		err_msg("error[net_send_galaxy_event]: Unable to send string.\n");
 		return NETWORK_ERROR_NET_SEND_STRING;
 	}
 
+	err = net_send_uint32(fd, gevent->pid);
+	if (err < 0) {
+		err_net_send_uint32(err);
+		err_msg("error[net_send_galaxy_event]: Unable to send pid.\n");
+		return NETWORK_ERROR_NET_SEND_UINT32;
+	}
+
+	if (gevent->old_name != NULL) {
+		err = net_send_field(fd, GALAXY_FIELD_OLD_NAME, gevent->old_name,
+			strlen(gevent->old_name) + 1);
+		if (err < 0) {
+			err_msg("error[net_send_galaxy_event]: Unable to send old name.\n");
+			return err;
+		}
+	}
+
+	if (gevent->sequence != 0) {
+		uint64_t stamp[3];
+
+		stamp[0] = gevent->sequence;
+		stamp[1] = gevent->monotonic_ns;
+		stamp[2] = gevent->realtime_ns;
+		err = net_send_field(fd, GALAXY_FIELD_STAMP, stamp, sizeof(stamp));
+		if (err < 0) {
+			err_msg("error[net_send_galaxy_event]: Unable to send stamp.\n");
+			return err;
+		}
+	}
+
+	if (gevent->stat.fields != 0) {
+		uint64_t stat[6];
+
+		stat[0] = gevent->stat.fields;
+		stat[1] = gevent->stat.mode;
+		stat[2] = gevent->stat.size;
+		stat[3] = gevent->stat.ino;
+		stat[4] = gevent->stat.dev;
+		stat[5] = gevent->stat.mtime_ns;
+		err = net_send_field(fd, GALAXY_FIELD_STAT, stat, sizeof(stat));
+		if (err < 0) {
+			err_msg("error[net_send_galaxy_event]: Unable to send stat.\n");
+			return err;
+		}
+	}
+
+	if (gevent->digest_len != 0) {
+		err = net_send_field(fd, GALAXY_FIELD_DIGEST, gevent->digest,
+			gevent->digest_len);
+		if (err < 0) {
+			err_msg("error[net_send_galaxy_event]: Unable to send digest.\n");
+			return err;
+		}
+	}
+
+	if (gevent->tail_len != 0 || gevent->tail_flags != 0) {
+		uint64_t tail[2];
+
+		tail[0] = gevent->tail_offset;
+		tail[1] = gevent->tail_flags;
+		err = net_send_field(fd, GALAXY_FIELD_TAIL, tail, sizeof(tail));
+		if (err == 0 && file_fd >= 0)
+			err = net_send_file_field(fd, GALAXY_FIELD_TAIL_DATA, file_fd,
+				gevent->tail_offset, gevent->tail_len);
+		else if (err == 0 && gevent->tail_data != NULL)
+			err = net_send_field(fd, GALAXY_FIELD_TAIL_DATA,
+				gevent->tail_data, gevent->tail_len);
+		if (err < 0) {
+			err_msg("error[net_send_galaxy_event]: Unable to send tail.\n");
+			return err;
+		}
+	}
+
+	if (gevent->summary_events != 0) {
+		uint64_t summary[3 + GALAXY_SUMMARY_BITS];
+		int i;
+
+		summary[0] = gevent->summary_events;
+		summary[1] = gevent->summary_first_ns;
+		summary[2] = gevent->summary_last_ns;
+		for (i = 0; i < GALAXY_SUMMARY_BITS; i++)
+			summary[3 + i] = gevent->summary_counts[i];
+		err = net_send_field(fd, GALAXY_FIELD_SUMMARY, summary,
+			sizeof(summary));
+		if (err == 0 && gevent->summary_names_len != 0)
+			err = net_send_field(fd, GALAXY_FIELD_SUMMARY_NAMES,
+				gevent->summary_names, gevent->summary_names_len);
+		if (err < 0) {
+			err_msg("error[net_send_galaxy_event]: Unable to send summary.\n");
+			return err;
+		}
+	}
+
+	err = net_send_uint32(fd, GALAXY_FIELD_END);
+	if (err < 0) {
+		err_net_send_uint32(err);
+		err_msg("error[net_send_galaxy_event]: Unable to send end of fields.\n");
+		return NETWORK_ERROR_NET_SEND_UINT32;
+	}
+
 	return 0;
 }
 
@@ -561,6 +759,61 @@ errout:
 	return NULL;
 }
 
+/*
+ * Receives one of the optional fields of a galaxy event, as sent by
+ * net_send_field(). Memory for the value is obtained with malloc(3); a
+ * '\0' is added after it, so string values can be used as they are.
+ *
+ * Return Value:
+ *   Returns the value, with its tag in `tag' and its length in `len'.
+ *   Returns NULL at the end of the fields (GALAXY_FIELD_END or the end
+ *   of the connection) and on errors.
+ */
+void *
+net_recv_field(int fd, uint32_t *tag, uint32_t *len)
+{
+	char *value;
+	ssize_t bytes;
+	uint32_t done;
+
+	/* Older daemons close the connection instead of ending the list. */
+	if (read(fd, tag, sizeof(*tag)) != sizeof(*tag) ||
+	    *tag == GALAXY_FIELD_END)
+		return NULL;
+	if (net_recv_uint32(fd, len) < 0)
+		return NULL;
+	/* The rest of the event is left unread; the connection carries
+	 * only this one and is closed after it. */
+	if (*len > GALAXY_FIELD_MAX) {
+		err_msg("error[net_recv_field]: Field of %u bytes is too long.\n", *len);
+		return NULL;
+	}
+
+	value = malloc(*len + 1);
+	if (value == NULL) {
+		err_malloc(errno);
+		err_msg("error[net_recv_field]: Unable to allocate a field of %u bytes.\n",
+			*len);
+		return NULL;
+	}
+	/* Large values (GALAXY_FIELD_TAIL_DATA) take more than one read. */
+	for (done = 0; done < *len; done += bytes) {
+		bytes = read(fd, value + done, *len - done);
+		if (bytes == -1 && errno == EINTR) {
+			bytes = 0;
+			continue;
+		}
+		if (bytes <= 0) {
+			err_msg("error[net_recv_field]: Read a partial field.\n");
+			free(value);
+			return NULL;
+		}
+	}
+	value[*len] = '\0';
+
+	return value;
+}
+
 /*
  * Receives a galaxy event from a socket connection.
  *
@@ -581,6 +834,10 @@ int
 net_recv_galaxy_event(int fd, struct galaxy_event_t *gevent)
 {
 	int cmd, err;
+	uint32_t pid, tag, len;
+	char *value;
+	uint64_t stamp[3], stat[6], tail[2], summary[3 + GALAXY_SUMMARY_BITS];
+	uint32_t i;
 
 	err = net_recv_uint32(fd, &cmd);
 	if (err < 0) {
@@ -608,6 +865,85 @@ net_recv_galaxy_event(int fd, struct galaxy_event_t *gevent)
 		return NETWORK_ERROR_NET_RECV_STRING;
 	}
 
+	/* Older daemons close the connection without sending a pid or any
+	 * of the optional fields. */
+	if (read(fd, &pid, sizeof(pid)) == sizeof(pid))
+		gevent->pid = pid;
+
+	/* Every optional field is a tag and a length-prefixed value, so the
+	 * ones this library doesn't know are skipped. */
+	while ((value = net_recv_field(fd, &tag, &len)) != NULL) {
+		switch (tag) {
+			case GALAXY_FIELD_OLD_NAME:
+				free(gevent->old_name);
+				gevent->old_name = value;
+				value = NULL;
+				break;
+			case GALAXY_FIELD_STAMP:
+				if (len < sizeof(stamp))
+					break;
+				memcpy(stamp, value, sizeof(stamp));
+				gevent->sequence = stamp[0];
+				gevent->monotonic_ns = stamp[1];
+				gevent->realtime_ns = stamp[2];
+				break;
+			case GALAXY_FIELD_STAT:
+				if (len < sizeof(stat))
+					break;
+				memcpy(stat, value, sizeof(stat));
+				gevent->stat.fields = stat[0];
+				gevent->stat.mode = stat[1];
+				gevent->stat.size = stat[2];
+				gevent->stat.ino = stat[3];
+				gevent->stat.dev = stat[4];
+				gevent->stat.mtime_ns = stat[5];
+				break;
+			case GALAXY_FIELD_DIGEST:
+				if (len != GALAXY_DIGEST_LENGTH)
+					break;
+				memcpy(gevent->digest, value, len);
+				gevent->digest_len = len;
+				break;
+			case GALAXY_FIELD_TAIL:
+				if (len < sizeof(tail))
+					break;
+				memcpy(tail, value, sizeof(tail));
+				gevent->tail_offset = tail[0];
+				gevent->tail_flags = tail[1];
+				break;
+			case GALAXY_FIELD_TAIL_DATA:
+				free(gevent->tail_data);
+				gevent->tail_data = value;
+				gevent->tail_len = len;
+				value = NULL;
+				break;
+			case GALAXY_FIELD_SUMMARY:
+				if (len < sizeof(summary))
+					break;
+				memcpy(summary, value, sizeof(summary));
+				gevent->summary_events = summary[0];
+				gevent->summary_first_ns = summary[1];
+				gevent->summary_last_ns = summary[2];
+				for (i = 0; i < GALAXY_SUMMARY_BITS; i++)
+					gevent->summary_counts[i] = summary[3 + i];
+				break;
+			case GALAXY_FIELD_SUMMARY_NAMES:
+				free(gevent->summary_names);
+				gevent->summary_names = value;
+				gevent->summary_names_len = len;
+				gevent->summary_nnames = 0;
+				for (i = 0; i < len; i++) {
+					if (value[i] == '\0')
+						gevent->summary_nnames++;
+				}
+				value = NULL;
+				break;
+			default:
+				break;
+		}
+		free(value);
+	}
+
 	gevent->timestamp = time(NULL);
 
 	return 0;
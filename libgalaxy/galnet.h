@@ -61,9 +61,15 @@ int serv_accept(int listenfd, uid_t *uidptr);
 int cli_conn(const char *name);
 int net_send_uint32(int fd, const uint32_t uint);
 int net_send_string(int fd, const char *string);
-int net_send_galaxy_event(int fd, const char *filename, uint32_t mask);
+int net_send_field(int fd, uint32_t tag, const void *value, uint32_t len);
+int net_send_file_field(int fd, uint32_t tag, int file_fd, uint64_t offset,
+	uint32_t len);
+int net_send_galaxy_event(int fd, const struct galaxy_event_t *gevent);
+int net_send_galaxy_event_tail(int fd, const struct galaxy_event_t *gevent,
+	int file_fd);
 int net_recv_uint32(int fd, uint32_t *retval);
 char *net_recv_string(int fd);
+void *net_recv_field(int fd, uint32_t *tag, uint32_t *len);
 int net_recv_galaxy_event(int fd, struct galaxy_event_t *gevent);
 
 void err_serv_listen(int err);
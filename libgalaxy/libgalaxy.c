@@ -64,6 +64,24 @@ create_galaxy_event(void)
 
 	gevent->mask = 0;
 	gevent->name = NULL;
+	gevent->pid = 0;
+	gevent->old_name = NULL;
+	gevent->sequence = 0;
+	gevent->monotonic_ns = 0;
+	gevent->realtime_ns = 0;
+	memset(&gevent->stat, 0, sizeof(gevent->stat));
+	gevent->digest_len = 0;
+	gevent->tail_offset = 0;
+	gevent->tail_flags = 0;
+	gevent->tail_len = 0;
+	gevent->tail_data = NULL;
+	gevent->summary_events = 0;
+	memset(gevent->summary_counts, 0, sizeof(gevent->summary_counts));
+	gevent->summary_first_ns = 0;
+	gevent->summary_last_ns = 0;
+	gevent->summary_nnames = 0;
+	gevent->summary_names_len = 0;
+	gevent->summary_names = NULL;
 
 	return gevent;
 }
@@ -77,6 +95,12 @@ destroy_galaxy_event(void *ptr)
 
 	if (gevent->name != NULL)
 		free(gevent->name);
+	if (gevent->old_name != NULL)
+		free(gevent->old_name);
+	if (gevent->tail_data != NULL)
+		free(gevent->tail_data);
+	if (gevent->summary_names != NULL)
+		free(gevent->summary_names);
 	free(gevent);
 }
 
@@ -214,6 +238,52 @@ end:
 	return gevent;
 }
 
+/*
+ * Opens a connection to the galaxy daemon and sends it a command (see
+ * galaxy_send_server_command()). The connection is left open for
+ * commands that get a reply.
+ *
+ * Return Value:
+ *   Returns the connected socket, or a negative value on error.
+ */
+static int
+open_server_command(const struct galaxy_t *galaxy, galaxy_cmd_t command,
+	uint32_t mask, const char *regexp)
+{
+	int connfd, err;
+
+	/* Get a client connection to the given galaxy socket name. */
+	connfd = cli_conn(galaxy->sname);
+	if (connfd < 0) {
+		err_msg("error[open_server_command]: Unable to obtain client connection.\n");
+		return NETWORK_ERROR_CLI_CONN;
+	}
+
+	/* Send command number. */
+	err = net_send_uint32(connfd, command);
+	if (err < 0)
+		goto end;
+
+	/* Send the Inotify mask. */
+	err = net_send_uint32(connfd, mask);
+	if (err < 0)
+		goto end;
+
+	/* Send the string data. It is possible to have a NULL value for the
+	 * string to send. Check for this explicitly and skip if it is NULL. */
+	if (regexp) {
+		err = net_send_string(connfd, regexp);
+		if (err < 0)
+			goto end;
+	}
+
+	return connfd;
+
+end:
+	close(connfd);
+	return err;
+}
+
 /*
  * This function will notify the galaxy daemon to watch for the given
  * files/directories as specified by the regular expression.
@@ -243,35 +313,125 @@ end:
 int
 galaxy_send_server_command(const struct galaxy_t *galaxy,
 	galaxy_cmd_t command, uint32_t mask, const char *regexp)
+{
+	int connfd;
+
+	connfd = open_server_command(galaxy, command, mask, regexp);
+	if (connfd < 0)
+		return connfd;
+	close(connfd);
+
+	return 0;
+}
+
+/*
+ * Blocks until the galaxy daemon has crawled every directory under
+ * `prefix' that its clients are interested in, i.e. until events for
+ * that part of the file system are no longer missed. Subscribe first
+ * with galaxy_watch(), then wait.
+ *
+ * Parameters:
+ *   galaxy: The galaxy_t descriptor created by galaxy_connect().
+ *   prefix: An absolute path, e.g. one of the daemon's root directories.
+ *   timeout: The most seconds to wait, or 0 to wait for as long as it
+ *     takes.
+ *
+ * Return Value:
+ *   Returns 1 when `prefix' is covered, and zero when the timeout ran
+ *   out or `prefix' is not under any of the daemon's root directories.
+ *   Returns a negative value on network errors.
+ */
+int
+galaxy_wait_ready(const struct galaxy_t *galaxy, const char *prefix,
+	uint32_t timeout)
 {
 	int connfd, err;
+	uint32_t ack;
 
-	/* Get a client connection to the given galaxy socket name. */
-	connfd = cli_conn(galaxy->sname);
-	if (connfd < 0) {
-		err_msg("error[galaxy_send_server_command]: Unable to obtain client connection.\n");
-		return NETWORK_ERROR_CLI_CONN;
-	}
+	connfd = open_server_command(galaxy, GALAXY_WAIT_READY, timeout, prefix);
+	if (connfd < 0)
+		return connfd;
 
-	/* Send command number. */
-	err = net_send_uint32(connfd, command);
+	err = net_recv_uint32(connfd, &ack);
+	close(connfd);
 	if (err < 0)
-		goto end;
+		return err;
 
-	/* Send the Inotify mask. */
-	err = net_send_uint32(connfd, mask);
+	return ack == ACK_SUCCESS;
+}
+
+/*
+ * Asks the galaxy daemon how far it got crawling each of its root
+ * directories. The array returned in `status' must be released with
+ * galaxy_free_crawl_status().
+ *
+ * Return Value:
+ *   Returns the number of roots, or a negative value on error.
+ */
+int
+galaxy_crawl_status(const struct galaxy_t *galaxy,
+	struct galaxy_crawl_status_t **status)
+{
+	int connfd, err;
+	uint32_t n, i, eta;
+	struct galaxy_crawl_status_t *s;
+
+	*status = NULL;
+	connfd = open_server_command(galaxy, GALAXY_CRAWL_STATUS, 0, NULL);
+	if (connfd < 0)
+		return connfd;
+
+	err = net_recv_uint32(connfd, &n);
 	if (err < 0)
 		goto end;
 
-	/* Send the string data. It is possible to have a NULL value for the
-	 * string to send. Check for this explicitly and skip if it is NULL. */
-	if (regexp) {
-		err = net_send_string(connfd, regexp);
-		if (err < 0)
-			goto end;
+	*status = calloc(n > 0 ? n : 1, sizeof(struct galaxy_crawl_status_t));
+	if (*status == NULL) {
+		err_malloc(errno);
+		err_msg("error[galaxy_crawl_status]: Unable to malloc crawl status.\n");
+		err = NETWORK_ERROR_MALLOC;
+		goto end;
 	}
 
+	for (i = 0; i < n; i++) {
+		s = &(*status)[i];
+		s->root = net_recv_string(connfd);
+		if (s->root == NULL) {
+			err = NETWORK_ERROR_NET_RECV_STRING;
+			break;
+		}
+		if ((err = net_recv_uint32(connfd, &s->queued)) < 0 ||
+		    (err = net_recv_uint32(connfd, &s->pending)) < 0 ||
+		    (err = net_recv_uint32(connfd, &s->scanned)) < 0 ||
+		    (err = net_recv_uint32(connfd, &s->watched)) < 0 ||
+		    (err = net_recv_uint32(connfd, &s->failed)) < 0 ||
+		    (err = net_recv_uint32(connfd, &eta)) < 0 ||
+		    (err = net_recv_uint32(connfd, &s->flags)) < 0)
+			break;
+		s->eta = (int32_t)eta;
+	}
+	if (err < 0) {
+		galaxy_free_crawl_status(*status, n);
+		*status = NULL;
+		goto end;
+	}
+
+	close(connfd);
+	return n;
+
 end:
 	close(connfd);
 	return err;
 }
+
+void
+galaxy_free_crawl_status(struct galaxy_crawl_status_t *status, int n)
+{
+	int i;
+
+	if (status == NULL)
+		return;
+	for (i = 0; i < n; i++)
+		free(status[i].root);
+	free(status);
+}